@@ -29,7 +29,7 @@
 #include <limits.h>
 #include <string.h>
 #include <unistd.h>		/* getpid(), alarm() */
-#include <sys/select.h>
+#include <poll.h>		/* poll() */
 #include <signal.h>		/* sig_atomic_t */
 
 #include "negotiate.h"		/* read/write_message_block(),
@@ -159,6 +159,57 @@ is_ready(int i, struct dgsh_negotiation *mb)
 	return ready;
 }
 
+/*
+ * Return true if the message block carries one of the negotiation's
+ * final states, which must pass once through each port.
+ */
+STATIC bool
+is_final(struct dgsh_negotiation *mb)
+{
+	return mb->state == PS_RUN || mb->state == PS_DRAW_EXIT ||
+		(mb->state == PS_ERROR && mb->is_error_confirmed);
+}
+
+/*
+ * Have an output concentrator pass a final message block to all its
+ * output ports at once, rather than around the ring, so that a branch
+ * can leave the negotiation without waiting for the preceding ones.
+ * The ports share the block.
+ */
+STATIC void
+fan_out(struct dgsh_negotiation *mb)
+{
+	int i;
+
+	for (i = STDOUT_FILENO; i < nfd; i == STDOUT_FILENO ? i = FREE_FILENO : i++)
+		if (!pi[i].written && pi[i].to_write == NULL)
+			pi[i].to_write = mb;
+}
+
+/* Return true if the message block is still to be written to a port */
+STATIC bool
+is_pending(struct dgsh_negotiation *mb)
+{
+	int i;
+
+	for (i = 0; i < nfd; i++)
+		if (pi[i].to_write == mb)
+			return true;
+	return false;
+}
+
+/*
+ * Keep the specified final message block for use after the negotiation,
+ * freeing the one kept until now, unless it is still to be written.
+ */
+STATIC void
+keep_final(struct dgsh_negotiation *mb)
+{
+	if (chosen_mb != NULL && chosen_mb != mb && !is_pending(chosen_mb))
+		free_mb(chosen_mb);
+	chosen_mb = mb;
+}
+
 /**
  * Register current concentrator to message block's
  * concentrator array
@@ -175,6 +226,7 @@ set_io_channels(struct dgsh_negotiation *mb)
 	c.output_fds = -1;
 	c.n_proc_pids = (nfd > 2 ? nfd - 2 : 1);
 	c.multiple_inputs = multiple_inputs;
+	c.position = graph_position();
 	c.proc_pids = (int *)malloc(sizeof(int) * c.n_proc_pids);
 	int j = 0, i;
 
@@ -240,7 +292,24 @@ print_state(int i, int var, int pcase)
 	}
 }
 
-#define max(a, b) ((a) > (b) ? (a) : (b))
+/*
+ * Set the poll(2) events of port i according to the work pending on it.
+ * Ports without pending work get a negative fd, which poll(2) ignores.
+ */
+static void
+set_port_events(struct pollfd *pfd, int i)
+{
+	pfd[i].fd = i;
+	pfd[i].events = 0;
+	if (!(noinput && i == STDIN_FILENO) && i != STDERR_FILENO) {
+		if (!pi[i].seen)
+			pfd[i].events |= POLLIN;
+		if (pi[i].to_write && !pi[i].written)
+			pfd[i].events |= POLLOUT;
+	}
+	if (pfd[i].events == 0)
+		pfd[i].fd = -1;
+}
 
 /*
  * Pass around the message blocks so that they reach all processes
@@ -249,8 +318,9 @@ print_state(int i, int var, int pcase)
 STATIC int
 pass_message_blocks(void)
 {
-	fd_set readfds, writefds;
-	int nfds = 0;
+	struct pollfd *pfd;	/* Indexed by port */
+	int nready;		/* Ports with pending events */
+	int n_run_ready = 0;	/* Ports whose processes can run */
 	int i;
 	int oi = -1;		/* scatter/gather block's origin index */
 	int ofd = -1;		/* ... origin fd direction */
@@ -270,75 +340,84 @@ pass_message_blocks(void)
 		pi[STDOUT_FILENO].to_write = chosen_mb;
 	}
 
-	for (;;) {
-		// Create select(2) masks
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-		for (i = 0; i < nfd; i++) {
-			if (noinput && i == STDIN_FILENO)
-				continue;
-			if (i == STDERR_FILENO)
-				continue;
-			if (!pi[i].seen) {
-				FD_SET(i, &readfds);
-				nfds = max(i + 1, nfds);
-			}
-			if (pi[i].to_write && !pi[i].written) {
-				FD_SET(i, &writefds);
-				nfds = max(i + 1, nfds);
-				pi[i].to_write->is_origin_conc = true;
-				pi[i].to_write->conc_pid = pid;
-				DPRINTF(4, "Actual origin: conc with pid %d", pid);
-			}
-		}
+	pfd = (struct pollfd *)calloc(nfd, sizeof(struct pollfd));
+	if (pfd == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nfd; i++)
+		set_port_events(pfd, i);
 
+	for (;;) {
 	again:
-		if (select(nfds, &readfds, &writefds, NULL, NULL) < 0) {
+		if ((nready = poll(pfd, nfd, -1)) < 0) {
 			if (errno == EINTR)
 				goto again;
 			/* All other cases are internal errors. */
-			err(1, "select");
+			err(1, "poll");
 		}
 
 		// Read/write what we can
-		for (i = 0; i < nfd; i++) {
-			if (FD_ISSET(i, &writefds)) {
+		for (i = 0; nready > 0 && i < nfd; i++) {
+			short ready = pfd[i].revents;
+			int next = i;
+
+			if (ready == 0)
+				continue;
+			nready--;
+			/* Hang-ups and errors surface through the read or write */
+			if (ready & (POLLERR | POLLHUP | POLLNVAL))
+				ready |= pfd[i].events;
+			if (ready & POLLOUT) {
 				iswrite = true;
 				assert(pi[i].to_write);
 				chosen_mb = pi[i].to_write;
+				chosen_mb->is_origin_conc = true;
+				chosen_mb->conc_pid = pid;
+				DPRINTF(4, "Actual origin: conc with pid %d", pid);
 				DPRINTF(4, "**fd i: %d set for writing to tool with pid %d", i, pi[i].pid);
 				write_message_block(i); // XXX check return
 
-				if (pi[i].to_write->state == PS_RUN ||
-					pi[i].to_write->state == PS_DRAW_EXIT ||
-					(pi[i].to_write->state == PS_ERROR &&
-						pi[i].to_write->is_error_confirmed))
+				if (is_final(pi[i].to_write))
 					pi[i].written = true;
 
 				// Write side exit
-				if (is_ready(i, pi[i].to_write)) {
+				if (is_ready(i, pi[i].to_write) &&
+						!pi[i].run_ready) {
 					pi[i].run_ready = true;
+					n_run_ready++;
 					DPRINTF(4, "**%s(): pi[%d] is run ready",
 							__func__, i);
 				}
 				pi[i].to_write = NULL;
 			}
-			if (FD_ISSET(i, &readfds)) {
+			if (ready & POLLIN) {
 				struct dgsh_negotiation *rb;
+				bool drop;	/* Whether rb is not passed on */
 				ro = false;
-				int next = next_fd(i, &ro);
+				next = next_fd(i, &ro);
 
 				assert(!pi[i].run_ready);
-				assert(pi[next].to_write == NULL);
-				if (read_message_block(i, &pi[next].to_write) ==
-								OP_ERROR) {
+				if (read_message_block(i, &rb) == OP_ERROR) {
 					chosen_mb->state = PS_ERROR;
 					if (noinput)
 						chosen_mb->is_error_confirmed = true;
 					pi[next].to_write = chosen_mb;
+					set_port_events(pfd, next);
 					continue;
 				}
-				rb = pi[next].to_write;
+
+				/*
+				 * A final block returning from a branch
+				 * that got it through fan_out() is not
+				 * passed on to the next branch, which
+				 * has also got it.
+				 */
+				drop = !multiple_inputs && is_final(rb) &&
+					(pi[next].written ||
+					 pi[next].to_write != NULL);
+				if (!drop) {
+					assert(pi[next].to_write == NULL);
+					pi[next].to_write = rb;
+				}
 
 				DPRINTF(4, "%s(): next write via fd %d to pid %d",
 						__func__, next, pi[next].pid);
@@ -369,16 +448,16 @@ pass_message_blocks(void)
 				if (ro) {
 					DPRINTF(4, "**Restore origin: %d, fd: %s",
 							oi, ofd ? "stdout" : "stdin");
-					pi[next].to_write->origin_index = oi;
-					pi[next].to_write->origin_fd_direction = ofd;
+					rb->origin_index = oi;
+					rb->origin_fd_direction = ofd;
 				} else if (noinput) {
-					pi[next].to_write->origin_index = -1;
-					pi[next].to_write->origin_fd_direction = STDOUT_FILENO;
+					rb->origin_index = -1;
+					rb->origin_fd_direction = STDOUT_FILENO;
 				}
 
 				/* Set a conc's required/provided IO in mb */
 				if (!noinput)
-					set_io_channels(pi[next].to_write);
+					set_io_channels(rb);
 
 				if (rb->state == PS_NEGOTIATION &&
 						noinput) {
@@ -393,55 +472,66 @@ pass_message_blocks(void)
 						DPRINTF(1, "%s(): Gathered I/O requirements.", __func__);
 						int state = solve_graph();
 						if (state == OP_ERROR) {
-							pi[next].to_write->state = PS_ERROR;
-							pi[next].to_write->is_error_confirmed = true;
+							rb->state = PS_ERROR;
+							rb->is_error_confirmed = true;
 						} else if (state == OP_DRAW_EXIT)
-							pi[next].to_write->state = PS_DRAW_EXIT;
+							rb->state = PS_DRAW_EXIT;
 						else {
 							DPRINTF(1, "%s(): Computed solution", __func__);
-							pi[next].to_write->state = PS_RUN;
+							rb->state = PS_RUN;
 						}
-						for (j = 1; j < nfd; j++)
+						fan_out(rb);
+						for (j = 1; j < nfd; j++) {
 							pi[j].seen = false;
+							set_port_events(pfd, j);
+						}
 						// Don't free
 						chosen_mb = NULL;
 					}
-				} else if (rb->state == PS_RUN ||
-						rb->state == PS_DRAW_EXIT ||
-						(rb->state == PS_ERROR &&
-						rb->is_error_confirmed))
+				} else if (is_final(rb)) {
 					pi[i].seen = true;
-				else if (rb->state == PS_ERROR)
+					if (!multiple_inputs && i == STDIN_FILENO) {
+						int j;
+
+						fan_out(rb);
+						for (j = FREE_FILENO; j < nfd; j++)
+							set_port_events(pfd, j);
+					}
+				} else if (rb->state == PS_ERROR)
 					rb->is_error_confirmed = true;
 
 				print_state(i, (int)rb->initiator_pid, 1);
 				if (pi[i].seen && pi[i].written) {
-					chosen_mb = pi[next].to_write;
+					keep_final(rb);
 					pi[i].run_ready = true;
+					n_run_ready++;
 					DPRINTF(4, "**%s(): pi[%d] is run ready",
 							__func__, i);
-				}
+				} else if (drop)
+					free_mb(rb);
 			}
+			set_port_events(pfd, i);
+			set_port_events(pfd, next);
+			print_state(i, n_run_ready, 2);
 		}
 
 		// See if all processes are run-ready
-		nfds = 0;
-		for (i = 0; i < nfd; i++) {
-			if (pi[i].run_ready)
-				nfds++;
-			print_state(i, nfds, 2);
-		}
-		if ((nfd > 2 && (nfds == nfd - 1 ||
-					(noinput && nfds == nfd - 2))) ||
-		    (nfds == nfd || (noinput && nfds == nfd - 1))) {
+		if ((nfd > 2 && (n_run_ready == nfd - 1 ||
+					(noinput && n_run_ready == nfd - 2))) ||
+		    (n_run_ready == nfd ||
+		     (noinput && n_run_ready == nfd - 1))) {
 			assert(chosen_mb != NULL);
 			DPRINTF(4, "%s(): conc leaves negotiation", __func__);
+			free(pfd);
 			return chosen_mb->state;
 		} else if (chosen_mb != NULL &&	iswrite) { // Free if we have written
 			DPRINTF(4, "chosen_mb: %lx, i: %d, next: %d, pi[next].to_write: %lx\n",
 				(long)chosen_mb, i, next_fd(i, &ro), (long)pi[next_fd(i, &ro)].to_write);
-			free_mb(chosen_mb);
-			chosen_mb = NULL;
+			/* A fanned out block may still be due to other ports */
+			if (!is_pending(chosen_mb)) {
+				free_mb(chosen_mb);
+				chosen_mb = NULL;
+			}
 			iswrite = false;
 		}
 	}
@@ -449,6 +539,65 @@ pass_message_blocks(void)
 
 
 
+/*
+ * Set up the message block and the processes talking to each port
+ * from the graph stored at an earlier run in the file named by
+ * DGSH_GRAPH for the graph identified by DGSH_GRAPH_ID,
+ * so that the fds can be passed without negotiating.
+ * Return OP_SUCCESS if this was possible, OP_NOOP if there is no such
+ * graph, and OP_ERROR if the concentrator's entry does not match it.
+ */
+STATIC enum op_result
+graph_file_ports(void)
+{
+	char *path = getenv("DGSH_GRAPH");
+	char *id = getenv("DGSH_GRAPH_ID");
+	int position = graph_position();
+	struct dgsh_negotiation *mb;
+	struct dgsh_conc *c = NULL;
+	bool ignore;
+	int i, j = 0;
+
+	if (path == NULL || id == NULL || position < 0 ||
+			graph_file_load(path, id, &mb) == OP_ERROR)
+		return OP_NOOP;
+	chosen_mb = mb;
+	/*
+	 * An output concentrator without input has no fds to pass.
+	 * It is not part of the stored concentrators, but as the graph's
+	 * identifier matches, all its peers use the stored graph as well.
+	 */
+	if (noinput)
+		return OP_SUCCESS;
+
+	for (i = 0; i < mb->n_concs; i++)
+		if (mb->conc_array[i].position == position) {
+			c = &mb->conc_array[i];
+			break;
+		}
+	if (c == NULL || c->multiple_inputs != multiple_inputs ||
+			c->n_proc_pids != (nfd > 2 ? nfd - 2 : 1)) {
+		free_mb(mb);
+		chosen_mb = NULL;
+		graph_file_mismatch(path, position);
+		return OP_ERROR;
+	}
+
+	/* Take the identity of the stored concentrator and its peers */
+	pid = c->pid;
+	if (multiple_inputs) {
+		pi[STDOUT_FILENO].pid = c->endpoint_pid;
+		for (i = STDIN_FILENO; i < nfd; i == STDIN_FILENO ? i = FREE_FILENO : i++)
+			pi[i].pid = c->proc_pids[j++];
+	} else {
+		pi[STDIN_FILENO].pid = c->endpoint_pid;
+		for (i = STDOUT_FILENO; i != STDIN_FILENO; i = next_fd(i, &ignore))
+			pi[i].pid = c->proc_pids[j++];
+	}
+	DPRINTF(1, "%s(): using the graph stored in %s", __func__, path);
+	return OP_SUCCESS;
+}
+
 /*
  * Scatter the fds read from the input process to multiple outputs.
  */
@@ -462,23 +611,21 @@ scatter_input_fds(struct dgsh_negotiation *mb)
 		exit(1);	// XXX
 	}
 	int n_to_read = this_conc->input_fds;
-	int *read_fds = (int *)malloc(n_to_read * sizeof(int));
+	int *in_fds = (int *)malloc(n_to_read * sizeof(int));
 	int i, j, write_index = 0;
 	bool ignore = false;
 	DPRINTF(4, "%s(): fds to read: %d", __func__, n_to_read);
 
-	for (i = 0; i < n_to_read; i++)
-		read_fds[i] = read_fd(STDIN_FILENO);
+	read_fds(STDIN_FILENO, in_fds, n_to_read);
 
 	for (i = STDOUT_FILENO; i != STDIN_FILENO; i = next_fd(i, &ignore)) {
 		int n_to_write = get_expected_fds_n(mb, pi[i].pid);
 		DPRINTF(4, "%s(): fds to write for p[%d].pid %d: %d",
 				__func__, i, pi[i].pid, n_to_write);
-		for (j = write_index; j < write_index + n_to_write; j++) {
-			write_fd(i, read_fds[j]);
+		for (j = write_index; j < write_index + n_to_write; j++)
 			DPRINTF(4, "%s(): Write fd: %d to output channel: %d",
-					__func__, read_fds[j], i);
-		}
+					__func__, in_fds[j], i);
+		write_fds(i, in_fds + write_index, n_to_write);
 		write_index += n_to_write;
 	}
 	assert(write_index == n_to_read);
@@ -497,7 +644,7 @@ gather_input_fds(struct dgsh_negotiation *mb)
 		exit(1);	// XXX
 	}
 	int n_to_write = this_conc->output_fds;
-	int *read_fds = (int *)malloc(n_to_write * sizeof(int));
+	int *in_fds = (int *)malloc(n_to_write * sizeof(int));
 	int i, j, read_index;
 	DPRINTF(4, "%s(): fds to write: %d", __func__, n_to_write);
 
@@ -506,17 +653,15 @@ gather_input_fds(struct dgsh_negotiation *mb)
 		int n_to_read = get_provided_fds_n(mb, pi[i].pid);
 		DPRINTF(4, "%s(): fds to read for p[%d].pid %d: %d",
 				__func__, i, pi[i].pid, n_to_read);
-		for (j = read_index; j < read_index + n_to_read; j++) {
-			read_fds[j] = read_fd(i);
+		read_fds(i, in_fds + read_index, n_to_read);
+		for (j = read_index; j < read_index + n_to_read; j++)
 			DPRINTF(4, "%s(): Read fd: %d from input channel: %d",
-					__func__, read_fds[j], i);
-		}
+					__func__, in_fds[j], i);
 		read_index += n_to_read;
 	}
 	assert(read_index == n_to_write);
 
-	for (i = 0; i < n_to_write; i++)
-		write_fd(STDOUT_FILENO, read_fds[i]);
+	write_fds(STDOUT_FILENO, in_fds, n_to_write);
 
 }
 
@@ -529,6 +674,7 @@ main(int argc, char *argv[])
 	int exit;
 	char *debug_level = NULL;
 	char *timeout;
+	long long start = trace_now();
 
 	program_name = argv[0];
 	pid = getpid();
@@ -579,7 +725,17 @@ main(int argc, char *argv[])
 	pi = (struct portinfo *)calloc(nfd, sizeof(struct portinfo));
 
 	chosen_mb = NULL;
-	exit = pass_message_blocks();
+	switch (graph_file_ports()) {
+	case OP_SUCCESS:
+		exit = PS_RUN;
+		break;
+	case OP_ERROR:
+		exit = PS_ERROR;
+		break;
+	default:
+		exit = pass_message_blocks();
+		break;
+	}
 	if (exit == PS_RUN) {
 		if (noinput)
 			DPRINTF(1, "%s(): Special (no-input) conc communicated the solution", __func__);
@@ -589,6 +745,8 @@ main(int argc, char *argv[])
 			scatter_input_fds(chosen_mb);
 		exit = PS_COMPLETE;
 	}
+	trace_event("negotiate", start, 0, state_name(exit));
+	trace_write(multiple_inputs ? "dgsh-conc -i" : "dgsh-conc -o");
 	free_mb(chosen_mb);
 	free(pi);
 	DPRINTF(3, "conc with pid %d terminates %s",
@@ -231,7 +231,7 @@ static void
 http_serve(FILE *in, FILE *out, const char *mime_type)
 {
 	char line[10000], method[10000], path[10000], protocol[10000];
-	char *file;
+	char *file, *key = NULL;
 	size_t len;
 	struct stat sb;
 	struct query *q;
@@ -310,15 +310,26 @@ http_serve(FILE *in, FILE *out, const char *mime_type)
 
 	/* File system name space */
 	if (stat(file, &sb) < 0) {
-		send_error(out, 404, "Not Found", NULL, strerror(errno));
-		return;
+		/* Named store value: store/name */
+		if (errno != ENOTDIR || (key = strrchr(file, '/')) == NULL) {
+			send_error(out, 404, "Not Found", NULL, strerror(errno));
+			return;
+		}
+		*key++ = 0;
+		if (stat(file, &sb) < 0 || !S_ISSOCK(sb.st_mode) ||
+		    !dgsh_kvstore_has_value(file, key, true)) {
+			send_error(out, 404, "Not Found", NULL,
+			    "No such store value.");
+			return;
+		}
 	}
 	if (S_ISSOCK(sb.st_mode)) {
 		/* Value store */
 		send_headers(out, 200, "Ok", NULL, mime_type,
 		    -1, (time_t)-1);
 		(void)fflush(out);
-		dgsh_send_command(file, read_cmd, true, false, fileno(out));
+		dgsh_send_command(file, key, read_cmd, true, false,
+		    fileno(out));
 	} else if (S_ISREG(sb.st_mode)) {
 		/* Regular file */
 		int ich;
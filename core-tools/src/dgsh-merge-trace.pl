@@ -0,0 +1,68 @@
+#!/usr/bin/env perl
+#
+# Merge the negotiation traces written by the processes of a dgsh graph
+# into a single Chrome trace event timeline
+#
+#  Copyright 2026 Diomidis Spinellis
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+
+use strict;
+use warnings;
+use JSON::PP;
+
+if ($#ARGV == -1) {
+	print STDERR "usage: $0 directory|file ...\n";
+	exit 1;
+}
+
+# Expand directories into the trace files they contain
+my @files;
+for my $name (@ARGV) {
+	if (-d $name) {
+		push(@files, sort glob("$name/dgsh-*.json"));
+	} else {
+		push(@files, $name);
+	}
+}
+
+my $json = JSON::PP->new;
+my (@meta, @events);
+for my $name (@files) {
+	open(my $in, '<', $name) || die "Unable to open $name: $!\n";
+	local $/;
+	my $trace = eval { $json->decode(<$in>) };
+	close($in);
+	if (!defined($trace) || ref($trace) ne 'ARRAY') {
+		print STDERR "$name: not a trace file; ignored\n";
+		next;
+	}
+	for my $e (@$trace) {
+		if ($e->{ph} eq 'M') {
+			push(@meta, $e);
+		} else {
+			push(@events, $e);
+		}
+	}
+}
+
+# Order the events in time, starting the timeline at the earliest one
+@events = sort { $a->{ts} <=> $b->{ts} || $a->{pid} <=> $b->{pid} } @events;
+my $origin = @events ? $events[0]->{ts} : 0;
+$_->{ts} -= $origin for (@events);
+
+print $json->canonical->pretty->encode({
+	traceEvents => [@meta, @events],
+	displayTimeUnit => 'ms',
+});
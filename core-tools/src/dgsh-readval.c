@@ -40,9 +40,12 @@ static const char *program_name;
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-c|e|l] [-n] [-q] [-x] -s path\n"
+	fprintf(stderr, "Usage: %s [-a|c|e|f|l] [-k name] [-n] [-q] [-x] -s path\n"
+		"-a"		"\tRead the aggregates of the store's current value\n"
 		"-c"		"\tRead the current value from the store\n"
 		"-e"		"\tRead current value or empty from the store\n"
+		"-f"		"\tOutput each new value of the store as it appears\n"
+		"-k name"	"\tRead the store's value with the specified name\n"
 		"-l"		"\tRead the last (before EOF) value from the store (default)\n"
 		"-n"		"\tDo not retry failed connection to write store\n"
 		"-q"		"\tAsk the write-end to quit\n"
@@ -59,6 +62,7 @@ main(int argc, char *argv[])
 	bool quit = false;
 	char cmd = 0;
 	const char *socket_path = NULL;
+	const char *key = NULL;
 	bool retry_connection = true;
 	bool should_negotiate = true;
 	int ninputs = 0;
@@ -66,18 +70,23 @@ main(int argc, char *argv[])
 
 	program_name = argv[0];
 
-	/* Default if nothing else is specified */
-	if (argc == 3)
-		cmd = 'L';
-
-	while ((ch = getopt(argc, argv, "celnqxs:")) != -1) {
+	while ((ch = getopt(argc, argv, "acefk:lnqxs:")) != -1) {
 		switch (ch) {
+		case 'a':	/* Read aggregates */
+			cmd = 'A';
+			break;
 		case 'c':	/* Read current value */
 			cmd = 'C';
 			break;
 		case 'e':	/* Read current or empty value */
 			cmd = 'c';
 			break;
+		case 'f':	/* Follow the value's updates */
+			cmd = 'S';
+			break;
+		case 'k':	/* Named value */
+			key = optarg;
+			break;
 		case 'l':	/* Read last value */
 			cmd = 'L';
 			break;
@@ -104,12 +113,17 @@ main(int argc, char *argv[])
 	if (argc != 0 || socket_path == NULL)
 		usage();
 
+	/* Default if nothing else is specified */
+	if (cmd == 0 && !quit)
+		cmd = 'L';
+
 	if (should_negotiate)
 		dgsh_negotiate(DGSH_HANDLE_ERROR, program_name, &ninputs, &noutputs, NULL, NULL);
 	else
 		set_negotiation_complete();
 
-	dgsh_send_command(socket_path, cmd, retry_connection, quit, STDOUT_FILENO);
+	dgsh_send_command(socket_path, key, cmd, retry_connection, quit,
+	    STDOUT_FILENO);
 
 	return 0;
 }
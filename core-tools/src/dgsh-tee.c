@@ -147,6 +147,18 @@ static bool block_len = 0;
 /* Set to true when we reach EOF on input */
 static bool reached_eof = false;
 
+/* Control socket through which outputs can be attached at runtime */
+static char *opt_control = NULL;
+
+/*
+ * Control socket connections whose request to attach outputs has yet
+ * to arrive.  They are waited on with the other file descriptors, so that
+ * a stalled client cannot delay the flow of data.
+ */
+#define MAX_ATTACH_REQUESTS 16
+static int attach_requests[MAX_ATTACH_REQUESTS];
+static int n_attach_requests = 0;
+
 /* Record terminator */
 static char rt = '\n';
 
@@ -589,7 +601,7 @@ source_read(struct source_info *ifp)
 		/* Provide some time for the output to drain. */
 		return read_oom;
 	}
-	if ((n = read(ifp->fd, b.p, b.size)) == -1)
+	if ((n = dgsh_read(ifp->fd, b.p, b.size)) == -1)
 		switch (errno) {
 		case EAGAIN:
 			DPRINTF(4, "EAGAIN on %s", fp_name(ifp));
@@ -784,13 +796,13 @@ sink_write(struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofile
 				/* Can happen when a line spans a buffer */
 				n = 0;
 			else {
-				n = write(ofp->fd, b.p, b.size);
+				n = dgsh_write(ofp->fd, b.p, b.size);
 				if (n < 0)
 					switch (errno) {
 					/* EPIPE is acceptable, for the sink's reader can terminate early. */
 					case EPIPE:
 						ofp->active = false;
-						(void)close(ofp->fd);
+						(void)dgsh_close(ofp->fd);
 						DPRINTF(4, "EPIPE for %s", fp_name(ofp));
 						break;
 					case EAGAIN:
@@ -832,9 +844,12 @@ sink_write(struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofile
 static void
 usage(const char *name)
 {
-	fprintf(stderr, "Usage %s [-b size] [-i file] [-IMs] [-o file] [-m size] [-t char]\n"
+	fprintf(stderr, "Usage %s [-b size] [-c path] [-i file] [-IMs] [-o file] [-m size] [-t char]\n"
+		"       %s -A path\n"
+		"-A path"	"\tAttach standard output to the dgsh-tee listening on path\n"
 		"-a"		"\tOpen output file(s) for appending\n"
 		"-b size"	"\tSpecify the size of the buffer to use (used for stress testing)\n"
+		"-c path"	"\tAccept outputs attached through the control socket path\n"
 		"-f"		"\tOverflow buffered data into a temporary file\n"
 		"-I"		"\tInput-side buffering\n"
 		"-i file"	"\tGather input from specified file\n"
@@ -845,7 +860,7 @@ usage(const char *name)
 		"-s"		"\tScatter the input across the files, rather than copying it to all\n"
 		"-T dir"	"\tSpecify directory for storing temporary file\n"
 		"-t char"	"\tProcess char-terminated records (newline default)\n",
-		name);
+		name, name);
 	exit(1);
 }
 
@@ -867,6 +882,63 @@ non_block(int fd, const char *name)
 		err(2, "Error setting %s to non-blocking mode", name);
 }
 
+/*
+ * If fd is a shared-memory channel on which I/O can proceed without
+ * waiting, add it to ready_fds and return true.
+ * Such channels may not appear ready to select(2).
+ */
+static bool
+channel_ready(int fd, fd_set *ready_fds)
+{
+	if (dgsh_ready(fd) == 1) {
+		FD_SET(fd, ready_fds);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Arrange for select(2) to wait until the sink fd can be written.
+ * Shared-memory channels signal available space by becoming readable;
+ * return true if the sink is such a channel that can be written now.
+ */
+static bool
+sink_fd_set(int fd, fd_set *sink_fds, fd_set *source_fds,
+		fd_set *channel_sink_fds, fd_set *ready_fds)
+{
+	switch (dgsh_ready(fd)) {
+	case -1:
+		FD_SET(fd, sink_fds);
+		return false;
+	case 1:
+		FD_SET(fd, ready_fds);
+		/* FALLTHROUGH */
+	default:
+		FD_SET(fd, source_fds);
+		FD_SET(fd, channel_sink_fds);
+		return FD_ISSET(fd, ready_fds);
+	}
+}
+
+/*
+ * After select(2) returns, mark the shared-memory channels that
+ * can proceed as ready in the source and sink sets.
+ */
+static void
+channel_fds_ready(int max_fd, fd_set *source_fds, fd_set *sink_fds,
+		fd_set *ready_fds, fd_set *channel_sink_fds)
+{
+	int fd;
+
+	for (fd = 0; fd <= max_fd; fd++)
+		if (FD_ISSET(fd, channel_sink_fds)) {
+			if (FD_ISSET(fd, ready_fds) || FD_ISSET(fd, source_fds))
+				FD_SET(fd, sink_fds);
+			FD_CLR(fd, source_fds);
+		} else if (FD_ISSET(fd, ready_fds))
+			FD_SET(fd, source_fds);
+}
+
 /*
  * Show the arguments passed to select(2) in human-readable form
  * If check is true, abort the program if no bit is on
@@ -1006,6 +1078,98 @@ output_source(struct source_info *ifiles, int output_n)
 	return NULL;
 }
 
+/*
+ * Accept the connections pending on the control socket control_fd,
+ * adding them to the requests to wait on, and adjust max_fd accordingly.
+ */
+static void
+accept_attach_requests(int control_fd, int *max_fd)
+{
+	int sock;
+
+	while ((sock = dgsh_control_accept(control_fd)) != -1) {
+		if (n_attach_requests == MAX_ATTACH_REQUESTS) {
+			DPRINTF(1, "Too many pending attach requests");
+			close(sock);
+			continue;
+		}
+		attach_requests[n_attach_requests++] = sock;
+		*max_fd = MAX(sock, *max_fd);
+	}
+}
+
+/*
+ * Add to the end of the ofiles list the outputs attached through the
+ * request arriving on the control socket connection sock, and adjust
+ * max_fd accordingly.
+ * Return false if the request has not yet arrived.
+ * When copying, the new outputs receive the data read from now on;
+ * when scattering, they take part in the scattering of the data
+ * not yet assigned to an output.
+ */
+static bool
+attach_sinks(int sock, struct sink_info *ofiles, int *max_fd)
+{
+	struct sink_info *ofp, *front = NULL, *last = NULL;
+	off_t pos_assigned = 0;
+	int *fds;
+	int i, n;
+
+	if ((n = dgsh_control_receive(sock, &fds)) <= 0)
+		return n == -1 && errno == EAGAIN ? false : true;
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		if (front == NULL && ofp->active)
+			front = ofp;
+		pos_assigned = MAX(pos_assigned, ofp->pos_to_write);
+		last = ofp;
+	}
+	if (front == NULL)
+		front = ofiles;
+
+	for (i = 0; i < n; i++) {
+		ofp = new_sink_info(NULL);
+		ofp->fd = fds[i];
+		ofp->ifp = front->ifp;
+		ofp->chain_last = true;
+		if (opt_scatter)
+			ofp->pos_written = ofp->pos_to_write = pos_assigned;
+		else
+			ofp->pos_written = ofp->pos_to_write =
+				ofp->ifp->source_pos_read;
+		*max_fd = MAX(ofp->fd, *max_fd);
+		non_block(ofp->fd, fp_name(ofp));
+		DPRINTF(2, "Attached output %s at position %ld",
+				fp_name(ofp), (long)ofp->pos_written);
+		last->next = ofp;
+		last = ofp;
+	}
+	free(fds);
+	return true;
+}
+
+/* Remove the control socket on exit */
+static void
+remove_control(void)
+{
+	unlink(opt_control);
+}
+
+/*
+ * Attach the standard output as a new output of the program
+ * listening on the control socket at path.
+ */
+static void
+attach_output(const char *path)
+{
+	int fd = STDOUT_FILENO;
+	int noutputfds = 1, ninputfds = 0;
+
+	dgsh_negotiate(DGSH_HANDLE_ERROR, "tee", &ninputfds, &noutputfds,
+			NULL, NULL);
+	if (dgsh_control_attach(path, 1, &fd) == -1)
+		err(2, "Error attaching output to %s", path);
+}
+
 static void
 memory_stats(struct source_info *ifiles)
 {
@@ -1205,15 +1369,24 @@ main(int argc, char *argv[])
 	enum state state = read_ob;
 	bool opt_memory_stats = false;
 	bool opt_append = false;
+	struct dgsh_channel_hints output_hints = {0, 0, 0};
+	const char *opt_attach = NULL;
+	int control_fd = -1;
 
-	while ((ch = getopt(argc, argv, "ab:fIi:Mm:o:p:S:sTt:")) != -1) {
+	while ((ch = getopt(argc, argv, "A:ab:c:fIi:Mm:o:p:S:sTt:")) != -1) {
 		switch (ch) {
+		case 'A':
+			opt_attach = optarg;
+			break;
 		case 'a':
 			opt_append = true;
 			break;
 		case 'b':
 			buffer_size = (int)parse_size(progname, optarg);
 			break;
+		case 'c':
+			opt_control = optarg;
+			break;
 		case 'f':
 			use_tmp_file = true;
 			break;
@@ -1275,6 +1448,11 @@ main(int argc, char *argv[])
 	if (argc)
 		usage(progname);
 
+	if (opt_attach) {
+		attach_output(opt_attach);
+		return 0;
+	}
+
 	/* dgsh */
 	int j = 0;
 	int noutputfds;
@@ -1310,8 +1488,15 @@ main(int argc, char *argv[])
 
 
 
+	/*
+	 * Ask for output pipes large enough to take a whole buffer;
+	 * the negotiation shares the system's limit among them
+	 */
+	output_hints.buffer_size = buffer_size;
 	DPRINTF(3, "Calling negotiate in=%d out=%d", ninputfds, noutputfds);
-	dgsh_negotiate(DGSH_HANDLE_ERROR, name, &ninputfds, &noutputfds, &inputfds, &outputfds);
+	dgsh_negotiate_hints(DGSH_HANDLE_ERROR | DGSH_SHM_CHANNELS, name,
+			&ninputfds, &noutputfds,
+			&inputfds, &outputfds, NULL, &output_hints);
 	DPRINTF(3, "nin=%d nout=%d", ninputfds, noutputfds);
 	assert(noutputfds >= 0);
 	assert(ninputfds >= 0);
@@ -1362,6 +1547,9 @@ main(int argc, char *argv[])
 	if (opt_scatter && permute_n)
 		errx(1, "Scattering and permutation cannot be used together");
 
+	if (opt_control && permute_n)
+		errx(1, "Attaching outputs and permutation cannot be used together");
+
 	if (ofiles == NULL) {
 		/* Output to stdout */
 		ofp = new_sink_info("standard output");
@@ -1388,16 +1576,29 @@ main(int argc, char *argv[])
 	front_ifp = ifiles;
 	chain_io_files(ifiles, ofiles, permute_n != 0);
 
+	if (opt_control) {
+		if ((control_fd = dgsh_control_open(opt_control)) == -1)
+			err(2, "Error creating control socket %s", opt_control);
+		atexit(remove_control);
+		max_fd = MAX(control_fd, max_fd);
+	}
+
 	/* Copy source to sink without allowing any single file to block us. */
 	for (;;) {
 		fd_set source_fds;
 		fd_set sink_fds;
+		fd_set ready_fds;	/* Channels that can proceed now */
+		fd_set channel_sink_fds;
+		struct timeval no_wait = {0, 0};
+		bool have_ready = false;
 		int fd_set_count = 0;
 
 		show_state(state);
 		/* Set the fd's we're interested to read/write; close unneeded ones. */
 		FD_ZERO(&source_fds);
 		FD_ZERO(&sink_fds);
+		FD_ZERO(&ready_fds);
+		FD_ZERO(&channel_sink_fds);
 
 		if (!reached_eof)
 			switch (state) {
@@ -1406,6 +1607,7 @@ main(int argc, char *argv[])
 					if (!ifp->reached_eof) {
 						FD_SET(ifp->fd, &source_fds);
 						fd_set_count += 1;
+						have_ready |= channel_ready(ifp->fd, &ready_fds);
 					}
 				break;
 			case read_ob:
@@ -1413,6 +1615,7 @@ main(int argc, char *argv[])
 					if (ifp->active && !ifp->reached_eof) {
 						FD_SET(ifp->fd, &source_fds);
 						fd_set_count += 1;
+						have_ready |= channel_ready(ifp->fd, &ready_fds);
 					}
 				break;
 			default:
@@ -1428,25 +1631,59 @@ main(int argc, char *argv[])
 					DPRINTF(4, "Check active file[%s] pos_written=%ld pos_to_write=%ld",
 						fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write);
 					if (ofp->pos_written < ofp->pos_to_write) {
-						FD_SET(ofp->fd, &sink_fds);
+						have_ready |= sink_fd_set(ofp->fd,
+							&sink_fds, &source_fds,
+							&channel_sink_fds, &ready_fds);
 						fd_set_count += 1;
 					}
 					break;
 				case drain_ib:
 				case write_ob:
-					FD_SET(ofp->fd, &sink_fds);
+					have_ready |= sink_fd_set(ofp->fd, &sink_fds,
+							&source_fds, &channel_sink_fds,
+							&ready_fds);
 					fd_set_count += 1;
 					break;
 				}
 			}
 
+		/*
+		 * While waiting, also accept outputs attached through
+		 * the control socket, as long as there is data to give them.
+		 */
+		if (control_fd != -1 && fd_set_count != 0 && !reached_eof) {
+			FD_SET(control_fd, &source_fds);
+			for (j = 0; j < n_attach_requests; j++)
+				FD_SET(attach_requests[j], &source_fds);
+		}
+
 		if (fd_set_count != 0) {
 			/* Block until we can read or write. */
 			show_select_args("Entering select", &source_fds, ifiles, &sink_fds, ofiles, true);
-			if (select(max_fd + 1, &source_fds, &sink_fds, NULL, NULL) < 0)
+			if (select(max_fd + 1, &source_fds, &sink_fds, NULL,
+					have_ready ? &no_wait : NULL) < 0)
 				err(3, "select");
+			channel_fds_ready(max_fd, &source_fds, &sink_fds,
+					&ready_fds, &channel_sink_fds);
 			show_select_args("Select returned", &source_fds, ifiles, &sink_fds, ofiles, false);
 
+			if (control_fd != -1 &&
+					FD_ISSET(control_fd, &source_fds)) {
+				FD_CLR(control_fd, &source_fds);
+				accept_attach_requests(control_fd, &max_fd);
+			}
+			for (j = 0; j < n_attach_requests; j++) {
+				int sock = attach_requests[j];
+
+				if (!FD_ISSET(sock, &source_fds))
+					continue;
+				FD_CLR(sock, &source_fds);
+				/* Requests that were served close their socket */
+				if (attach_sinks(sock, ofiles, &max_fd))
+					attach_requests[j--] =
+						attach_requests[--n_attach_requests];
+			}
+
 			/* Write to all file descriptors that accept writes. */
 			if (sink_write(ifiles, &sink_fds, ofiles) > 0) {
 				/*
@@ -1471,7 +1708,7 @@ main(int argc, char *argv[])
 						DPRINTF(3, "Retiring file %s pos_written=pos_to_write=%ld source_pos_read=%ld",
 							fp_name(ofp), (long)ofp->pos_written, (long)ofp->ifp->source_pos_read);
 						/* No more data to write; close fd to avoid deadlocks downstream. */
-						if (close(ofp->fd) == -1)
+						if (dgsh_close(ofp->fd) == -1)
 							err(2, "Error closing %s", fp_name(ofp));
 						ofp->active = false;
 					}
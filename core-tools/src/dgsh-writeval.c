@@ -6,6 +6,8 @@
  * Thus, this process acts in effect as a data store: it reads a series of
  * values (think of them as assignements) and provides a way to read the
  * store's current value (from the socket).
+ * A single process can also keep several named values, each read from
+ * its own input.
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
@@ -21,24 +23,38 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* memfd_create() */
+#endif
+
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
 #include "dgsh.h"
 #include "kvstore.h"
 #include "dgsh-debug.h"
@@ -47,43 +63,19 @@
 #ifdef DEBUG
 /* Small buffer size to catch errors with data spanning buffers */
 #define BUFFER_SIZE 5
+#define SLAB_SIZE 5
 #else
 /* PIPE_BUF is a reasonable size heuristic. */
 #define BUFFER_SIZE PIPE_BUF
+/* Large buffers amortize the allocation and read costs of bulk input */
+#define SLAB_SIZE (1024 * 1024)
 #endif
 
-/* User options start here */
-/* Record terminator */
-static char rt = '\n';
-
-/* Record length; 0 if we use a record terminator */
-static int rl = 0;
-
-/* True if the begin and end are specified using a time window */
-static bool time_window;
-
-/*
- * Specified response record.
- * This is specified using reverse iterators (counted from the end of the stream).
- * The _rbegin is inclusive, _rend is exclusive
- * Examples:
- * To get the last record use the range rbegin = 0 rend = 1
- * To get 5 records starting 10 records away from the end
- * use the range rbegin = 10 rend = 15
- */
-static union {
-	struct timeval t;	/* Used if time_window is true */
-	int r;			/* Used if time_window is false */
-	double d;		/* Used when parsing */
-} record_rbegin, record_rend;
-
-/* User options end here */
-
-/* True once we reach the end of file on standard input */
-static bool reached_eof;
+/* Maximum amount of memory kept in freed buffers for reuse */
+#define MAX_SPARE_BYTES (4 * 1024 * 1024)
 
-/* True if a complete record (ending in rt) is available */
-static bool have_record;
+/* Relative error of the approximate quantiles of aggregated fields */
+#define QUANTILE_ACCURACY 0.01
 
 /* Queue (doubly linked list) of buffers used for storing the last read record */
 struct buffer {
@@ -94,13 +86,18 @@ struct buffer {
 	long long record_count;			/* Total number of complete records read (including this buffer)
 						   (0-based ordinal of first record not in buffer) */
 	long long byte_count;			/* Total number of bytes read (including this buffer) */
-	char data[BUFFER_SIZE];
+	long long offset;			/* Position of the buffer's data in the input */
+	long long seq;				/* Ordinal number of the buffer in the queue */
+	char data[];				/* buffer_capacity bytes */
 };
 
-static struct buffer *head, *tail;
-
-/* The oldest buffer whose contents are still being written to a socket. */
-static struct buffer *oldest_buffer_being_written;
+/*
+ * Freed buffers kept for reuse, linked through next.
+ * The two lists hold buffers for record and for time windows,
+ * which differ in their capacity.
+ */
+static struct buffer *spare_buffers[2];
+static int nspare_buffers[2];
 
 /* A pointer to a character stored in a buffer */
 struct dpointer {
@@ -108,27 +105,245 @@ struct dpointer {
 	int pos;		/* The position within the buffer */
 };
 
-/* The last complete record read */
-static struct dpointer current_record_begin, current_record_end;
+/*
+ * Events are obtained on Linux through epoll(7), so that the work
+ * for each event is independent of the number of clients; elsewhere
+ * through poll(2).
+ */
+#ifdef __linux__
+#define EVENT_IN EPOLLIN
+#define EVENT_OUT EPOLLOUT
+#else
+#define EVENT_IN POLLIN
+#define EVENT_OUT POLLOUT
+#endif
+
+/* A file descriptor whose events we wait for */
+struct watch {
+	int fd;
+	int events;		/* Events of interest */
+	int slot;		/* Position in the poll(2) array (0 for epoll);
+				   -1 if not watched */
+};
+
+#ifdef __linux__
+/* The epoll(7) instance and the events it returns on each call */
+static int epoll_fd;
+#define MAX_EVENTS 256
+#else
+/* The poll(2) array and the watches corresponding to its elements */
+static struct pollfd *poll_fds;
+static struct watch **poll_watches;
+static int poll_nfds, poll_size;
+#endif
+
+/* The socket accepting connections */
+static struct watch listen_watch;
 
 /* The clients we're talking to */
 struct client {
-	int fd;
+	struct watch w;			/* Must be first, see handle_event */
+	struct value *value;		/* The value the client reads */
 	struct dpointer write_begin;	/* Start of data for next write */
 	struct dpointer write_end;	/* End of data to write */
+	char length[CONTENT_LENGTH_DIGITS + 1];	/* The response's content length */
+	int length_left;		/* Content length bytes still to write */
+	char key[KVSTORE_KEY_MAX + 1];	/* Name of the value being read */
+	int key_length;
+	char *text;			/* Text response being written */
+	int text_length, text_written;
+	bool subscribed;		/* Records are pushed to the client */
+	/* Sequence numbers of the buffers and positions delimiting the last record sent */
+	long long sent_begin_seq, sent_end_seq;
+	int sent_begin_pos, sent_end_pos;
 	enum {
-		s_inactive,		/* Free (unused or closed) */
 		s_read_command,		/* Waiting for a command (Q or R) to be read */
+		s_read_key,		/* Waiting for the name of the value to read */
+		s_subscribed,		/* Waiting for a record to push to a subscriber */
 		s_send_current,		/* Waiting for the current value to be written */
 		s_send_current_nblk,	/* Non-blocking: waiting for the current or empty value to be written */
 		s_send_last,		/* Waiting for the last (before EOF) value to be written */
 		s_sending_response,	/* A response is being written */
-		s_wait_close,		/* Wait for the client to close the connection */
+		s_send_segment,		/* The shared memory segment is to be sent */
+		s_send_aggregates,	/* The aggregates are to be written */
+		s_wait_close,		/* Wait for another command or for the client to close the connection */
 	} state;
+	struct client **list;		/* List of clients it is on, if any */
+	struct client *next, *prev;	/* Its neighbors on the list */
+};
+
+/* The numeric field of a record in the window */
+struct sample {
+	double x;		/* The field's value */
+	long long end;		/* Input position following the record */
+};
+
+/* Counts of samples in logarithmically sized buckets */
+struct bucket_store {
+	long long *counts;	/* Counts of buckets first to first + n - 1 */
+	int first;
+	int n;
+};
+
+/*
+ * Aggregates of a numeric field over the records in the window.
+ * The samples form a queue, which records join as they enter the window
+ * and leave as they exit it.
+ * The numbers of the samples that can become the window's minimum or
+ * maximum are kept in two monotonic queues, and the samples' quantiles
+ * are approximated by counting the samples in buckets whose bounds grow
+ * by a constant factor.
+ * Thus each record costs O(1) amortized time to enter and exit.
+ */
+struct aggregates {
+	int field;		/* Field aggregated; 0 for the whole record */
+	long long end;		/* Input position up to which records were added */
+	struct dpointer end_dp;	/* The same position in the buffers */
+
+	/* State of parsing the record being added */
+	int record_field;	/* Field being read; 0 between fields */
+	char token[64];		/* The aggregated field's characters */
+	int token_length;
+
+	/*
+	 * The rings of samples and of the sample numbers in the minimum
+	 * and maximum queues.
+	 * Element n is stored in position n & (size - 1).
+	 */
+	struct sample *samples;
+	long long *min_queue, *max_queue;
+	long long size;
+	long long first, last;			/* Samples in the window */
+	long long min_first, min_last, max_first, max_last;
+
+	long double sum;
+	long long zero_count;
+	struct bucket_store positive, negative;	/* By absolute value */
+};
+
+/* A value kept by the store, read from its own input */
+struct value {
+	const char *name;		/* Name used by clients; NULL if unnamed */
+
+	/* User options start here */
+	/* Record terminator */
+	char rt;
+
+	/* Record length; 0 if we use a record terminator */
+	int rl;
+
+	/* True if the begin and end are specified using a time window */
+	bool time_window;
+
+	/*
+	 * Specified response record.
+	 * This is specified using reverse iterators (counted from the end of the stream).
+	 * The _rbegin is inclusive, _rend is exclusive
+	 * Examples:
+	 * To get the last record use the range rbegin = 0 rend = 1
+	 * To get 5 records starting 10 records away from the end
+	 * use the range rbegin = 10 rend = 15
+	 */
+	union {
+		struct timeval t;	/* Used if time_window is true */
+		int r;			/* Used if time_window is false */
+		double d;		/* Used when parsing */
+	} record_rbegin, record_rend;
+
+	/* Largest record published in shared memory; 0 if none is published */
+	int segment_capacity;
+
+	/* True if aggregates of the window's aggregate_field are kept */
+	bool aggregate;
+	int aggregate_field;
+
+	/* User options end here */
+
+	/* The input and its state */
+	struct watch input_watch;
+
+	/* True if the input is a file that cannot be watched for events */
+	bool input_always_ready;
+
+	/* True if the input is ready for reading before waiting for events */
+	bool input_ready;
+
+	/* True if the input was read while handling the events */
+	bool input_read;
+
+	/* True once we reach the end of file on the input */
+	bool reached_eof;
+
+	/* True if a complete record (ending in rt) is available */
+	bool have_record;
+
+	/* The queue of buffers storing the data read */
+	struct buffer *head, *tail;
+
+	/*
+	 * Number of data bytes in each buffer.
+	 * Record windows fill large buffers through successive reads.
+	 * Time windows read into small ones, so that each buffer's timestamp
+	 * closely matches the time its data arrived.
+	 */
+	int buffer_capacity;
+
+	/* Ordinal number of the next buffer added to the queue */
+	long long buffer_seq;
+
+	/*
+	 * Index of the queued buffers, used for finding the buffers of a
+	 * time window through binary search.
+	 * Buffer b is stored in time_index[b->seq % time_index_size].
+	 */
+	struct buffer **time_index;
+	long long time_index_size;
+
+	/* Number of bytes read from the input */
+	long long bytes_read;
+
+	/* Aggregates of the records in the window; NULL if not kept */
+	struct aggregates *aggregates;
+
+	/* The oldest buffer whose contents are still being written to a socket. */
+	struct buffer *oldest_buffer_being_written;
+
+	/* The last complete record read */
+	struct dpointer current_record_begin, current_record_end;
+
+	/* Shared memory segment in which the current record is published */
+	struct kvstore_segment *segment;
+	int segment_fd;
+
+	/*
+	 * Ring of the positions following the most recent record terminators.
+	 * It allows the records specified by number to be located without
+	 * scanning the data backwards.
+	 * The position following the k-th most recent terminator is stored in
+	 * rt_ring[(tail->record_count - 1 - k) % rt_ring_size].
+	 */
+	struct dpointer *rt_ring;
+	int rt_ring_size;
+
+	/*
+	 * Clients waiting for a record to become available, clients waiting
+	 * for the end of file, clients being sent a response, and
+	 * subscribers waiting for a new record.
+	 * Clients waiting for their socket to be readable or writable are
+	 * found through the socket's events, so they need not be listed.
+	 */
+	struct client *waiting_record, *waiting_eof, *sending, *subscribers;
 };
 
-#define MAX_CLIENTS 64
-static struct client clients[MAX_CLIENTS];
+/*
+ * The values kept by the store; clients that do not name a value
+ * read the first one.
+ */
+static struct value *values;
+static int nvalues;
+
+/* The value being processed */
+static struct value *value;
 
 static const char *program_name;
 static const char *socket_path;
@@ -237,7 +452,7 @@ dpointer_move_back(struct dpointer *dp, int n)
 		dp->b, dp->pos, dp->b->size, dp->b->prev, n);
 	for (;;) {
 		if (dpointer_decrement(dp)) {
-			if (dp->b->data[dp->pos] == rt && --n == -1) {
+			if (dp->b->data[dp->pos] == value->rt && --n == -1) {
 				dpointer_increment(dp);
 				DPRINTF(4, "return %p pos=%d", dp->b, dp->pos);
 				return true;
@@ -268,7 +483,7 @@ dpointer_move_forward(struct dpointer *dp, int n)
 		return true;
 	}
 	for (;;) {
-		if (dp->b->data[dp->pos] == rt && --n == -1) {
+		if (dp->b->data[dp->pos] == value->rt && --n == -1) {
 			dpointer_increment(dp);
 			DPRINTF(4, "return %p pos=%d", dp->b, dp->pos);
 			return true;
@@ -288,7 +503,7 @@ oldest_buffer(struct buffer *a, struct buffer *b)
 		return b;
 	else if (b == NULL)
 		return a;
-	for (bp = head; bp ; bp = bp->next)
+	for (bp = value->head; bp ; bp = bp->next)
 		if (bp == a)
 			return a;
 		else if (bp == b)
@@ -303,14 +518,46 @@ oldest_buffer(struct buffer *a, struct buffer *b)
 static void
 update_oldest_buffer(void)
 {
-	int i;
+	struct client *c;
 
-	oldest_buffer_being_written = NULL;
-	for (i = 0; i < MAX_CLIENTS; i++)
-		if (clients[i].state == s_sending_response)
-			oldest_buffer_being_written =
-				oldest_buffer(oldest_buffer_being_written, clients[i].write_begin.b);
-	DPRINTF(4, "Oldest buffer beeing written is %p", oldest_buffer_being_written);
+	value->oldest_buffer_being_written = NULL;
+	for (c = value->sending; c; c = c->next)
+		value->oldest_buffer_being_written =
+			oldest_buffer(value->oldest_buffer_being_written, c->write_begin.b);
+	DPRINTF(4, "Oldest buffer beeing written is %p", value->oldest_buffer_being_written);
+}
+
+/* Return a buffer for reading data, reusing a freed one if available */
+static struct buffer *
+buffer_alloc(void)
+{
+	struct buffer *b;
+	int i = value->time_window;
+
+	if (spare_buffers[i]) {
+		b = spare_buffers[i];
+		spare_buffers[i] = b->next;
+		nspare_buffers[i]--;
+		return b;
+	}
+	if ((b = malloc(sizeof(struct buffer) + value->buffer_capacity)) == NULL)
+		err(1, "Unable to allocate read buffer");
+	return b;
+}
+
+/* Release buffer b, keeping it for reuse if few are kept */
+static void
+buffer_free(struct buffer *b)
+{
+	int i = value->time_window;
+
+	if ((long long)(nspare_buffers[i] + 1) * value->buffer_capacity > MAX_SPARE_BYTES) {
+		free(b);
+		return;
+	}
+	b->next = spare_buffers[i];
+	spare_buffers[i] = b;
+	nspare_buffers[i]++;
 }
 
 /* Free buffers preceding in position the used buffer */
@@ -319,21 +566,85 @@ free_unused_buffers_by_position(struct buffer *used)
 {
 	struct buffer *b, *bnext;
 
-	for (b = head; b; b = bnext) {
-		if (b == used || b == oldest_buffer_being_written) {
-			head = b;
+	for (b = value->head; b; b = bnext) {
+		if (b == used || b == value->oldest_buffer_being_written) {
+			value->head = b;
 			b->prev = NULL;
-			DPRINTF(4, "After freeing buffer(s) head=%p tail=%p", head, tail);
+			DPRINTF(4, "After freeing buffer(s) head=%p tail=%p", value->head, value->tail);
 			return;
 		}
 		bnext = b->next;
 		DPRINTF(4, "Freeing buffer %p prev=%p next=%p", b, b->prev, b->next);
-		free(b);
+		buffer_free(b);
 	}
 	/* Should have encountered used along the way. */
 	assert(0);
 }
 
+/* Add b to the end of the buffer queue */
+static void
+queue_buffer(struct buffer *b)
+{
+	b->prev = value->tail;
+	b->next = NULL;
+	b->seq = value->buffer_seq++;
+	if (value->tail)
+		value->tail->next = b;
+	value->tail = b;
+	if (!value->head)
+		value->head = b;
+
+	if (!value->time_window)
+		return;
+
+	/* Grow the time index to hold the queued buffers */
+	if (b->seq - value->head->seq >= value->time_index_size) {
+		long long size, seq;
+		struct buffer **index;
+
+		size = value->time_index_size ? value->time_index_size * 2 : 1024;
+		if ((index = malloc(size * sizeof(*index))) == NULL)
+			err(1, "Unable to allocate time index");
+		for (seq = value->head->seq; seq < b->seq; seq++)
+			index[seq % size] = value->time_index[seq % value->time_index_size];
+		free(value->time_index);
+		value->time_index = index;
+		value->time_index_size = size;
+	}
+	value->time_index[b->seq % value->time_index_size] = b;
+}
+
+/* Return true if buffer b was read after (or, if at is true, at) time t */
+static bool
+read_after(struct buffer *b, struct timeval *t, bool at)
+{
+	return at ? !timercmp(&b->timestamp, t, <) : timercmp(&b->timestamp, t, >);
+}
+
+/*
+ * Return the oldest queued buffer read after (or, if at is true, at)
+ * the time t, or NULL if there is no such buffer.
+ */
+static struct buffer *
+buffer_after(struct timeval *t, bool at)
+{
+	long long low, high, mid;
+
+	if (!value->tail || !read_after(value->tail, t, at))
+		return NULL;
+	/* Binary search in the sequence number range [low, high] */
+	low = value->head->seq;
+	high = value->tail->seq;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (read_after(value->time_index[mid % value->time_index_size], t, at))
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return value->time_index[low % value->time_index_size];
+}
+
 /* Free buffers preceding in time (older than) the used buffer */
 static void
 free_unused_buffers_by_time(struct timeval *used)
@@ -344,15 +655,17 @@ free_unused_buffers_by_time(struct timeval *used)
 		(long long)used->tv_sec, (int)used->tv_usec);
 
 	/* Find first useful record */
-	for (b = head; b; b = b->next)
-		if (timercmp(&b->timestamp, used, >=) || b == oldest_buffer_being_written)
-			break;
+	b = buffer_after(used, true);
+	if (value->oldest_buffer_being_written &&
+	    value->oldest_buffer_being_written->seq >= value->head->seq &&
+	    (!b || value->oldest_buffer_being_written->seq < b->seq))
+		b = value->oldest_buffer_being_written;
 	assert(b);	/* Should have encountered used along the way. */
 
 	DPRINTF(4, "First used buffer is %p", b);
 	/* Must now leave another record in case a record extends backward */
-	if (rl) {
-		int n = rl;
+	if (value->rl) {
+		int n = value->rl;
 
 		do {
 			b = b->prev;
@@ -360,32 +673,75 @@ free_unused_buffers_by_time(struct timeval *used)
 	} else {
 		do {
 			b = b->prev;
-		} while (b && !memchr(b->data, rt, b->size));
+		} while (b && !memchr(b->data, value->rt, b->size));
 	}
 	DPRINTF(4, "After extending back %p", b);
 	if (b)
 		free_unused_buffers_by_position(b);
 }
 
-/* Return the content length of the client's buffer */
+/* Return the length of the data between begin and end */
 static unsigned int
-content_length(struct client *c)
+content_length(struct dpointer *begin, struct dpointer *end)
 {
 	struct buffer *bp;
 	unsigned int length;
 
-	if (c->write_begin.b == c->write_end.b)
-		length = c->write_end.pos - c->write_begin.pos;
+	if (begin->b == end->b)
+		length = end->pos - begin->pos;
 	else {
-		length = c->write_begin.b->size - c->write_begin.pos;
-		for (bp = c->write_begin.b->next; bp && bp != c->write_end.b; bp = bp->next)
+		length = begin->b->size - begin->pos;
+		for (bp = begin->b->next; bp && bp != end->b; bp = bp->next)
 			length += bp->size;
-		length +=  c->write_end.pos;
+		length +=  end->pos;
 	}
 	DPRINTF(4, "return %u", length);
 	return length;
 }
 
+/*
+ * Allocate the ring of record terminator positions,
+ * if the records are specified by number and the ring fits in memory.
+ */
+static void
+rt_ring_init(void)
+{
+	if (value->time_window || value->rl || value->record_rbegin.r < 0 ||
+	    value->record_rend.r < value->record_rbegin.r)
+		return;
+	value->rt_ring_size = value->record_rend.r + 1;
+	value->rt_ring = calloc(value->rt_ring_size, sizeof(*value->rt_ring));
+	DPRINTF(3, "Terminator ring of %d elements at %p", value->rt_ring_size, value->rt_ring);
+}
+
+/*
+ * Return the position following the k-th most recent record terminator,
+ * or the beginning of the data, if k terminators have not been read.
+ */
+static struct dpointer
+rt_ring_position(int k)
+{
+	struct dpointer *dp;
+
+	if (k >= value->tail->record_count) {
+		struct dpointer start = {value->head, 0};
+
+		return start;
+	}
+	dp = &value->rt_ring[(value->tail->record_count - 1 - k) % value->rt_ring_size];
+	/*
+	 * As with dpointer_move_back, point to the beginning of the next
+	 * buffer rather than past the end of the terminator's buffer.
+	 * This also keeps the position valid when the terminator's buffer
+	 * is freed.
+	 */
+	if (dp->pos == dp->b->size && dp->b->next) {
+		dp->b = dp->b->next;
+		dp->pos = 0;
+	}
+	return *dp;
+}
+
 /*
  * Update the pointers to the current response record based on the defined
  * record terminator.
@@ -395,21 +751,27 @@ update_current_record_by_rt_number(void)
 {
 	bool ret;
 
+	if (value->rt_ring) {
+		value->current_record_end = rt_ring_position(value->record_rbegin.r);
+		value->current_record_begin = rt_ring_position(value->record_rend.r);
+		return;
+	}
+
 	/* Point to the end of read data */
-	current_record_end.b = tail;
-	current_record_end.pos = tail->size;
+	value->current_record_end.b = value->tail;
+	value->current_record_end.pos = value->tail->size;
 
 	/* Remove data that forms an incomplete record */
-	ret = dpointer_move_back(&current_record_end, 0);
+	ret = dpointer_move_back(&value->current_record_end, 0);
 	assert(ret);
 
 	/* Go back to the end of the specified record */
-	ret = dpointer_move_back(&current_record_end, record_rbegin.r);
+	ret = dpointer_move_back(&value->current_record_end, value->record_rbegin.r);
 	assert(ret);
 
 	/* Go further back to the begin of the specified record */
-	current_record_begin = current_record_end;
-	ret = dpointer_move_back(&current_record_begin, record_rend.r - record_rbegin.r);
+	value->current_record_begin = value->current_record_end;
+	ret = dpointer_move_back(&value->current_record_begin, value->record_rend.r - value->record_rbegin.r);
 	assert(ret);
 }
 
@@ -423,20 +785,20 @@ update_current_record_by_rl_number(void)
 	bool ret;
 
 	/* Point to the end of read data */
-	current_record_end.b = tail;
-	current_record_end.pos = tail->size;
+	value->current_record_end.b = value->tail;
+	value->current_record_end.pos = value->tail->size;
 
 	/* Remove data that forms an incomplete record */
-	ret = dpointer_subtract(&current_record_end, tail->byte_count % rl);
+	ret = dpointer_subtract(&value->current_record_end, value->tail->byte_count % value->rl);
 	assert(ret);
 
 	/* Go back to the end of the specified record */
-	ret = dpointer_subtract(&current_record_end, record_rbegin.r * rl);
+	ret = dpointer_subtract(&value->current_record_end, value->record_rbegin.r * value->rl);
 	assert(ret);
 
 	/* Go further back to the begin of the specified record */
-	current_record_begin = current_record_end;
-	ret = dpointer_subtract(&current_record_begin, (record_rend.r - record_rbegin.r) * rl);
+	value->current_record_begin = value->current_record_end;
+	ret = dpointer_subtract(&value->current_record_begin, (value->record_rend.r - value->record_rbegin.r) * value->rl);
 	assert(ret);
 }
 
@@ -450,29 +812,29 @@ static void
 update_current_record_by_rt_time(struct buffer *begin, struct buffer *end)
 {
 	/* Point to the begin of the data window */
-	current_record_begin.b = begin;
-	current_record_begin.pos = 0;
+	value->current_record_begin.b = begin;
+	value->current_record_begin.pos = 0;
 
 	/* Go to the begin of a record starting at or after the buffer */
-	if (!dpointer_move_forward(&current_record_begin, 0))
+	if (!dpointer_move_forward(&value->current_record_begin, 0))
 		return;
 
 	/* Point to the end of the data window */
-	current_record_end.b = end;
-	current_record_end.pos = end->size;
-	dpointer_decrement(&current_record_end);
+	value->current_record_end.b = end;
+	value->current_record_end.pos = end->size;
+	dpointer_decrement(&value->current_record_end);
 
 	/* Adjust data that forms an incomplete record */
-	if (!dpointer_move_forward(&current_record_end, 0)) {
-		current_record_end.b = end;
-		current_record_end.pos = end->size;
-		if (!dpointer_move_back(&current_record_end, 0))
+	if (!dpointer_move_forward(&value->current_record_end, 0)) {
+		value->current_record_end.b = end;
+		value->current_record_end.pos = end->size;
+		if (!dpointer_move_back(&value->current_record_end, 0))
 			return;
-		if (memcmp(&current_record_begin, &current_record_end, sizeof(struct dpointer)) == 0)
+		if (memcmp(&value->current_record_begin, &value->current_record_end, sizeof(struct dpointer)) == 0)
 			return;
 	}
 
-	have_record = true;
+	value->have_record = true;
 }
 
 /*
@@ -487,20 +849,20 @@ update_current_record_by_rl_time(struct buffer *begin, struct buffer *end)
 	int mod;
 
 	DPRINTF(4, "Adjusting begin");
-	current_record_begin.b = begin;
-	current_record_begin.pos = 0;
-	if (begin->prev && (mod = begin->prev->byte_count % rl) != 0)
+	value->current_record_begin.b = begin;
+	value->current_record_begin.pos = 0;
+	if (begin->prev && (mod = begin->prev->byte_count % value->rl) != 0)
 		/*
 		 * Example: rl == 10, prev->byte_count == 53
 		 * mod = 3, dpointer_add(..., 7)
 		 */
-		if (!dpointer_add(&current_record_begin, rl - mod))
+		if (!dpointer_add(&value->current_record_begin, value->rl - mod))
 			return;		/* Next record not there */
 
 	DPRINTF(4, "Adjusting end");
-	current_record_end.b = end;
-	current_record_end.pos = end->size;
-	if ((mod = end->byte_count % rl) != 0) {
+	value->current_record_end.b = end;
+	value->current_record_end.pos = end->size;
+	if ((mod = end->byte_count % value->rl) != 0) {
 		/*
 		 * Example: rl == 10, end->byte_count == 82
 		 * mod = 2, dpointer_add(..., 8)
@@ -508,21 +870,21 @@ update_current_record_by_rl_time(struct buffer *begin, struct buffer *end)
 		 * pointing beyond the range, and valid positions that dpointer_add
 		 * can handle correctly.
 		 */
-		if (!dpointer_decrement(&current_record_end) ||
-		    !dpointer_add(&current_record_end, rl - mod)) {
+		if (!dpointer_decrement(&value->current_record_end) ||
+		    !dpointer_add(&value->current_record_end, value->rl - mod)) {
 			DPRINTF(4, "incomplete last record");
 			/* Try going back */
-			current_record_end.b = end;
-			current_record_end.pos = end->size;
-			if (!dpointer_subtract(&current_record_end, mod))
+			value->current_record_end.b = end;
+			value->current_record_end.pos = end->size;
+			if (!dpointer_subtract(&value->current_record_end, mod))
 				return;
 		} else
-			(void)dpointer_increment(&current_record_end);
+			(void)dpointer_increment(&value->current_record_end);
 	}
 
-	if (memcmp(&current_record_begin, &current_record_end, sizeof(struct dpointer)) == 0)
+	if (memcmp(&value->current_record_begin, &value->current_record_end, sizeof(struct dpointer)) == 0)
 		return;
-	have_record = true;
+	value->have_record = true;
 }
 
 #ifdef DEBUG
@@ -537,9 +899,9 @@ dump_buffer_times(void)
 
 	DPRINTF(4, "update_current_record: now=%lld.%06d rend=%lld.%06d rbegin=%lld.%06d",
 		(long long)now.tv_sec, (int)now.tv_usec,
-		(long long)record_rend.t.tv_sec, (int)record_rend.t.tv_usec,
-		(long long)record_rbegin.t.tv_sec, (int)record_rbegin.t.tv_usec);
-	for (bp = head; bp != NULL; bp = bp->next) {
+		(long long)value->record_rend.t.tv_sec, (int)value->record_rend.t.tv_usec,
+		(long long)value->record_rbegin.t.tv_sec, (int)value->record_rbegin.t.tv_usec);
+	for (bp = value->head; bp != NULL; bp = bp->next) {
 		timersub(&now, &bp->timestamp, &t);
 
 		DPRINTF(4, "\t%p size=%3d byte_count=%5lld Tr=%3lld.%06d Ta=%3lld.%06d [%.*s]",
@@ -573,44 +935,45 @@ timestamp(const char *msg)
 static void
 update_current_record(void)
 {
-	assert(head && tail);
+	assert(value->head && value->tail);
 
-	if (time_window) {
+	if (value->time_window) {
 		struct timeval now, tbegin, tend;	/* In absolute time units */
 		struct buffer *bbegin, *bend, *begin_candidate = NULL;
 
 		DUMP_BUFFER_TIMES();
-		have_record = false;		/* Records in the window come and go */
+		value->have_record = false;		/* Records in the window come and go */
 
 		/* Convert to absolute time */
 		gettimeofday(&now, NULL);
-		timersub(&now, &record_rend.t, &tbegin);
+		timersub(&now, &value->record_rend.t, &tbegin);
 
 		DPRINTF(4, "tail->timestamp=%lld.%06d tbegin=%lld.%06d",
-			(long long)tail->timestamp.tv_sec, (int)tail->timestamp.tv_usec,
+			(long long)value->tail->timestamp.tv_sec, (int)value->tail->timestamp.tv_usec,
 			(long long)tbegin.tv_sec, (int)tbegin.tv_usec);
 
-		if (timercmp(&tail->timestamp, &tbegin, <)) {
-			free_unused_buffers_by_position(tail);
+		if (timercmp(&value->tail->timestamp, &tbegin, <)) {
+			free_unused_buffers_by_position(value->tail);
 			return;		/* No records fresh enough */
 		}
 
-		timersub(&now, &record_rbegin.t, &tend);
+		timersub(&now, &value->record_rbegin.t, &tend);
 
 		DPRINTF(4, "head->timestamp=%lld.%06d tend=%lld.%06d",
-			(long long)head->timestamp.tv_sec, (int)head->timestamp.tv_usec,
+			(long long)value->head->timestamp.tv_sec, (int)value->head->timestamp.tv_usec,
 			(long long)tend.tv_sec, (int)tend.tv_usec);
 
-		if (timercmp(&head->timestamp, &tend, >))
+		if (timercmp(&value->head->timestamp, &tend, >))
 			return;		/* No records old enough */
 
 		/* Find the record range */
 		DPRINTF(4, "Looking for record range");
-		for (bend = tail; timercmp(&bend->timestamp, &tend, >); bend = bend->prev)
-			;
+		bend = buffer_after(&tend, false);
+		bend = bend ? bend->prev : value->tail;
 		DPRINTF(4, "bend=%p %lld.%06d", bend, (long long)bend->timestamp.tv_sec, (int)bend->timestamp.tv_usec);
 
-		for (bbegin = bend; bbegin && timercmp(&bbegin->timestamp, &tbegin, >); bbegin = bbegin->prev)
+		bbegin = buffer_after(&tbegin, false);
+		if (bbegin && bbegin->seq <= bend->seq)
 			begin_candidate = bbegin;
 
 		if (!begin_candidate) {
@@ -620,7 +983,7 @@ update_current_record(void)
 		bbegin = begin_candidate;
 		DPRINTF(4, "bbegin=%p %lld.%06d", bbegin, (long long)bbegin->timestamp.tv_sec, (int)bbegin->timestamp.tv_usec);
 
-		if (rl)
+		if (value->rl)
 			update_current_record_by_rl_time(bbegin, bend);
 		else
 			update_current_record_by_rt_time(bbegin, bend);
@@ -628,132 +991,758 @@ update_current_record(void)
 		free_unused_buffers_by_time(&tbegin);
 	} else {
 		DPRINTF(4, "tail->record_count=%lld record_rend.r=%d",
-			tail->record_count, record_rend.r);
-		if (tail->record_count - record_rend.r < 0)
+			value->tail->record_count, value->record_rend.r);
+		if (value->tail->record_count - value->record_rend.r < 0)
 			/* Not enough records */
 			return;
 
-		if (rl)
+		if (value->rl)
 			update_current_record_by_rl_number();
 		else
 			update_current_record_by_rt_number();
-		have_record = true;
-		free_unused_buffers_by_position(current_record_begin.b);
+		value->have_record = true;
+		free_unused_buffers_by_position(value->current_record_begin.b);
 	}
 
-	DPRINTF(4, "have_record=%d", have_record);
-	DPRINTF(4, "begin b=%p pos=%d", current_record_begin.b, current_record_begin.pos);
-	DPRINTF(4, "end b=%p pos=%d", current_record_end.b, current_record_end.pos);
+	DPRINTF(4, "have_record=%d", value->have_record);
+	DPRINTF(4, "begin b=%p pos=%d", value->current_record_begin.b, value->current_record_begin.pos);
+	DPRINTF(4, "end b=%p pos=%d", value->current_record_end.b, value->current_record_end.pos);
 }
 
-/*
- * Read a one character command from the specifid client and act on it
- * The following commands are supported:
- * R: Read value (the client wants to read our current store value)
- * Q: Quit (Terminate the operation of this data store)
- */
+/* Return the position of the character dp points to in the input */
+static long long
+dpointer_offset(const struct dpointer *dp)
+{
+	return dp->b->offset + dp->pos;
+}
 
+/* Logarithm of the factor by which the quantile buckets grow */
+static double log_gamma;
+
+/* Set up the aggregation of the specified field of the value's records */
 static void
-read_command(struct client *c)
+aggregates_init(int field)
 {
-	char cmd;
-	int n;
+	struct aggregates *a;
+
+	if ((a = calloc(1, sizeof(*a))) == NULL)
+		err(1, "Unable to allocate aggregates");
+	a->field = field;
+	a->end = -1;
+	value->aggregates = a;
+	log_gamma = log((1 + QUANTILE_ACCURACY) / (1 - QUANTILE_ACCURACY));
+}
 
-	switch (n = read(c->fd, &cmd, 1)) {
-	case -1: 		/* Error */
-		switch (errno) {
-		case EAGAIN:
-			DPRINTF(4, "EAGAIN on client socket read");
-			break;
-		default:
-			err(3, "Read from socket");
+/* Double the size of the aggregates' rings */
+static void
+aggregates_grow(struct aggregates *a)
+{
+	long long size = a->size ? a->size * 2 : 1024;
+	struct sample *samples;
+	long long *min_queue, *max_queue;
+	long long n;
+
+	if ((samples = malloc(size * sizeof(*samples))) == NULL ||
+	    (min_queue = malloc(size * sizeof(*min_queue))) == NULL ||
+	    (max_queue = malloc(size * sizeof(*max_queue))) == NULL)
+		err(1, "Unable to allocate aggregates");
+	for (n = a->first; n < a->last; n++)
+		samples[n & (size - 1)] = a->samples[n & (a->size - 1)];
+	for (n = a->min_first; n < a->min_last; n++)
+		min_queue[n & (size - 1)] = a->min_queue[n & (a->size - 1)];
+	for (n = a->max_first; n < a->max_last; n++)
+		max_queue[n & (size - 1)] = a->max_queue[n & (a->size - 1)];
+	free(a->samples);
+	free(a->min_queue);
+	free(a->max_queue);
+	a->samples = samples;
+	a->min_queue = min_queue;
+	a->max_queue = max_queue;
+	a->size = size;
+}
+
+/* Add delta to the count of bucket i, extending the store's range if needed */
+static void
+bucket_add(struct bucket_store *bs, int i, int delta)
+{
+	long long *counts;
+	int first, last;
+
+	if (bs->n == 0 || i < bs->first || i >= bs->first + bs->n) {
+		/* Leave room for further growth */
+		first = bs->n ? MIN(bs->first, i - 32) : i - 32;
+		last = bs->n ? MAX(bs->first + bs->n, i + 32) : i + 32;
+		if ((counts = calloc(last - first, sizeof(*counts))) == NULL)
+			err(1, "Unable to allocate quantile buckets");
+		if (bs->n)
+			memcpy(counts + bs->first - first, bs->counts,
+				bs->n * sizeof(*counts));
+		free(bs->counts);
+		bs->counts = counts;
+		bs->first = first;
+		bs->n = last - first;
+	}
+	bs->counts[i - bs->first] += delta;
+}
+
+/* Add delta to the count of the quantile bucket in which x belongs */
+static void
+sketch_add(struct aggregates *a, double x, int delta)
+{
+	if (x > 0)
+		bucket_add(&a->positive, (int)ceil(log(x) / log_gamma), delta);
+	else if (x < 0)
+		bucket_add(&a->negative, (int)ceil(log(-x) / log_gamma), delta);
+	else
+		a->zero_count += delta;
+}
+
+/* Return the value represented by the quantile bucket i */
+static double
+bucket_value(int i)
+{
+	double gamma = exp(log_gamma);
+
+	return 2 * pow(gamma, i) / (gamma + 1);
+}
+
+/* Add to the window's samples the value x of a record ending at end */
+static void
+add_sample(struct aggregates *a, double x, long long end)
+{
+	long long n;
+
+	if (a->last - a->first == a->size)
+		aggregates_grow(a);
+	n = a->last++;
+	a->samples[n & (a->size - 1)].x = x;
+	a->samples[n & (a->size - 1)].end = end;
+	a->sum += x;
+
+	/* Samples that can no longer become the minimum or maximum */
+	while (a->min_last > a->min_first &&
+	    a->samples[a->min_queue[(a->min_last - 1) & (a->size - 1)] & (a->size - 1)].x >= x)
+		a->min_last--;
+	a->min_queue[a->min_last++ & (a->size - 1)] = n;
+	while (a->max_last > a->max_first &&
+	    a->samples[a->max_queue[(a->max_last - 1) & (a->size - 1)] & (a->size - 1)].x <= x)
+		a->max_last--;
+	a->max_queue[a->max_last++ & (a->size - 1)] = n;
+
+	sketch_add(a, x, 1);
+}
+
+/* Remove the oldest of the window's samples */
+static void
+remove_sample(struct aggregates *a)
+{
+	long long n = a->first++;
+	double x = a->samples[n & (a->size - 1)].x;
+
+	if (a->first == a->last)
+		a->sum = 0;	/* Avoid accumulating rounding errors */
+	else
+		a->sum -= x;
+	if (a->min_queue[a->min_first & (a->size - 1)] == n)
+		a->min_first++;
+	if (a->max_queue[a->max_first & (a->size - 1)] == n)
+		a->max_first++;
+	sketch_add(a, x, -1);
+}
+
+/*
+ * Complete the parsing of the record ending at the input position end,
+ * adding its field to the samples, if the field is a number
+ */
+static void
+end_record(struct aggregates *a, long long end)
+{
+	char *endptr;
+	double x;
+
+	if (a->token_length > 0 && a->token_length < (int)sizeof(a->token)) {
+		a->token[a->token_length] = 0;
+		x = strtod(a->token, &endptr);
+		if (endptr != a->token && isfinite(x)) {
+			while (isspace((unsigned char)*endptr))
+				endptr++;
+			if (*endptr == 0)
+				add_sample(a, x, end);
 		}
-		break;
-	case 0:			/* EOF */
-		close(c->fd);
-		c->state = s_inactive;
-		DPRINTF(4, "Done with client %p", c);
-		update_oldest_buffer();
-		break;
-	default:		/* Have data. Insert buffer at the end of the queue. */
-		DPRINTF(4, "Read command %c from client %p", cmd, c);
-		switch (cmd) {
-		case 'L':
-			c->state = s_send_last;
-			break;
-		case 'Q':
-			(void)unlink(socket_path);
-			exit(0);
-		case 'c':
-			c->state = s_send_current_nblk;
-			break;
-		case 'C':
-			c->state = s_send_current;
-			if (time_window && head)
-				update_current_record();	/* Refresh have_record */
-			break;
-		default:
-			errx(5, "Unknown command [%c]", cmd);
+	}
+	a->record_field = 0;
+	a->token_length = 0;
+}
+
+/* Parse the character ch of the record being added to the aggregates */
+static void
+parse_record_char(struct aggregates *a, char ch)
+{
+	if (a->field) {
+		/* Fields are separated by blanks, as in awk(1) */
+		if (ch == ' ' || ch == '\t' || ch == '\n') {
+			if (a->record_field > 0)
+				a->record_field = -a->record_field;
+			return;
 		}
+		if (a->record_field <= 0)
+			a->record_field = -a->record_field + 1;
+		if (a->record_field != a->field)
+			return;
 	}
+	/* A token that does not fit cannot be a number */
+	if (a->token_length < (int)sizeof(a->token) - 1)
+		a->token[a->token_length++] = ch;
+	else
+		a->token_length = sizeof(a->token);
 }
 
 /*
- * Write a single record to the specified client
- * Update the write_begin pointer
- * Close the connection and clean the client if done
- * If write_length is true, precede the record with
- * CONTENT_LENGTH_DIGITS digits representing the record's
- * length.
+ * Bring the aggregates up to date with the current record's window,
+ * adding the records that entered it and removing those that left it
  */
 static void
-write_record(struct client *c, bool write_length)
+update_aggregates(void)
 {
-	int n;
-	int towrite;
-	struct iovec iov[2], *iovptr;
-	char length[CONTENT_LENGTH_DIGITS + 2];
+	struct aggregates *a = value->aggregates;
+	long long begin, end, pos;
+	struct dpointer dp;
+	char *p;
+	int i, n;
 
-	DPRINTF(4, "Write %srecord for client %p", write_length ? "first " : "", c);
-	if (c->write_begin.b == c->write_end.b) {
-		towrite = c->write_end.pos - c->write_begin.pos;
-		DPRINTF(4, "Single buffer %p: writing %d bytes. write_end.pos=%d write_begin.pos=%d",
-			c->write_begin.b, towrite, c->write_end.pos, c->write_begin.pos);
-	} else {
-		towrite = c->write_begin.b->size - c->write_begin.pos;
-		DPRINTF(4, "Multiple buffers %p %p: writing %d bytes. write_begin.b->size=%d write_begin.pos=%d",
-			c->write_begin.b, c->write_end.b,
-			towrite, c->write_begin.b->size, c->write_begin.pos);
-	}
+	if (a == NULL)
+		return;
 
-	iov[1].iov_base = c->write_begin.b->data + c->write_begin.pos;
-	iov[1].iov_len = towrite;
-	DPRINTF(4, "Writing [%.*s]", (int)iov[1].iov_len, (char *)iov[1].iov_base);
+	if (!value->have_record) {
+		/* An empty window; start afresh with the next one */
+		while (a->first < a->last)
+			remove_sample(a);
+		a->end = -1;
+		return;
+	}
 
-	if (write_length) {
-		snprintf(length, sizeof(length), CONTENT_LENGTH_FORMAT, content_length(c));
-		iov[0].iov_base = length;
-		iov[0].iov_len = CONTENT_LENGTH_DIGITS;
-		iovptr = iov;
-	} else
-		iovptr = iov + 1;
+	begin = dpointer_offset(&value->current_record_begin);
+	end = dpointer_offset(&value->current_record_end);
 
-	if ((n = writev(c->fd, iovptr, write_length ? 2 : 1)) == -1)
-		switch (errno) {
-		case EAGAIN:
-			DPRINTF(4, "EAGAIN on client socket write");
-			return;
-		default:
-			err(3, "Write to socket");
-		}
+	/* Remove the records that left the window */
+	while (a->first < a->last &&
+	    a->samples[a->first & (a->size - 1)].end <= begin)
+		remove_sample(a);
 
-	if (write_length) {
-		if (n < CONTENT_LENGTH_DIGITS)
-			errx(5, "Short content length record write: %d", n);
-		n -= CONTENT_LENGTH_DIGITS;
+	/* Skip records that entered and left the window between updates */
+	if (a->end <= begin) {
+		a->end = begin;
+		a->end_dp = value->current_record_begin;
+		a->record_field = 0;
+		a->token_length = 0;
 	}
 
-	c->write_begin.pos += n;
+	/* Add the records that entered the window */
+	dp = a->end_dp;
+	for (pos = a->end; pos < end; ) {
+		if (dp.pos == dp.b->size) {
+			dp.b = dp.b->next;
+			dp.pos = 0;
+			continue;
+		}
+		p = dp.b->data + dp.pos;
+		n = MIN(dp.b->size - dp.pos, end - pos);
+		for (i = 0; i < n; i++) {
+			pos++;
+			if (value->rl) {
+				parse_record_char(a, p[i]);
+				if (pos % value->rl == 0)
+					end_record(a, pos);
+			} else if (p[i] == value->rt)
+				end_record(a, pos);
+			else
+				parse_record_char(a, p[i]);
+		}
+		dp.pos += n;
+	}
+	a->end = end;
+	a->end_dp = dp;
+	DPRINTF(4, "Aggregating %lld samples", a->last - a->first);
+}
+
+/* Return the smallest of the window's samples */
+static double
+aggregate_min(struct aggregates *a)
+{
+	return a->samples[a->min_queue[a->min_first & (a->size - 1)] & (a->size - 1)].x;
+}
+
+/* Return the largest of the window's samples */
+static double
+aggregate_max(struct aggregates *a)
+{
+	return a->samples[a->max_queue[a->max_first & (a->size - 1)] & (a->size - 1)].x;
+}
+
+/*
+ * Return an approximation of the specified percentile of the window's
+ * samples: the smallest sample that is greater than or equal to
+ * percent% of them (the nearest-rank definition)
+ */
+static double
+quantile(struct aggregates *a, int percent)
+{
+	/* Zero-based rank, rounded up in integer arithmetic */
+	long long rank = (percent * (a->last - a->first) + 99) / 100 - 1;
+	long long seen = 0;
+	double min = aggregate_min(a);
+	double max = aggregate_max(a);
+	double x = max;
+	int i;
+
+	for (i = a->negative.n - 1; i >= 0; i--)
+		if ((seen += a->negative.counts[i]) > rank) {
+			x = -bucket_value(a->negative.first + i);
+			goto found;
+		}
+	if ((seen += a->zero_count) > rank) {
+		x = 0;
+		goto found;
+	}
+	for (i = 0; i < a->positive.n; i++)
+		if ((seen += a->positive.counts[i]) > rank) {
+			x = bucket_value(a->positive.first + i);
+			break;
+		}
+found:
+	/* Keep the approximation within the samples' range */
+	return MAX(min, MIN(max, x));
+}
+
+#ifdef __linux__
+/* Initialize the mechanism for waiting for events */
+static void
+watch_init(void)
+{
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(2, "epoll_create1");
+}
+
+/*
+ * Wait for the specified events on the watched file descriptor.
+ * Errors and hangups are always reported.
+ * Return false if the file descriptor does not support waiting
+ * for events, as is the case for regular files.
+ */
+static bool
+watch_set(struct watch *w, int events)
+{
+	struct epoll_event ev;
+
+	if (w->slot != -1 && w->events == events)
+		return true;
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epoll_fd, w->slot == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+				w->fd, &ev) == -1) {
+		if (errno == EPERM)
+			return false;
+		err(2, "epoll_ctl");
+	}
+	w->slot = 0;
+	w->events = events;
+	return true;
+}
+
+/* Stop watching the specified file descriptor */
+static void
+watch_remove(struct watch *w)
+{
+	if (w->slot == -1)
+		return;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL) == -1)
+		err(2, "epoll_ctl");
+	w->slot = -1;
+}
+
+/*
+ * Wait up to timeout ms (-1 for ever) for events on the watched file
+ * descriptors, and call handle for each one that has any.
+ * Return the number of file descriptors that had events.
+ */
+static int
+watch_wait(int timeout, void (*handle)(struct watch *w, int revents))
+{
+	struct epoll_event ev[MAX_EVENTS];
+	int i, n;
+
+	while ((n = epoll_wait(epoll_fd, ev, MAX_EVENTS, timeout)) == -1)
+		if (errno != EINTR)
+			err(3, "epoll_wait");
+	for (i = 0; i < n; i++)
+		handle(ev[i].data.ptr, ev[i].events);
+	return n;
+}
+#else
+static void
+watch_init(void)
+{
+}
+
+static bool
+watch_set(struct watch *w, int events)
+{
+	if (w->slot == -1) {
+		if (poll_nfds == poll_size) {
+			poll_size = poll_size ? 2 * poll_size : 64;
+			if ((poll_fds = realloc(poll_fds,
+					poll_size * sizeof(*poll_fds))) == NULL ||
+			    (poll_watches = realloc(poll_watches,
+					poll_size * sizeof(*poll_watches))) == NULL)
+				err(2, "Error allocating poll array");
+		}
+		w->slot = poll_nfds++;
+		poll_fds[w->slot].fd = w->fd;
+		poll_watches[w->slot] = w;
+	}
+	poll_fds[w->slot].events = w->events = events;
+	return true;
+}
+
+static void
+watch_remove(struct watch *w)
+{
+	int last;
+
+	if (w->slot == -1)
+		return;
+	last = --poll_nfds;
+	/* Fill the hole with the array's last element */
+	poll_fds[w->slot] = poll_fds[last];
+	poll_watches[w->slot] = poll_watches[last];
+	poll_watches[w->slot]->slot = w->slot;
+	w->slot = -1;
+}
+
+static int
+watch_wait(int timeout, void (*handle)(struct watch *w, int revents))
+{
+	int i, n;
+
+	while ((n = poll(poll_fds, poll_nfds, timeout)) == -1)
+		if (errno != EINTR)
+			err(3, "poll");
+	/*
+	 * Go backwards, so that elements moved by watch_remove() and
+	 * added by handle() are not visited.
+	 */
+	for (i = poll_nfds - 1; i >= 0; i--)
+		if (poll_fds[i].revents)
+			handle(poll_watches[i], poll_fds[i].revents);
+	return n;
+}
+#endif
+
+/* Move client c to the specified list; NULL removes it from its list. */
+static void
+list_move(struct client *c, struct client **list)
+{
+	if (c->list == list)
+		return;
+	if (c->list) {
+		if (c->prev)
+			c->prev->next = c->next;
+		else
+			*c->list = c->next;
+		if (c->next)
+			c->next->prev = c->prev;
+	}
+	c->list = list;
+	if (list) {
+		c->prev = NULL;
+		c->next = *list;
+		if (*list)
+			(*list)->prev = c;
+		*list = c;
+	}
+}
+
+/*
+ * Set the state of client c, and arrange for it to be served
+ * when its socket and our data are ready for the state.
+ */
+static void
+set_state(struct client *c, int state)
+{
+	struct client **list = NULL;
+	int events = 0;
+
+	c->state = state;
+	switch (c->state) {
+	case s_read_command:		/* Waiting for a command (Q or R) to be read */
+	case s_read_key:		/* Waiting for the name of the value to read */
+	case s_wait_close:		/* Wait for another command or for the client to close the connection */
+		events = EVENT_IN;
+		break;
+	case s_subscribed:		/* Waiting for a record to push to a subscriber */
+		events = EVENT_IN;	/* Notice when the client hangs up */
+		list = &value->subscribers;
+		break;
+	case s_send_current:		/* Waiting for the current value to be written */
+		if (value->have_record)
+			events = EVENT_OUT;
+		else
+			list = &value->waiting_record;
+		break;
+	case s_send_last:		/* Waiting for the last (before EOF) value to be written */
+		if (value->reached_eof)
+			events = EVENT_OUT;
+		else
+			list = &value->waiting_eof;
+		break;
+	case s_send_current_nblk:	/* Waiting for a response to be written */
+		events = EVENT_OUT;
+		break;
+	case s_sending_response:	/* A response is being sent */
+		events = EVENT_OUT;
+		list = &value->sending;
+		break;
+	case s_send_segment:		/* The shared memory segment is to be sent */
+	case s_send_aggregates:		/* The aggregates are to be written */
+		events = EVENT_OUT;
+		break;
+	}
+	list_move(c, list);
+	(void)watch_set(&c->w, events);
+}
+
+/* Close the connection with client c and free it */
+static void
+close_client(struct client *c)
+{
+	list_move(c, NULL);
+	watch_remove(&c->w);
+	close(c->w.fd);
+	DPRINTF(4, "Done with client %p", c);
+	free(c->text);
+	free(c);
+}
+
+/*
+ * Return true if the specified socket I/O error means that the client
+ * hung up, for example a subscriber whose output reader exited.
+ * Such a client is closed, without affecting the store's other clients.
+ */
+static bool
+client_hung_up(struct client *c)
+{
+	if (errno != EPIPE && errno != ECONNRESET)
+		return false;
+	DPRINTF(4, "Client %p hung up", c);
+	close_client(c);
+	update_oldest_buffer();
+	return true;
+}
+
+/*
+ * Read a one character command from the specifid client and act on it
+ * The following commands are supported:
+ * C: Read the current value, waiting for one to become available
+ * c: Read the current value, or an empty one if none is available
+ * A: Read the aggregates of the current value's records
+ * L: Read the last value, waiting for the end of file
+ * K: Select the value named by the following characters up to a newline
+ * M: Map the shared memory segment publishing the current value
+ * Q: Quit (Terminate the operation of this data store)
+ * S: Subscribe to the current value, receiving each new one as it appears
+ * A client can send further commands on the same connection;
+ * these are read after the response to the previous one is written.
+ * A command sent by a subscriber ends its subscription.
+ */
+
+static void
+read_command(struct client *c)
+{
+	char cmd;
+	int n;
+
+	switch (n = read(c->w.fd, &cmd, 1)) {
+	case -1: 		/* Error */
+		switch (errno) {
+		case EAGAIN:
+			DPRINTF(4, "EAGAIN on client socket read");
+			break;
+		default:
+			if (!client_hung_up(c))
+				err(3, "Read from socket");
+		}
+		break;
+	case 0:			/* EOF */
+		close_client(c);
+		update_oldest_buffer();
+		break;
+	default:		/* Have data. Insert buffer at the end of the queue. */
+		DPRINTF(4, "Read command %c from client %p", cmd, c);
+		c->subscribed = false;
+		switch (cmd) {
+		case 'L':
+			set_state(c, s_send_last);
+			break;
+		case 'Q':
+			(void)unlink(socket_path);
+			exit(0);
+		case 'c':
+			set_state(c, s_send_current_nblk);
+			break;
+		case 'K':
+			c->key_length = 0;
+			set_state(c, s_read_key);
+			break;
+		case 'M':
+			set_state(c, s_send_segment);
+			break;
+		case 'S':
+			c->subscribed = true;
+			c->sent_begin_seq = -1;		/* Nothing sent yet */
+			set_state(c, s_subscribed);
+			break;
+		case 'C':
+			if (value->time_window && value->head) {
+				update_current_record();	/* Refresh have_record */
+				update_aggregates();
+			}
+			set_state(c, s_send_current);
+			break;
+		case 'A':
+			if (value->time_window && value->head) {
+				update_current_record();	/* Refresh the window */
+				update_aggregates();
+			}
+			set_state(c, s_send_aggregates);
+			break;
+		default:
+			errx(5, "Unknown command [%c]", cmd);
+		}
+	}
+}
+
+/*
+ * Read from the specified client the name of the value it wants to read,
+ * select that value, and acknowledge the selection.
+ * Close the connection if the store has no such value.
+ */
+static void
+read_key(struct client *c)
+{
+	char ch;
+	int i;
+
+	for (;;) {
+		switch (read(c->w.fd, &ch, 1)) {
+		case -1: 		/* Error */
+			switch (errno) {
+			case EAGAIN:
+				DPRINTF(4, "EAGAIN on client socket read");
+				return;
+			default:
+				if (client_hung_up(c))
+					return;
+				err(3, "Read from socket");
+			}
+		case 0:			/* EOF */
+			close_client(c);
+			return;
+		}
+		if (ch != '\n') {
+			if (c->key_length == KVSTORE_KEY_MAX)
+				break;
+			c->key[c->key_length++] = ch;
+			continue;
+		}
+		c->key[c->key_length] = 0;
+		for (i = 0; i < nvalues; i++)
+			if (values[i].name && strcmp(values[i].name, c->key) == 0) {
+				DPRINTF(4, "Client %p reads value %s", c, c->key);
+				c->value = value = &values[i];
+				/* Nothing else is being written to the client */
+				if (write(c->w.fd, "K", 1) == -1) {
+					if (client_hung_up(c))
+						return;
+					err(3, "Write to socket");
+				}
+				set_state(c, s_read_command);
+				return;
+			}
+		break;
+	}
+	DPRINTF(4, "Client %p asked for an unknown value", c);
+	close_client(c);
+}
+
+/*
+ * Write a single record to the specified client
+ * Update the write_begin pointer
+ * Wait for another command once the record is written
+ * If write_length is true, precede the record with
+ * CONTENT_LENGTH_DIGITS digits representing the record's
+ * length.
+ */
+static void
+write_record(struct client *c, bool write_length)
+{
+	int n;
+	int towrite;
+	struct iovec iov[2], *iovptr;
+
+	DPRINTF(4, "Write %srecord for client %p", write_length ? "first " : "", c);
+	if (c->write_begin.b == c->write_end.b) {
+		towrite = c->write_end.pos - c->write_begin.pos;
+		DPRINTF(4, "Single buffer %p: writing %d bytes. write_end.pos=%d write_begin.pos=%d",
+			c->write_begin.b, towrite, c->write_end.pos, c->write_begin.pos);
+	} else {
+		towrite = c->write_begin.b->size - c->write_begin.pos;
+		DPRINTF(4, "Multiple buffers %p %p: writing %d bytes. write_begin.b->size=%d write_begin.pos=%d",
+			c->write_begin.b, c->write_end.b,
+			towrite, c->write_begin.b->size, c->write_begin.pos);
+	}
+
+	iov[1].iov_base = c->write_begin.b->data + c->write_begin.pos;
+	iov[1].iov_len = towrite;
+	DPRINTF(4, "Writing [%.*s]", (int)iov[1].iov_len, (char *)iov[1].iov_base);
+
+	if (write_length) {
+		snprintf(c->length, sizeof(c->length), CONTENT_LENGTH_FORMAT,
+			content_length(&c->write_begin, &c->write_end));
+		c->length_left = CONTENT_LENGTH_DIGITS;
+	}
+	if (c->length_left) {
+		iov[0].iov_base = c->length + CONTENT_LENGTH_DIGITS - c->length_left;
+		iov[0].iov_len = c->length_left;
+		iovptr = iov;
+	} else
+		iovptr = iov + 1;
+
+	if ((n = writev(c->w.fd, iovptr, c->length_left ? 2 : 1)) == -1)
+		switch (errno) {
+		case EAGAIN:
+			DPRINTF(4, "EAGAIN on client socket write");
+			return;
+		default:
+			if (client_hung_up(c))
+				return;
+			err(3, "Write to socket");
+		}
+
+	/*
+	 * The socket buffer may hold only part of the content length,
+	 * when the client sends further commands before reading the
+	 * responses to its previous ones.
+	 */
+	if (c->length_left) {
+		if (n < c->length_left) {
+			c->length_left -= n;
+			return;
+		}
+		n -= c->length_left;
+		c->length_left = 0;
+	}
+
+	c->write_begin.pos += n;
 	DPRINTF(4, "Wrote %u data bytes. Current buffer position=%d", n, c->write_begin.pos);
 	/*
 	 * More data to write from this buffer?
@@ -777,30 +1766,271 @@ write_record(struct client *c, bool write_length)
 
 	/* Done with this client */
 	DPRINTF(4, "No more data to write for client %p", c);
-	c->state = s_wait_close;
+	set_state(c, c->subscribed ? s_subscribed : s_wait_close);
+}
+
+/*
+ * Append to the client's text response the specified aggregate
+ * and its value
+ */
+static void
+append_aggregate(struct client *c, int size, const char *name, double x)
+{
+	c->text_length += snprintf(c->text + c->text_length,
+		size - c->text_length, "%s %.15g\n", name, x);
 }
 
-/* Set the buffer's counters */
+/*
+ * Write to the specified client the aggregates of the current value's
+ * window, one per line, preceded by their content length.
+ * The response is empty if the value's aggregates are not kept.
+ */
+static void
+write_aggregates(struct client *c)
+{
+	struct aggregates *a = value->aggregates;
+	long long count;
+	int n, size = 512;
+
+	if (c->text == NULL) {
+		if ((c->text = malloc(size)) == NULL)
+			err(1, "Unable to allocate response");
+		c->text_length = CONTENT_LENGTH_DIGITS;
+		if (a) {
+			count = a->last - a->first;
+			c->text_length += snprintf(c->text + c->text_length,
+				size - c->text_length, "count %lld\n", count);
+			append_aggregate(c, size, "sum", (double)a->sum);
+			if (count) {
+				append_aggregate(c, size, "min", aggregate_min(a));
+				append_aggregate(c, size, "max", aggregate_max(a));
+				append_aggregate(c, size, "mean", (double)(a->sum / count));
+				append_aggregate(c, size, "p50", quantile(a, 50));
+				append_aggregate(c, size, "p90", quantile(a, 90));
+				append_aggregate(c, size, "p99", quantile(a, 99));
+			}
+		}
+		snprintf(c->length, sizeof(c->length), CONTENT_LENGTH_FORMAT,
+			c->text_length - CONTENT_LENGTH_DIGITS);
+		memcpy(c->text, c->length, CONTENT_LENGTH_DIGITS);
+		c->text_written = 0;
+	}
+	if ((n = write(c->w.fd, c->text + c->text_written,
+	    c->text_length - c->text_written)) == -1)
+		switch (errno) {
+		case EAGAIN:
+			DPRINTF(4, "EAGAIN on client socket write");
+			return;
+		default:
+			if (client_hung_up(c))
+				return;
+			err(3, "Write to socket");
+		}
+	c->text_written += n;
+	if (c->text_written < c->text_length)
+		return;
+	DPRINTF(4, "Wrote aggregates to client %p", c);
+	free(c->text);
+	c->text = NULL;
+	set_state(c, s_wait_close);
+}
+
+/*
+ * Return true if buffers of a time window's value have yet to enter
+ * the window
+ */
+static bool
+window_entry_pending(void)
+{
+	struct timeval now, abs_rbegin_time;
+
+	if (!value->time_window || !value->tail)
+		return false;
+	gettimeofday(&now, NULL);
+	timersub(&now, &value->record_rbegin.t, &abs_rbegin_time);
+	return timercmp(&value->tail->timestamp, &abs_rbegin_time, >);
+}
+
+/* Return true if the current record is the one last sent to the client */
+static bool
+sent_current_record(struct client *c)
+{
+	return c->sent_begin_seq == value->current_record_begin.b->seq &&
+		c->sent_begin_pos == value->current_record_begin.pos &&
+		c->sent_end_seq == value->current_record_end.b->seq &&
+		c->sent_end_pos == value->current_record_end.pos;
+}
+
+/*
+ * Send to the client a byte accompanied by the file descriptor of
+ * the shared memory segment, if there is one
+ */
+static void
+send_segment(struct client *c)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr h;
+		unsigned char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec io = { .iov_base = "M", .iov_len = 1 };
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+	if (value->segment_fd != -1) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), &value->segment_fd, sizeof(int));
+	}
+	if (sendmsg(c->w.fd, &msg, 0) == -1)
+		switch (errno) {
+		case EAGAIN:
+			DPRINTF(4, "EAGAIN on client socket sendmsg");
+			return;
+		default:
+			if (client_hung_up(c))
+				return;
+			err(3, "Send to socket");
+		}
+	DPRINTF(4, "Sent segment to client %p", c);
+	set_state(c, s_wait_close);
+}
+
+/* Mark the start of an update to the shared memory segment */
+static void
+segment_lock(void)
+{
+	__atomic_store_n(&value->segment->seq, value->segment->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Mark the end of an update to the shared memory segment */
+static void
+segment_unlock(void)
+{
+	__atomic_store_n(&value->segment->seq, value->segment->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Publish the current record in the shared memory segment.
+ * With a record window the current record changes only when more
+ * records are read, or when the end of file is reached.
+ */
+static void
+publish_record(void)
+{
+	uint32_t flags = 0;
+	long long record_count;
+	unsigned int length;
+	struct dpointer dp;
+	char *p;
+	int n;
+
+	if (value->segment == NULL)
+		return;
+
+	record_count = value->tail ? value->tail->record_count : 0;
+	if (value->have_record)
+		flags |= KVSTORE_HAVE_RECORD;
+	if (value->reached_eof)
+		flags |= KVSTORE_EOF;
+	if (value->segment->record_count == (uint64_t)record_count &&
+	    (value->segment->flags & ~KVSTORE_TOO_LARGE) == flags)
+		return;
+
+	segment_lock();
+	if (value->have_record) {
+		length = content_length(&value->current_record_begin, &value->current_record_end);
+		if (length > value->segment->capacity) {
+			flags |= KVSTORE_TOO_LARGE;
+			length = 0;
+		}
+		/* Copy the record from the buffers it spans */
+		for (dp = value->current_record_begin, p = value->segment->data; p < value->segment->data + length; ) {
+			n = (dp.b == value->current_record_end.b ? value->current_record_end.pos : dp.b->size) - dp.pos;
+			memcpy(p, dp.b->data + dp.pos, n);
+			p += n;
+			dp.b = dp.b->next;
+			dp.pos = 0;
+		}
+	} else
+		length = 0;
+	value->segment->length = length;
+	value->segment->record_count = record_count;
+	value->segment->flags = flags;
+	segment_unlock();
+	DPRINTF(4, "Published %u bytes of record %lld", length, record_count);
+}
+
+/* Let the shared memory segment readers know that the store exited */
+static void
+close_segments(void)
+{
+	for (value = values; value < values + nvalues; value++)
+		if (value->segment) {
+			segment_lock();
+			value->segment->flags |= KVSTORE_CLOSED;
+			segment_unlock();
+		}
+}
+
+/* Create the shared memory segment in which the current record is published */
+static void
+create_segment(void)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	size_t size = sizeof(struct kvstore_segment) + value->segment_capacity;
+
+	if ((value->segment_fd = memfd_create("dgsh-store", MFD_CLOEXEC)) == -1 ||
+	    ftruncate(value->segment_fd, size) == -1 ||
+	    (value->segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    value->segment_fd, 0)) == MAP_FAILED)
+		err(1, "Unable to create shared memory segment");
+	value->segment->capacity = value->segment_capacity;
+#else
+	/* Readers fall back to reading the record through the socket */
+	warnx("Shared memory publication is not supported on this platform");
+#endif
+}
+
+/*
+ * Update the buffer's counters for the data stored in it
+ * from position from onward.
+ */
 void
-set_buffer_counters(struct buffer *b)
+set_buffer_counters(struct buffer *b, int from)
 {
-	if (time_window)
+	if (value->time_window)
 		gettimeofday(&b->timestamp, NULL);
 
-	if (rl == 0) {
-		/* Count records using RS */
-		int i;
-
-		b->record_count = b->prev ? b->prev->record_count : 0;
-		for (i = 0; i < b->size; i++)
-			if (b->data[i] == rt)
-				b->record_count++;
+	if (value->rl == 0) {
+		/* Count records using RS, recording their positions */
+		char *p, *end = b->data + b->size;
+		struct dpointer *dp;
+
+		if (from == 0)
+			b->record_count = b->prev ? b->prev->record_count : 0;
+		for (p = b->data + from; (p = memchr(p, value->rt, end - p)) != NULL; p++) {
+			if (value->rt_ring) {
+				dp = &value->rt_ring[b->record_count % value->rt_ring_size];
+				dp->b = b;
+				dp->pos = p - b->data + 1;
+			}
+			b->record_count++;
+		}
 	} else {
 		/* Count records using RL */
 
-		b->byte_count = b->prev ? b->prev->byte_count : 0;
-		b->byte_count += b->size;
-		b->record_count = b->byte_count / rl;
+		if (from == 0)
+			b->byte_count = b->prev ? b->prev->byte_count : 0;
+		b->byte_count += b->size - from;
+		b->record_count = b->byte_count / value->rl;
 	}
 }
 
@@ -808,69 +2038,88 @@ set_buffer_counters(struct buffer *b)
 #if __GNUC__ == 4 && __GNUC_MINOR__ >= 2 && __GNUC_MINOR__ < 6
 #pragma GCC diagnostic ignored "-Wuninitialized"
 #endif
-/* Read data from STDIN into a new buffer */
+/*
+ * Read data from the value's input, appending it to the last buffer
+ * if it has space left, or into a new buffer.
+ */
 static void
 buffer_read(void)
 {
 	struct buffer *b;
 	struct timeval now, abs_rend_time;
+	bool append;
+	int from, n;
 
-	if ((b = malloc(sizeof(struct buffer))) == NULL)
-		err(1, "Unable to allocate read buffer");
+	append = !value->time_window && value->tail && value->tail->size < value->buffer_capacity;
+	if (append) {
+		b = value->tail;
+		from = b->size;
+	} else {
+		b = buffer_alloc();
+		b->offset = value->bytes_read;
+		from = 0;
+	}
 
-	DPRINTF(4, "Calling read on stdin for buffer %p", b);
-	switch (b->size = read(STDIN_FILENO, b->data, sizeof(b->data))) {
+	DPRINTF(4, "Calling read on the input for buffer %p at %d", b, from);
+	switch (n = dgsh_read(value->input_watch.fd, b->data + from, value->buffer_capacity - from)) {
 	case -1: 		/* Error */
 		switch (errno) {
 		case EAGAIN:
-			DPRINTF(4, "EAGAIN on standard input");
-			free(b);
+			DPRINTF(4, "EAGAIN on the input");
+			if (!append)
+				buffer_free(b);
 			break;
 		default:
-			err(3, "Read from standard input");
+			err(3, "Read from input");
 		}
 		break;
 	case 0:			/* EOF */
-		reached_eof = true;
-		if (time_window) {
+		value->reached_eof = true;
+		if (value->time_window) {
 			/* Make abs_rend_time the latest absolute time that interests us */
 			gettimeofday(&now, NULL);
-			timeradd(&now, &record_rend.t, &abs_rend_time);
+			timeradd(&now, &value->record_rend.t, &abs_rend_time);
 		}
-		if (have_record) {
-			free(b);
+		if (value->have_record) {
+			if (!append)
+				buffer_free(b);
 #if __GNUC__ >= 4 && __GNUC_MINOR__ >= 6
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
 #endif
-		} else if (!time_window || !tail ||
-		    timercmp(&tail->timestamp, &abs_rend_time, >)) {
+		} else if (!value->time_window || !value->tail ||
+		    timercmp(&value->tail->timestamp, &abs_rend_time, >)) {
 #if __GNUC__ >= 4 && __GNUC_MINOR__ >= 6
 #pragma GCC diagnostic pop
 #endif
 			/* Setup an empty record, if there will never be a record to send */
+			if (append) {
+				b = buffer_alloc();
+				b->offset = value->bytes_read;
+			}
 			b->size = 0;
-			b->prev = b->next = NULL;
-			head = tail = b;
-			current_record_begin.b = current_record_end.b = b;
-			current_record_begin.pos = current_record_end.pos = 0;
-			have_record = true;
-		}
+			b->record_count = value->tail ? value->tail->record_count : 0;
+			value->head = value->tail = NULL;
+			queue_buffer(b);
+			value->current_record_begin.b = value->current_record_end.b = b;
+			value->current_record_begin.pos = value->current_record_end.pos = 0;
+			value->have_record = true;
+		} else if (!append)
+			buffer_free(b);
 		break;
 	default:		/* Have data. Insert buffer at the end of the queue. */
-		b->prev = tail;
-		b->next = NULL;
-		if (tail)
-			tail->next = b;
-		tail = b;
-		if (!head)
-			head = b;
+		b->size = from + n;
+		value->bytes_read += n;
+		if (!append)
+			queue_buffer(b);
 		DPRINTF(4, "Read %d bytes into %p prev=%p next=%p head=%p tail=%p",
-			b->size, b, b->prev, b->next, head, tail);
-		set_buffer_counters(b);
+			n, b, b->prev, b->next, value->head, value->tail);
+		set_buffer_counters(b, from);
 		update_current_record();
 		break;
 	}
+	update_aggregates();
+	publish_record();
 }
 
 /*
@@ -891,25 +2140,49 @@ non_block(int fd)
 		err(2, "Error setting socket to non-blocking mode");
 }
 
-/* Return an initialized free client entry, or exit with an error. */
-static struct client *
-get_free_client(void)
+/* Start serving a client connected through the specified socket */
+static void
+new_client(int fd)
 {
-	int i;
+	struct client *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(2, "Error allocating client");
+	non_block(fd);
+	c->w.fd = fd;
+	c->w.slot = -1;
+	c->value = value = &values[0];
+	set_state(c, s_read_command);
+	DPRINTF(4, "New client %p", c);
+}
+
+/*
+ * Allow the number of open files, and thereby of clients,
+ * to reach the maximum the system allows us.
+ */
+static void
+raise_open_file_limit(void)
+{
+	struct rlimit limit;
 
-	for (i = 0; i < MAX_CLIENTS; i++)
-		if (clients[i].state == s_inactive)
-			return &clients[i];
-	errx(5, "Maximum number of clients exceeded for socket %s", socket_path);
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+	    limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &limit);
+	}
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-l len|-t char] [-b n] [-e n] [-u s|m|h|d|r] -s path\n"
+	fprintf(stderr, "Usage: %s [[-l len|-t char] [-a field] [-b n] [-e n] [-m size] [-u s|m|h|d|r]\n"
+		"\t[-k name]] ... -s path\n"
+		"-a field"	"\tKeep aggregates of the window's numeric field (0 for the whole record)\n"
 		"-b n"		"\tStore records beginning in a window n away from the end (default 1)\n"
 		"-e n"		"\tStore records ending in a window n away from the end (default 0)\n"
+		"-k name"	"\tStore under name a value with the preceding options\n"
 		"-l len"	"\tProcess fixed-width len-sized records\n"
+		"-m size"	"\tPublish records of up to size bytes in shared memory\n"
 		"-s path"	"\tSpecify the socket to create\n"
 		"-t char"	"\tProcess char-terminated records (newline default)\n"
 		"-u unit"	"\tSpecify the unit of window boundaries\n"
@@ -954,39 +2227,119 @@ double_to_timeval(double d)
 	return t;
 }
 
+/*
+ * Add to the store a value with the specified name and options,
+ * whose window boundaries are measured in the specified unit.
+ */
+static void
+add_value(const char *name, const struct value *options, char unit)
+{
+	int i;
+
+	if (name) {
+		if (*name == 0 || strlen(name) > KVSTORE_KEY_MAX ||
+		    strchr(name, '\n'))
+			errx(6, "Invalid value name [%s]", name);
+		for (i = 0; i < nvalues; i++)
+			if (values[i].name && strcmp(values[i].name, name) == 0)
+				errx(6, "Value [%s] specified more than once", name);
+	}
+	values = realloc(values, ++nvalues * sizeof(struct value));
+	if (values == NULL)
+		err(1, "Unable to allocate memory for value");
+	value = &values[nvalues - 1];
+	*value = *options;
+	value->name = name;
+	value->segment_fd = -1;
+
+	switch (unit) {
+	case 'r':
+		if (value->record_rbegin.d != (int)value->record_rbegin.d ||
+		    value->record_rend.d != (int)value->record_rend.d)
+		    	errx(6, "Record numbers must be integers");
+		value->record_rbegin.r = (int)value->record_rbegin.d;
+		value->record_rend.r = (int)value->record_rend.d;
+		value->time_window = false;
+		break;
+	case 'd':
+		value->record_rbegin.d *= 24;
+		value->record_rend.d *= 24;
+		/* FALLTHROUGH */
+	case 'h':
+		value->record_rbegin.d *= 60;
+		value->record_rend.d *= 60;
+		/* FALLTHROUGH */
+	case 'm':
+		value->record_rbegin.d *= 60;
+		value->record_rend.d *= 60;
+		/* FALLTHROUGH */
+	case 's':
+		value->record_rbegin.t = double_to_timeval(value->record_rbegin.d);
+		value->record_rend.t = double_to_timeval(value->record_rend.d);
+		if (!timercmp(&value->record_rbegin.t, &value->record_rend.t, <))
+			errx(6, "Begin time must be older than end time");
+		value->time_window = true;
+		if (value->segment_capacity)
+			errx(6, "Shared memory publication requires a record window");
+		break;
+	}
+}
+
 /* Parse the program's arguments */
 static void
 parse_arguments(int argc, char *argv[])
 {
 	int ch;
 	char unit = 'r';
+	/* By default return the last record read */
+	const struct value default_options = {
+		.rt = '\n',
+		.record_rbegin = { .d = 0 },
+		.record_rend = { .d = 1 },
+	};
+	struct value options = default_options;
+	bool have_options = false;
 
 	program_name = argv[0];
-	/* By default return the last record read */
-	record_rbegin.d = 0;
-	record_rend.d = 1;
 
-	while ((ch = getopt(argc, argv, "b:e:l:s:t:u:")) != -1) {
+	while ((ch = getopt(argc, argv, "a:b:e:k:l:m:s:t:u:")) != -1) {
 		switch (ch) {
+		case 'a':	/* Aggregated field */
+			if (!isdigit((unsigned char)*optarg))
+				usage();
+			options.aggregate = true;
+			options.aggregate_field = atoi(optarg);
+			break;
 		case 'b':	/* Begin record, measured from the end (0) */
-			record_rend.d = parse_double(optarg);
+			options.record_rend.d = parse_double(optarg);
 			break;
 		case 'e':	/* End record, measured from the end (0) */
-			record_rbegin.d = parse_double(optarg);
+			options.record_rbegin.d = parse_double(optarg);
 			break;
+		case 'k':	/* Named value; the preceding options apply to it */
+			add_value(optarg, &options, unit);
+			options = default_options;
+			unit = 'r';
+			have_options = false;
+			continue;
 		case 'l':	/* Fixed record length */
-			rl = atoi(optarg);
-			if (rl <= 0)
+			options.rl = atoi(optarg);
+			if (options.rl <= 0)
+				usage();
+			break;
+		case 'm':	/* Shared memory segment size */
+			options.segment_capacity = atoi(optarg);
+			if (options.segment_capacity <= 0)
 				usage();
 			break;
 		case 's':
 			socket_path = optarg;
-			break;
+			continue;
 		case 't':	/* Record terminator */
 			/* We allow \0 as rt */
 			if (strlen(optarg) > 1)
 				usage();
-			rt = *optarg;
+			options.rt = *optarg;
 			break;
 		case 'u':	/* Measurement unit */
 			if (strlen(optarg) != 1 || strchr("smhdr", *optarg) == NULL)
@@ -997,6 +2350,7 @@ parse_arguments(int argc, char *argv[])
 		default:
 			usage();
 		}
+		have_options = true;
 	}
 	argc -= optind;
 	argv += optind;
@@ -1004,33 +2358,107 @@ parse_arguments(int argc, char *argv[])
 	if (argc != 0 || socket_path == NULL)
 		usage();
 
-	switch (unit) {
-	case 'r':
-		if (record_rbegin.d != (int)record_rbegin.d ||
-		    record_rend.d != (int)record_rend.d)
-		    	errx(6, "Record numbers must be integers");
-		record_rbegin.r = (int)record_rbegin.d;
-		record_rend.r = (int)record_rend.d;
-		time_window = false;
+	if (nvalues == 0)
+		add_value(NULL, &options, unit);
+	else if (have_options)
+		errx(6, "Value options must precede the -k option naming the value");
+}
+
+/* Handle the events reported for the watched file descriptor w */
+static void
+handle_event(struct watch *w, int revents)
+{
+	struct client *c;
+
+	for (value = values; value < values + nvalues; value++)
+		if (w == &value->input_watch) {
+			buffer_read();
+			value->input_read = true;
+			return;
+		}
+
+	if (w == &listen_watch) {
+		int rsock;
+		socklen_t len;
+		struct sockaddr_un remote;
+
+		/* Accept all pending connections */
+		for (;;) {
+			len = sizeof(remote);
+			rsock = accept(w->fd, (struct sockaddr *)&remote, &len);
+			if (rsock == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				    errno == EINTR)
+					return;
+				err(5, "accept");
+			}
+			new_client(rsock);
+		}
+	}
+
+	c = (struct client *)w;
+	value = c->value;
+	if (w->events == 0) {
+		/* A client that is waiting for our data hung up */
+		close_client(c);
+		return;
+	}
+
+	switch (c->state) {
+	case s_read_command:		/* Waiting for a command (Q or R) to be read */
+	case s_wait_close:		/* Wait for another command or for the client to close the connection */
+	case s_subscribed:		/* Waiting for a record to push to a subscriber */
+		read_command(c);
 		break;
-	case 'd':
-		record_rbegin.d *= 24;
-		record_rend.d *= 24;
-		/* FALLTHROUGH */
-	case 'h':
-		record_rbegin.d *= 60;
-		record_rend.d *= 60;
-		/* FALLTHROUGH */
-	case 'm':
-		record_rbegin.d *= 60;
-		record_rend.d *= 60;
+	case s_read_key:		/* Waiting for the name of the value to read */
+		read_key(c);
+		break;
+	case s_send_current:		/* Waiting for a response to be written */
+		if (!value->have_record) {
+			/* The record left the time window; wait again */
+			set_state(c, s_send_current);
+			break;
+		}
 		/* FALLTHROUGH */
-	case 's':
-		record_rbegin.t = double_to_timeval(record_rbegin.d);
-		record_rend.t = double_to_timeval(record_rend.d);
-		if (!timercmp(&record_rbegin.t, &record_rend.t, <))
-			errx(6, "Begin time must be older than end time");
-		time_window = true;
+	case s_send_last:		/* Waiting for the last (before EOF) value to be written */
+		assert(value->have_record);
+		/* Start writing the most fresh last record */
+		c->write_begin = value->current_record_begin;
+		c->write_end = value->current_record_end;
+		c->sent_begin_seq = c->write_begin.b->seq;
+		c->sent_begin_pos = c->write_begin.pos;
+		c->sent_end_seq = c->write_end.b->seq;
+		c->sent_end_pos = c->write_end.pos;
+		set_state(c, s_sending_response);
+		value->oldest_buffer_being_written =
+			oldest_buffer(value->oldest_buffer_being_written, c->write_begin.b);
+		write_record(c, true);
+		break;
+	case s_send_current_nblk:	/* Waiting for a response (even empty) to be written */
+		if (value->have_record) {
+			/* Start writing the most fresh last record */
+			c->write_begin = value->current_record_begin;
+			c->write_end = value->current_record_end;
+			value->oldest_buffer_being_written =
+				oldest_buffer(value->oldest_buffer_being_written, c->write_begin.b);
+		} else {
+			static struct buffer empty;
+
+			/* Write an empty record */
+			c->write_begin.b = c->write_end.b = &empty;
+			c->write_begin.pos = c->write_end.pos = 0;
+		}
+		set_state(c, s_sending_response);
+		write_record(c, true);
+		break;
+	case s_sending_response:	/* A response is being written */
+		write_record(c, false);
+		break;
+	case s_send_segment:		/* The shared memory segment is to be sent */
+		send_segment(c);
+		break;
+	case s_send_aggregates:		/* The aggregates are to be written */
+		write_aggregates(c);
 		break;
 	}
 }
@@ -1042,176 +2470,119 @@ parse_arguments(int argc, char *argv[])
  * Communicating clients
  * Elapsed time values
  * This is called in an endless loop to do the following things:
- *   Setup select(2) arguments
- *   Call select(2)
+ *   Make clients whose wait for data is over wait for their socket
+ *   Wait for events
  *   Process events that can be processed
  */
 static void
-handle_events(int sock)
+handle_events(void)
 {
-	fd_set source_fds;
-	fd_set sink_fds;
-	struct timeval wait_time, *waitptr;
-	bool set_waitptr;
-	int i, max_fd, nfds;
-	socklen_t len;
-	struct sockaddr_un remote;
-
-	/* Set the fds that interest us */
-	FD_ZERO(&source_fds);
-	FD_ZERO(&sink_fds);
-	waitptr = NULL;
-
-	max_fd = -1;
-	/* Read from standard input */
-	if (!reached_eof) {
-		FD_SET(STDIN_FILENO, &source_fds);
-		max_fd = STDIN_FILENO;
-	}
+	int timeout = -1;
+	bool input_ready = false;
+	int nfds;
+	struct client *c, *next;
+
+	for (value = values; value < values + nvalues; value++) {
+		/* Clients waiting for data that is now available */
+		if (value->have_record)
+			while (value->waiting_record)
+				set_state(value->waiting_record, s_send_current);
+		if (value->reached_eof)
+			while (value->waiting_eof)
+				set_state(value->waiting_eof, s_send_last);
 
-	/* Accept incoming connection */
-	FD_SET(sock, &source_fds);
-	max_fd = MAX(sock, max_fd);
+		/*
+		 * Subscribers that have not been sent the current record.
+		 * Records that appear while a subscriber is being sent one
+		 * are skipped, so slow subscribers receive only the latest.
+		 * Subscriptions end once the final record has been sent.
+		 */
+		for (c = value->subscribers; c; c = next) {
+			next = c->next;
+			if (value->have_record && !sent_current_record(c))
+				set_state(c, s_send_current);
+			else if (value->reached_eof && (value->have_record ||
+			    !window_entry_pending()))
+				close_client(c);
+		}
 
-	/* I/O with a client */
-	set_waitptr = false;
-	for (i = 0; i < MAX_CLIENTS; i++)
-		switch (clients[i].state) {
-		case s_inactive:		/* Free (unused or closed) */
-			break;
-		case s_wait_close:		/* Wait for the client to close the connection */
-		case s_read_command:		/* Waiting for a command (Q or R) to be read */
-			FD_SET(clients[i].fd, &source_fds);
-			max_fd = MAX(clients[i].fd, max_fd);
-			break;
-		case s_send_last:		/* Waiting for the last (before EOF) value to be written */
-			if (reached_eof) {
-				FD_SET(clients[i].fd, &sink_fds);
-				max_fd = MAX(clients[i].fd, max_fd);
+		/* Read from the value's input */
+		value->input_ready = false;
+		if (!value->reached_eof)
+			/* Shared-memory input need not appear readable */
+			value->input_ready = value->input_always_ready ||
+				dgsh_ready(value->input_watch.fd) == 1;
+		input_ready = input_ready || value->input_ready;
+
+		if ((value->waiting_record || value->subscribers) &&
+		    value->time_window) {
+			/*
+			 * Find the oldest buffer that hasn't yet entered the time
+			 * window and arrange to wait for it to enter.
+			 */
+			struct buffer *candidate_buffer;
+			struct timeval now, abs_rbegin_time, wait_time;
+			int value_timeout;
+
+			gettimeofday(&now, NULL);
+			timersub(&now, &value->record_rbegin.t, &abs_rbegin_time);
+			DPRINTF(4, "have to wait for a buffer to enter window %lld.%06d",
+				(long long)abs_rbegin_time.tv_sec, (int)abs_rbegin_time.tv_usec);
+			/*
+			 * rbegin = 10
+			 * 13            19     20    21  23
+			 * abs_rbegin    ...    ... tail  now
+			 */
+			candidate_buffer = buffer_after(&abs_rbegin_time, false);
+			if (candidate_buffer) {
+				/* There is a buffer worth waiting for */
+				timersub(&candidate_buffer->timestamp, &abs_rbegin_time, &wait_time);
+				/* Round up to ms, to avoid waking up before it enters */
+				value_timeout = wait_time.tv_sec * 1000 +
+					(wait_time.tv_usec + 999) / 1000;
+				if (timeout == -1 || value_timeout < timeout)
+					timeout = value_timeout;
+				DPRINTF(4, "waiting %lld.%06d for %p %lld.%06d to enter the window",
+					(long long)wait_time.tv_sec, (int)wait_time.tv_usec,
+					candidate_buffer,
+					(long long)candidate_buffer->timestamp.tv_sec,
+					(int)candidate_buffer->timestamp.tv_usec);
+			} else
+				DPRINTF(4, "No candidate buffer found");
+
+			/* Subscribers also see records leaving the window */
+			if (value->subscribers && value->have_record) {
+				timeradd(&value->current_record_begin.b->timestamp,
+					&value->record_rend.t, &wait_time);
+				timersub(&wait_time, &now, &wait_time);
+				value_timeout = wait_time.tv_sec < 0 ? 0 :
+					wait_time.tv_sec * 1000 +
+					(wait_time.tv_usec + 999) / 1000;
+				if (timeout == -1 || value_timeout < timeout)
+					timeout = value_timeout;
 			}
-			break;
-		case s_send_current:		/* Waiting for a response to be written */
-			if (have_record) {
-				FD_SET(clients[i].fd, &sink_fds);
-				max_fd = MAX(clients[i].fd, max_fd);
-			} else if (time_window)
-				set_waitptr = true;
-			break;
-		case s_send_current_nblk:	/* Waiting for a response to be written */
-			FD_SET(clients[i].fd, &sink_fds);
-			max_fd = MAX(clients[i].fd, max_fd);
-			break;
-		case s_sending_response:	/* A response is being sent */
-			FD_SET(clients[i].fd, &sink_fds);
-			max_fd = MAX(clients[i].fd, max_fd);
-			break;
 		}
 
-	if (set_waitptr) {
-		/*
-		 * Find the oldest buffer that hasn't yet entered the time
-		 * window and arrange for select(2) to wait for it to enter.
-		 */
-		struct buffer *bp, *candidate_buffer = NULL;
-		struct timeval now, abs_rbegin_time;
-
-		gettimeofday(&now, NULL);
-		timersub(&now, &record_rbegin.t, &abs_rbegin_time);
-		DPRINTF(4, "have to wait for a buffer to enter window %lld.%06d",
-			(long long)abs_rbegin_time.tv_sec, (int)abs_rbegin_time.tv_usec);
-		/*
-		 * rbegin = 10
-		 * 13            19     20    21  23
-		 * abs_rbegin    ...    ... tail  now
-		 */
-		for (bp = tail; bp && timercmp(&bp->timestamp, &abs_rbegin_time, >); bp = bp->prev)
-			candidate_buffer = bp;
-		if (candidate_buffer) {
-			/* There is a buffer worth waiting for */
-			waitptr = &wait_time;
-			timersub(&candidate_buffer->timestamp, &abs_rbegin_time, waitptr);
-			DPRINTF(4, "waiting %lld.%06d for %p %lld.%06d to enter the window",
-				(long long)wait_time.tv_sec, (int)wait_time.tv_usec,
-				candidate_buffer,
-				(long long)candidate_buffer->timestamp.tv_sec,
-				(int)candidate_buffer->timestamp.tv_usec);
-		} else
-			DPRINTF(4, "No candidate buffer found");
+		value->input_read = false;
 	}
 
-	TIMESTAMP("Calling select");
-	if ((nfds = select(max_fd + 1, &source_fds, &sink_fds, NULL, waitptr)) < 0)
-		err(3, "select");
-	TIMESTAMP("Select returns");
+	TIMESTAMP("Waiting for events");
+	nfds = watch_wait(input_ready ? 0 : timeout, handle_event);
+	TIMESTAMP("Wait returns");
 
-	if (FD_ISSET(STDIN_FILENO, &source_fds))
-		buffer_read();
+	for (value = values; value < values + nvalues; value++) {
+		if (value->input_ready && !value->input_read)
+			buffer_read();
 
-	if (waitptr && nfds == 0)
-		/* Expired timer; records may have entered the window */
-		update_current_record();
+		if (value->reached_eof)
+			watch_remove(&value->input_watch);
 
-	for (i = 0; i < MAX_CLIENTS; i++)
-		switch (clients[i].state) {
-		case s_inactive:		/* Free (unused or closed) */
-			break;
-		case s_read_command:		/* Waiting for a command (Q or R) to be read */
-		case s_wait_close:		/* Wait for the client to close the connection */
-			if (FD_ISSET(clients[i].fd, &source_fds))
-				read_command(&clients[i]);
-			break;
-		case s_send_last:		/* Waiting for the last (before EOF) value to be written */
-			/* FALLTHROUGH */
-		case s_send_current:		/* Waiting for a response to be written */
-			if (FD_ISSET(clients[i].fd, &sink_fds)) {
-				assert(have_record);
-				/* Start writing the most fresh last record */
-				clients[i].write_begin = current_record_begin;
-				clients[i].write_end = current_record_end;
-				clients[i].state = s_sending_response;
-				oldest_buffer_being_written =
-					oldest_buffer(oldest_buffer_being_written, clients[i].write_begin.b);
-				write_record(&clients[i], true);
-			}
-			break;
-		case s_send_current_nblk:	/* Waiting for a response (even empty) to be written */
-			if (FD_ISSET(clients[i].fd, &sink_fds)) {
-				if (have_record) {
-					/* Start writing the most fresh last record */
-					clients[i].write_begin = current_record_begin;
-					clients[i].write_end = current_record_end;
-					oldest_buffer_being_written =
-						oldest_buffer(oldest_buffer_being_written, clients[i].write_begin.b);
-				} else {
-					static struct buffer empty;
-
-					/* Write an empty record */
-					clients[i].write_begin.b = clients[i].write_end.b = &empty;
-					clients[i].write_begin.pos = clients[i].write_end.pos = 0;
-				}
-				clients[i].state = s_sending_response;
-				write_record(&clients[i], true);
-			}
-			break;
-		case s_sending_response:	/* A response is being written */
-			if (FD_ISSET(clients[i].fd, &sink_fds))
-				write_record(&clients[i], false);
-			break;
+		if (timeout != -1 && nfds == 0 && value->time_window &&
+		    (value->waiting_record || value->subscribers)) {
+			/* Expired timer; records may have entered the window */
+			update_current_record();
+			update_aggregates();
 		}
-
-	if (FD_ISSET(sock, &source_fds)) {
-		int rsock;
-		struct client *c;
-
-		len = sizeof(remote);
-		rsock = accept(sock, (struct sockaddr *)&remote, &len);
-		if (rsock == -1 && errno != EAGAIN)
-			err(5, "accept");
-
-		c = get_free_client();
-		non_block(rsock);
-		c->fd = rsock;
-		c->state = s_read_command;
 	}
 }
 
@@ -1221,13 +2592,28 @@ main(int argc, char *argv[])
 	int sock;
 	socklen_t len;
 	struct sockaddr_un local;
-	int ninputs = 1;
+	int ninputs;
 	int noutputs = 0;
+	int *input_fds;
 
 	parse_arguments(argc, argv);
+	for (value = values; value < values + nvalues; value++) {
+		value->buffer_capacity = value->time_window ? BUFFER_SIZE : SLAB_SIZE;
+		rt_ring_init();
+		if (value->segment_capacity)
+			create_segment();
+		if (value->aggregate)
+			aggregates_init(value->aggregate_field);
+	}
+	atexit(close_segments);
+
+	/* Clients that hang up are closed, rather than ending the store */
+	signal(SIGPIPE, SIG_IGN);
 
-        dgsh_negotiate(DGSH_HANDLE_ERROR, program_name, &ninputs, &noutputs,
-			NULL, NULL);
+	/* Each value is read from its own input */
+	ninputs = nvalues;
+        dgsh_negotiate(DGSH_HANDLE_ERROR | DGSH_SHM_CHANNELS, program_name,
+			&ninputs, &noutputs, &input_fds, NULL);
 
 	if (strlen(socket_path) >= sizeof(local.sun_path) - 1)
 		errx(6, "Socket name [%s] must be shorter than %lu characters",
@@ -1244,12 +2630,24 @@ main(int argc, char *argv[])
 	if (bind(sock, (struct sockaddr *)&local, len) == -1)
 		err(3, "Error binding socket to Unix domain address %s", argv[1]);
 
-	if (listen(sock, 5) == -1)
+	if (listen(sock, SOMAXCONN) == -1)
 		err(4, "listen");
 
 	non_block(sock);
+	raise_open_file_limit();
+
+	watch_init();
+	listen_watch.fd = sock;
+	listen_watch.slot = -1;
+	(void)watch_set(&listen_watch, EVENT_IN);
+	for (value = values; value < values + nvalues; value++) {
+		value->input_watch.fd = input_fds[value - values];
+		value->input_watch.slot = -1;
+		if (!watch_set(&value->input_watch, EVENT_IN))
+			value->input_always_ready = true;
+		value->reached_eof = false;
+	}
 
-	reached_eof = false;
 	for (;;)
-		handle_events(sock);
+		handle_events();
 }
@@ -20,10 +20,60 @@
 #ifndef DGSH_H
 #define DGSH_H
 
+#include <sys/types.h>	/* ssize_t */
+
 #define DGSH_HANDLE_ERROR 0x100
+#define DGSH_SHM_CHANNELS 0x200
+
+/* Hints regarding the data that a tool's input or output channels carry */
+struct dgsh_channel_hints {
+	long long expected_bytes;	/* Expected data volume; 0 if unknown */
+	int buffer_size;		/* Preferred pipe capacity; 0 for default */
+	int latency_sensitive;		/* Favor latency over throughput */
+};
 
 int
 dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 		int *n_output_fds, int **input_fds, int **output_fds);
 
+int
+dgsh_negotiate_hints(int flags, const char *tool_name, int *n_input_fds,
+		int *n_output_fds, int **input_fds, int **output_fds,
+		const struct dgsh_channel_hints *input_hints,
+		const struct dgsh_channel_hints *output_hints);
+
+/* Negotiation overlapping with the program's setup */
+int
+dgsh_negotiate_start(int flags, const char *tool_name, int *n_input_fds,
+		int *n_output_fds, int **input_fds, int **output_fds);
+
+int
+dgsh_negotiate_finish(void);
+
+/* I/O on descriptors that can be shared-memory channels */
+ssize_t
+dgsh_read(int fd, void *buf, size_t nbyte);
+
+ssize_t
+dgsh_write(int fd, const void *buf, size_t nbyte);
+
+int
+dgsh_ready(int fd);
+
+int
+dgsh_close(int fd);
+
+/* Attaching channels to a running program */
+int
+dgsh_control_open(const char *path);
+
+int
+dgsh_control_accept(int control_fd);
+
+int
+dgsh_control_receive(int sock, int **fds);
+
+int
+dgsh_control_attach(const char *path, int n_fds, int *fds);
+
 #endif
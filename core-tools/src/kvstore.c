@@ -19,8 +19,9 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <sys/uio.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <assert.h>
 #include <stdbool.h>
@@ -29,23 +30,57 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "dgsh.h"
 #include "kvstore.h"
 #include "debug.h"
+#include "minmax.h"
 
+/* Number of seconds to keep retrying a failed connection */
 int retry_limit = 10;
 
-/* Write a command to the specified socket, and return the socket */
+/*
+ * Initial and maximum delay between connection attempts (in us).
+ * Doubling the delay from a small value lets a client that raced ahead
+ * of its store connect soon after the store starts listening.
+ */
+#define RETRY_DELAY_MIN 100
+#define RETRY_DELAY_MAX 100000
+
+/* A connection to a store, kept open to serve several commands */
+struct kvstore_connection {
+	char *path;			/* The store's socket path */
+	char *key;			/* Name of the value read; NULL for the first */
+	bool retry_connection;		/* Retry failed connection attempts */
+	int fd;				/* The connected socket */
+	int pending;			/* Commands awaiting a response */
+	char requests[128];		/* Commands not yet sent */
+	int nrequests;
+	int start, end;			/* Data in buff not yet consumed */
+	char buff[PIPE_BUF];		/* Data read from the store */
+	int uses;			/* Commands sent by dgsh_send_command */
+	bool segment_requested;		/* The store's segment was asked for */
+	struct kvstore_segment *segment; /* The store's mapped segment, if any */
+	size_t segment_size;
+	char *value;			/* Record copied from the segment */
+	struct kvstore_connection *next; /* Next cached connection */
+};
+
+/* Connections kept open by dgsh_send_command for reuse */
+static struct kvstore_connection *connections;
+
+/* Connect to the specified socket, and return the socket */
 static int
-write_command(const char *name, char cmd, bool retry_connection)
+connect_store(const char *name, bool retry_connection)
 {
 	int s;
 	socklen_t len;
 	struct sockaddr_un remote;
-	int counter = 0;
+	long long waited = 0;
+	long delay = RETRY_DELAY_MIN;
 	char *env_retry_limit;
 
 	if ((env_retry_limit = getenv("KVSTORE_RETRY_LIMIT")) != NULL)
@@ -66,31 +101,415 @@ again:
 	if (connect(s, (struct sockaddr *)&remote, len) == -1) {
 		if (retry_connection &&
 		    (errno == ENOENT || errno == ECONNREFUSED) &&
-		    counter++ < retry_limit) {
-			DPRINTF(3, "Retrying connection setup");
-			sleep(1);
+		    waited < retry_limit * 1000000LL) {
+			DPRINTF(3, "Retrying connection setup in %ld us", delay);
+			usleep(delay);
+			waited += delay;
+			delay = MIN(delay * 2, RETRY_DELAY_MAX);
 			goto again;
 		}
 		err(2, "connect %s", name);
 	}
 	DPRINTF(3, "Connected");
+	return s;
+}
 
+/* Write a command to the specified socket, and return the socket */
+static int
+write_command(const char *name, char cmd, bool retry_connection)
+{
+	int s;
+
+	s = connect_store(name, retry_connection);
 	if (write(s, &cmd, 1) == -1)
 		err(3, "write");
 	DPRINTF(3, "Wrote command");
 	return s;
 }
 
-/* Send to the socket path the specified command */
+/*
+ * Connect to the connection's store, and select the value to read
+ * Return false if the store has no such value.
+ */
+static bool
+open_connection(struct kvstore_connection *kc)
+{
+	char cmd[KVSTORE_KEY_MAX + 3];
+	char ack;
+
+	kc->fd = connect_store(kc->path, kc->retry_connection);
+	if (kc->key == NULL)
+		return true;
+	snprintf(cmd, sizeof(cmd), "K%s\n", kc->key);
+	if (write(kc->fd, cmd, strlen(cmd)) == -1)
+		err(3, "write");
+	/* The store closes the connection if it lacks the value */
+	return read(kc->fd, &ack, 1) == 1;
+}
+
+/*
+ * Connect to the store at the specified socket path, to read the value
+ * with the specified name, or its first value if key is NULL
+ * Return NULL if the store has no such value.
+ */
+struct kvstore_connection *
+dgsh_kvstore_open(const char *socket_path, const char *key,
+    bool retry_connection)
+{
+	struct kvstore_connection *kc;
+
+	/* No store can have a value with an invalid name */
+	if (key && (*key == 0 || strlen(key) > KVSTORE_KEY_MAX ||
+	    strchr(key, '\n')))
+		return NULL;
+	if ((kc = malloc(sizeof(*kc))) == NULL ||
+	    (kc->path = strdup(socket_path)) == NULL ||
+	    (key && (kc->key = strdup(key)) == NULL))
+		err(1, "Unable to allocate store connection");
+	if (key == NULL)
+		kc->key = NULL;
+	kc->retry_connection = retry_connection;
+	if (!open_connection(kc)) {
+		close(kc->fd);
+		free(kc->path);
+		free(kc->key);
+		free(kc);
+		return NULL;
+	}
+	kc->pending = 0;
+	kc->nrequests = 0;
+	kc->start = kc->end = 0;
+	kc->uses = 0;
+	kc->segment_requested = false;
+	kc->segment = NULL;
+	kc->value = NULL;
+	kc->next = NULL;
+	return kc;
+}
+
+/* Unmap the store's shared memory segment, if it is mapped */
+static void
+unmap_segment(struct kvstore_connection *kc)
+{
+	if (kc->segment == NULL)
+		return;
+	munmap(kc->segment, kc->segment_size);
+	free(kc->value);
+	kc->segment = NULL;
+	kc->value = NULL;
+}
+
+/* Close the connection and free its resources */
 void
-dgsh_send_command(const char *socket_path, char cmd, bool retry_connection,
-    bool quit, int outfd)
+dgsh_kvstore_close(struct kvstore_connection *kc)
 {
-	int s, n;
+	unmap_segment(kc);
+	close(kc->fd);
+	free(kc->path);
+	free(kc->key);
+	free(kc);
+}
+
+/*
+ * Return true if the store has closed the connection, e.g. because
+ * it was asked to quit.
+ * Only valid when no responses are pending, because then
+ * the connection should have nothing to read.
+ */
+static bool
+connection_closed(struct kvstore_connection *kc)
+{
+	struct pollfd pfd;
+
+	pfd.fd = kc->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) == -1)
+		err(5, "poll");
+	return pfd.revents != 0;
+}
+
+/* Send the queued commands to the store */
+static void
+send_requests(struct kvstore_connection *kc)
+{
+	if (write(kc->fd, kc->requests, kc->nrequests) == -1)
+		err(3, "write");
+	DPRINTF(3, "Wrote %d commands", kc->nrequests);
+	kc->nrequests = 0;
+}
+
+/*
+ * Queue an A, C, c, or L command without waiting for its response
+ * Commands are sent in batches, when a response is read or when
+ * the queue fills up.
+ */
+void
+dgsh_kvstore_request(struct kvstore_connection *kc, char cmd)
+{
+	if (kc->pending == 0 && connection_closed(kc)) {
+		DPRINTF(3, "Reconnecting to %s", kc->path);
+		close(kc->fd);
+		if (!open_connection(kc))
+			errx(5, "Store %s has no value named %s", kc->path,
+			    kc->key);
+		kc->start = kc->end = 0;
+		unmap_segment(kc);
+		kc->segment_requested = false;
+	}
+	kc->requests[kc->nrequests++] = cmd;
+	kc->pending++;
+	if (kc->nrequests == sizeof(kc->requests))
+		send_requests(kc);
+}
+
+/* Read more data from the store, erring on end of file */
+static void
+fill_buffer(struct kvstore_connection *kc)
+{
+	int n;
+
+	memmove(kc->buff, kc->buff + kc->start, kc->end - kc->start);
+	kc->end -= kc->start;
+	kc->start = 0;
+	if ((n = read(kc->fd, kc->buff + kc->end, sizeof(kc->buff) - kc->end)) == -1)
+		err(5, "read");
+	if (n == 0)
+		errx(5, "Store %s closed the connection", kc->path);
+	DPRINTF(4, "Read %d bytes", n);
+	kc->end += n;
+}
+
+/* Write to outfd the response to the oldest command sent */
+void
+dgsh_kvstore_response(struct kvstore_connection *kc, int outfd)
+{
+	int n;
+	unsigned content_length;
+	char cbuff[CONTENT_LENGTH_DIGITS + 1];
+
+	assert(kc->pending > 0);
+	if (kc->nrequests)
+		send_requests(kc);
+
+	/* Read content length */
+	while (kc->end - kc->start < CONTENT_LENGTH_DIGITS)
+		fill_buffer(kc);
+	memcpy(cbuff, kc->buff + kc->start, CONTENT_LENGTH_DIGITS);
+	cbuff[CONTENT_LENGTH_DIGITS] = 0;
+	if (sscanf(cbuff, "%u", &content_length) != 1) {
+		fprintf(stderr, "Unable to read content length from string [%s]\n", cbuff);
+		exit(1);
+	}
+	DPRINTF(3, "Content length is %u", content_length);
+	kc->start += CONTENT_LENGTH_DIGITS;
+
+	/* Copy the content, leaving any following responses in the buffer */
+	for (;;) {
+		n = MIN(content_length, (unsigned)(kc->end - kc->start));
+		if (n && write(outfd, kc->buff + kc->start, n) == -1)
+			err(4, "write");
+		kc->start += n;
+		content_length -= n;
+		if (content_length == 0)
+			break;
+		fill_buffer(kc);
+	}
+	kc->pending--;
+}
+
+/*
+ * Ask the store for its shared memory segment, and map it if the
+ * store publishes its record in one.
+ * No responses must be pending on the connection.
+ */
+static void
+map_segment(struct kvstore_connection *kc)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr h;
+		unsigned char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	char m;
+	struct iovec io = { .iov_base = &m, .iov_len = 1 };
+	struct stat sb;
+	void *p;
+	int fd = -1;
+	int n;
+
+	assert(kc->pending == 0 && kc->start == kc->end);
+	kc->segment_requested = true;
+	if (connection_closed(kc))
+		return;		/* Let the next request reconnect */
+	if (write(kc->fd, "M", 1) == -1)
+		err(3, "write");
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	while ((n = recvmsg(kc->fd, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (n == -1)
+		err(5, "recvmsg");
+	if (n == 0)
+		errx(5, "Store %s closed the connection", kc->path);
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (fd == -1) {
+		DPRINTF(3, "Store %s has no segment", kc->path);
+		return;
+	}
+
+	if (fstat(fd, &sb) == -1 ||
+	    (p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err(5, "Unable to map the segment of store %s", kc->path);
+	close(fd);
+	kc->segment = p;
+	kc->segment_size = sb.st_size;
+	if ((kc->value = malloc(kc->segment->capacity)) == NULL)
+		err(1, "Unable to allocate record buffer");
+	DPRINTF(3, "Mapped %u byte segment of store %s", kc->segment->capacity, kc->path);
+}
+
+/*
+ * Write to outfd the response to the specified command using the
+ * store's shared memory segment.
+ * Return false if the command must be sent to the store instead,
+ * because the store exited, its record is too large,
+ * or the command would have to wait.
+ */
+static bool
+read_segment(struct kvstore_connection *kc, char cmd, int outfd)
+{
+	struct kvstore_segment *s = kc->segment;
+	uint64_t seq;
+	uint32_t flags, length;
+	int tries;
+
+	/* A store killed by a signal cannot mark its segment as closed */
+	if (connection_closed(kc)) {
+		unmap_segment(kc);
+		return false;
+	}
+
+	for (tries = 0; ; tries++) {
+		if (tries == 100)
+			return false;	/* The store keeps updating it */
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		flags = __atomic_load_n(&s->flags, __ATOMIC_RELAXED);
+		length = MIN(__atomic_load_n(&s->length, __ATOMIC_RELAXED), s->capacity);
+		memcpy(kc->value, s->data, length);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	if (flags & KVSTORE_CLOSED) {
+		unmap_segment(kc);
+		return false;
+	}
+	if (flags & KVSTORE_TOO_LARGE)
+		return false;
+	switch (cmd) {
+	case 'c':	/* Read current value, non-blocking */
+		if (!(flags & KVSTORE_HAVE_RECORD))
+			length = 0;
+		break;
+	case 'C':	/* Read current value */
+		if (!(flags & KVSTORE_HAVE_RECORD))
+			return false;
+		break;
+	case 'L':	/* Read last value */
+		if (!(flags & KVSTORE_HAVE_RECORD) || !(flags & KVSTORE_EOF))
+			return false;
+		break;
+	}
+	if (length && write(outfd, kc->value, length) == -1)
+		err(4, "write");
+	return true;
+}
+
+/*
+ * Return a connection to the specified store value, reusing an open one,
+ * or NULL if the store has no such value
+ */
+static struct kvstore_connection *
+cached_connection(const char *socket_path, const char *key,
+    bool retry_connection)
+{
+	struct kvstore_connection *kc;
+
+	for (kc = connections; kc; kc = kc->next)
+		if (strcmp(kc->path, socket_path) == 0 &&
+		    (kc->key == key ||
+		     (kc->key && key && strcmp(kc->key, key) == 0)))
+			return kc;
+	if ((kc = dgsh_kvstore_open(socket_path, key, retry_connection)) == NULL)
+		return NULL;
+	kc->next = connections;
+	connections = kc;
+	return kc;
+}
+
+/*
+ * Subscribe to the value read through the connection, writing to outfd
+ * each record the store pushes, until the store closes the connection
+ * after sending the record current at the end of its input
+ */
+void
+dgsh_kvstore_subscribe(struct kvstore_connection *kc, int outfd)
+{
+	int n;
+
+	assert(kc->pending == 0);
+	dgsh_kvstore_request(kc, 'S');
+	send_requests(kc);
+	for (;;) {
+		/* The end of the subscription can only come between records */
+		if (kc->start == kc->end) {
+			if ((n = read(kc->fd, kc->buff, sizeof(kc->buff))) == -1)
+				err(5, "read");
+			if (n == 0)
+				break;
+			kc->start = 0;
+			kc->end = n;
+		}
+		/* Each record pushed is a response to the subscription */
+		kc->pending = 1;
+		dgsh_kvstore_response(kc, outfd);
+	}
+	kc->pending = 0;
+}
+
+/*
+ * Return true if the store at the socket path has the named value
+ * The connection established for finding out is kept for reuse.
+ */
+bool
+dgsh_kvstore_has_value(const char *socket_path, const char *key,
+    bool retry_connection)
+{
+	return cached_connection(socket_path, key, retry_connection) != NULL;
+}
+
+/*
+ * Send to the socket path the specified command, reading the value
+ * with the specified name, or the store's first value if key is NULL
+ * The connection is kept open and reused by subsequent calls.
+ */
+void
+dgsh_send_command(const char *socket_path, const char *key, char cmd,
+    bool retry_connection, bool quit, int outfd)
+{
+	int s;
 	char buff[PIPE_BUF];
-	int content_length;
-	char cbuff[CONTENT_LENGTH_DIGITS + 2];
-	struct iovec iov[2];
+	struct kvstore_connection *kc;
 
 	switch (cmd) {
 	case 0:		/* No I/O specified */
@@ -98,43 +517,40 @@ dgsh_send_command(const char *socket_path, char cmd, bool retry_connection,
 	case 'C':	/* Read current value */
 	case 'c':	/* Read current value, non-blocking */
 	case 'L':	/* Read last value */
-		s = write_command(socket_path, cmd, retry_connection);
-
-		/* Read content length and some data */
-		iov[0].iov_base = cbuff;
-		iov[0].iov_len = CONTENT_LENGTH_DIGITS;
-		iov[1].iov_base = buff;
-		iov[1].iov_len = sizeof(buff);
-		if ((n = readv(s, iov, 2)) == -1)
-			err(5, "readv");
-		DPRINTF(3, "Read %d characters", n);
-		cbuff[CONTENT_LENGTH_DIGITS] = 0;
-		if (sscanf(cbuff, "%u", &content_length) != 1) {
-			fprintf(stderr, "Unable to read content length from string [%s]\n", cbuff);
-			exit(1);
+	case 'A':	/* Read the value's aggregates */
+	case 'S':	/* Subscribe to the value */
+		if ((kc = cached_connection(socket_path, key,
+		    retry_connection)) == NULL)
+			errx(5, "Store %s has no value named %s", socket_path,
+			    key);
+		if (cmd == 'S') {
+			dgsh_kvstore_subscribe(kc, outfd);
+			break;
 		}
-		DPRINTF(3, "Content length is %u", content_length);
-		n -= CONTENT_LENGTH_DIGITS;
-		if (write(outfd, buff, n) == -1)
-			err(4, "write");
-		content_length -= n;
-
-		/* Read rest of data */
-		while (content_length > 0) {
-			if ((n = read(s, buff, sizeof(buff))) == -1)
-				err(5, "read");
-			DPRINTF(4, "Read %d bytes", n);
-			if (write(outfd, buff, n) == -1)
-				err(4, "write");
-			content_length -= n;
-		}
-		close(s);
+		/*
+		 * On a reused connection, map the segment in which the store
+		 * may publish its record, and serve the reads from it.
+		 */
+		if (kc->uses++ > 0 && !kc->segment_requested)
+			map_segment(kc);
+		if (kc->segment && cmd != 'A' && read_segment(kc, cmd, outfd))
+			break;
+		dgsh_kvstore_request(kc, cmd);
+		dgsh_kvstore_response(kc, outfd);
 		break;
 	default:
 		assert(0);
 		break;
 	}
 
-	if (quit)
-		(void)write_command(socket_path, 'Q', retry_connection);
+	if (quit) {
+		/*
+		 * Wait for the store to exit, so that it cannot remove
+		 * the socket of a store subsequently started on the same path.
+		 */
+		s = write_command(socket_path, 'Q', retry_connection);
+		while (read(s, buff, sizeof(buff)) > 0)
+			;
+		close(s);
+	}
 }
@@ -21,21 +21,100 @@
 #define KVSTORE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
-/* Send to the socket path the specified command */
-void dgsh_send_command(const char *socket_path, char cmd, bool retry_connection,
-    bool quit, int outfd);
+/*
+ * Send to the socket path the specified command, reading the value
+ * with the specified name, or the store's first value if key is NULL
+ */
+void dgsh_send_command(const char *socket_path, const char *key, char cmd,
+    bool retry_connection, bool quit, int outfd);
+
+/* Return true if the store at the socket path has the named value */
+bool dgsh_kvstore_has_value(const char *socket_path, const char *key,
+    bool retry_connection);
+
+/* A connection to a store, kept open to serve several commands */
+struct kvstore_connection;
+
+/*
+ * Connect to the store at the specified socket path, to read the value
+ * with the specified name, or its first value if key is NULL
+ * Return NULL if the store has no such value.
+ */
+struct kvstore_connection *dgsh_kvstore_open(const char *socket_path,
+    const char *key, bool retry_connection);
+
+/*
+ * Send an A, C, c, or L command without waiting for its response
+ * The store stops reading commands while it cannot write a response,
+ * so callers should not leave thousands of responses unread.
+ */
+void dgsh_kvstore_request(struct kvstore_connection *kc, char cmd);
+
+/* Write to outfd the response to the oldest command sent */
+void dgsh_kvstore_response(struct kvstore_connection *kc, int outfd);
+
+/*
+ * Subscribe to the value read through the connection, writing to outfd
+ * each record the store pushes, until the store reaches the end of its
+ * input
+ */
+void dgsh_kvstore_subscribe(struct kvstore_connection *kc, int outfd);
+
+/* Close the connection and free its resources */
+void dgsh_kvstore_close(struct kvstore_connection *kc);
 
 /*
  * The read/write store communication protocol is as follows
- * readval -> writeval: L | Q | C
- * For L (read last) and C (read current)
+ * readval -> writeval: L | Q | C | c | A | K | M | S
+ * For L (read last), C (read current), and c (read current or empty)
  * writeval -> readval: CONTENT_LENGTH content ...
  * If writeval gets EOF it returns an empty (length 0) record, if no record
  * can ever appear.
  * For Q (quit) writeval exits
+ * A client can keep the connection open and send further L, C, or c
+ * commands, even before reading the previous responses.
+ * These are served in order, each with its own content length.
+ * For A (aggregates) writeval -> readval: CONTENT_LENGTH content, where
+ * the content has a line with the name and value of each aggregate kept
+ * over the records of the current value.
+ * For M (map) writeval -> readval: a single byte, accompanied by the
+ * file descriptor of its shared memory segment, if it has one.
+ * For S (subscribe) writeval -> readval: CONTENT_LENGTH content for the
+ * current record and then for each new one, until writeval closes the
+ * connection after sending the record current at EOF.
+ * A subscriber still receiving a record is later sent only the newest one.
+ * A store can keep several named values.  Commands read the first one,
+ * unless they follow K name\n, which selects the value named name for
+ * the rest of the connection.  The store acknowledges the selection
+ * with a single byte, or closes the connection if it lacks the value.
  */
 #define CONTENT_LENGTH_DIGITS 10
 #define CONTENT_LENGTH_FORMAT "%010u"
 
+/* Maximum length of a value's name */
+#define KVSTORE_KEY_MAX 255
+
+/*
+ * The shared memory segment in which a store started with -m publishes
+ * its current record.
+ * It is protected by a sequence lock: the store increments seq before
+ * and after updating the segment, so a reader must retry if it finds
+ * seq odd or changed after reading the segment.
+ */
+struct kvstore_segment {
+	uint64_t seq;			/* Sequence lock counter */
+	uint64_t record_count;		/* Number of records read by the store */
+	uint32_t capacity;		/* Size of data */
+	uint32_t flags;			/* See below */
+	uint32_t length;		/* Length of the current record */
+	char data[];			/* The current record */
+};
+
+#define KVSTORE_HAVE_RECORD	1	/* A current record is available */
+#define KVSTORE_EOF		2	/* The store read all its input */
+#define KVSTORE_TOO_LARGE	4	/* The record does not fit in data */
+#define KVSTORE_CLOSED		8	/* The store has exited */
+
 #endif /* KVSTORE_H */
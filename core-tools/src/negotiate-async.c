@@ -0,0 +1,132 @@
+/*
+ * Copyright 2026 Diomidis Spinellis
+ *
+ * Negotiation performed by a helper thread, so that a tool can perform
+ * its setup while the graph negotiates.
+ * It is kept apart from negotiate.c, so that only the programs using it
+ * need to be linked with the threads library.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>		/* atexit() */
+#include <unistd.h>
+
+#include "dgsh.h"
+#include "negotiate.h"		/* set_negotiation_started() */
+
+/* The negotiation performed by the helper thread */
+static struct {
+	bool started;		/* The thread was created */
+	pthread_t thread;
+	int flags;		/* Arguments of dgsh_negotiate() */
+	const char *tool_name;
+	int *n_input_fds;
+	int *n_output_fds;
+	int **input_fds;
+	int **output_fds;
+	int result;		/* Its return value */
+	int saved_errno;	/* ... and errno */
+	int done[2];		/* Pipe written when the negotiation is done */
+} async;
+
+/*
+ * Let a negotiation in progress when the program exits complete,
+ * so that the graph sees the program exiting after it was set up.
+ */
+static void
+finish_at_exit(void)
+{
+	if (async.started && !pthread_equal(pthread_self(), async.thread))
+		pthread_join(async.thread, NULL);
+}
+
+static void *
+negotiate_thread(void *arg)
+{
+	char done = 0;
+
+	(void)arg;
+	async.result = dgsh_negotiate(async.flags, async.tool_name,
+			async.n_input_fds, async.n_output_fds,
+			async.input_fds, async.output_fds);
+	async.saved_errno = errno;
+	while (write(async.done[1], &done, 1) == -1 && errno == EINTR)
+		;
+	return NULL;
+}
+
+/*
+ * Start negotiating with the specified arguments of dgsh_negotiate()
+ * on a helper thread.
+ * The pointed variables are set when the negotiation is done;
+ * until then they must not be accessed.
+ * Return a file descriptor that becomes readable when the negotiation
+ * is done, or -1 on error.
+ */
+int
+dgsh_negotiate_start(int flags, const char *tool_name, int *n_input_fds,
+		int *n_output_fds, int **input_fds, int **output_fds)
+{
+	if (async.started) {
+		errno = EALREADY;
+		return -1;
+	}
+	if (pipe(async.done) == -1)
+		return -1;
+	async.flags = flags;
+	async.tool_name = tool_name;
+	async.n_input_fds = n_input_fds;
+	async.n_output_fds = n_output_fds;
+	async.input_fds = input_fds;
+	async.output_fds = output_fds;
+	/* Keep the exit handler from negotiating concurrently */
+	set_negotiation_started();
+	if ((errno = pthread_create(&async.thread, NULL, negotiate_thread,
+					NULL)) != 0) {
+		int saved_errno = errno;
+
+		close(async.done[0]);
+		close(async.done[1]);
+		errno = saved_errno;
+		return -1;
+	}
+	async.started = true;
+	atexit(finish_at_exit);
+	return async.done[0];
+}
+
+/*
+ * Wait for the negotiation started with dgsh_negotiate_start()
+ * to finish, and return the value returned by dgsh_negotiate().
+ * The descriptor returned by dgsh_negotiate_start() is closed.
+ */
+int
+dgsh_negotiate_finish(void)
+{
+	if (!async.started) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((errno = pthread_join(async.thread, NULL)) != 0)
+		return -1;
+	async.started = false;
+	close(async.done[0]);
+	close(async.done[1]);
+	errno = async.saved_errno;
+	return async.result;
+}
@@ -23,6 +23,7 @@
 #include <assert.h>		/* assert() */
 #include <errno.h>		/* ENOBUFS */
 #include <err.h>		/* err() */
+#include <fcntl.h>		/* fcntl(), F_SETPIPE_SZ */
 #include <limits.h>		/* IOV_MAX */
 #include <stdbool.h>		/* bool, true, false */
 #include <stdio.h>		/* fprintf() in DPRINTF() */
@@ -30,17 +31,21 @@
 #include <string.h>		/* memcpy() */
 #include <sysexits.h>		/* EX_PROTOCOL, EX_OK */
 #include <sys/socket.h>		/* sendmsg(), recvmsg() */
+#include <sys/un.h>		/* struct sockaddr_un */
 #include <unistd.h>		/* getpid(), getpagesize(),
 				 * STDIN_FILENO, STDOUT_FILENO,
 				 * STDERR_FILENO, alarm(), sysconf()
 				 */
 #include <signal.h>		/* signal(), SIGALRM */
 #include <time.h>		/* nanosleep() */
-#include <sys/select.h>		/* select(), fd_set, */
+#include <poll.h>		/* poll(), struct pollfd */
+#include <sys/stat.h>		/* mkdir() */
+#include <sys/time.h>		/* struct timeval */
 #include <stdio.h>		/* printf family */
 
 #include "negotiate.h"		/* Message block and I/O */
 #include "dgsh-debug.h"		/* DPRINTF() */
+#include "minmax.h"		/* MAX() */
 
 #ifdef TIME
 #include <time.h>
@@ -50,6 +55,35 @@ static struct timespec tstart={0,0}, tend={0,0};
 /* Default negotiation timeout (s) */
 #define DGSH_TIMEOUT 5
 
+/* Version of the solution cache file format */
+#define DGSH_CACHE_VERSION 2
+
+/* Version of the stored graph (DGSH_GRAPH) file format */
+#define DGSH_GRAPH_VERSION 2
+
+/* Expected channel volume (bytes) that warrants an enlarged pipe */
+#define DGSH_LARGE_VOLUME (16 * 1024 * 1024)
+
+/* Capacity (bytes) of pipes carrying large volumes */
+#define DGSH_LARGE_PIPE_SIZE (1024 * 1024)
+
+/* Capacity (bytes) of Linux's default pipes */
+#define DGSH_DEFAULT_PIPE_SIZE (64 * 1024)
+
+/* Expected channel volume (bytes) that a single write can carry */
+#define DGSH_SMALL_VOLUME PIPE_BUF
+
+/*
+ * Capacity (bytes) of pipes carrying small volumes.
+ * The kernel rounds it up to its minimum, one page.
+ */
+#define DGSH_SMALL_PIPE_SIZE 4096
+
+/* Not exposed by glibc without _GNU_SOURCE */
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#endif
+
 #ifndef UNIT_TESTING
 
 /* Models an I/O connection between tools on an dgsh graph. */
@@ -84,6 +118,16 @@ struct dgsh_node {
 	int dgsh_out;		/* Provides output to other tool(s)
 				 * on dgsh graph.
 				 */
+	int input_pipe_size;	/* Preferred capacity of input pipes;
+				 * 0 for the system's default.
+				 */
+	int output_pipe_size;	/* Preferred capacity of output pipes;
+				 * 0 for the system's default.
+				 */
+	int shm_channels;	/* Can use shared-memory channels. */
+	int position;		/* Position in the shell's graph; -1 if
+				 * not known.
+				 */
 };
 
 /* Holds a node's connections. It contains a piece of the solution. */
@@ -141,7 +185,10 @@ static struct dgsh_node_pipe_fds self_pipe_fds;	/* A tool's read and write file
 						 */
 static bool init_error = false;
 static volatile sig_atomic_t negotiation_completed = 0;
+static volatile sig_atomic_t negotiation_started = 0;
 int dgsh_debug_level = 0;
+static int cache_hits = 0;			/* Solution cache statistics */
+static int cache_misses = 0;
 
 static void get_environment_vars();
 static int dgsh_exit(int state, int flags);
@@ -159,7 +206,12 @@ dgsh_force_include_function(void)
 static void
 dgsh_exit_handler(void)
 {
-	if (negotiation_completed)
+	/*
+	 * A negotiation in progress, e.g. on the thread started by
+	 * dgsh_negotiate_start(), informs the graph through its
+	 * closed sockets.
+	 */
+	if (negotiation_completed || negotiation_started)
 		return;
 	init_error = true;
 	/* Finish negotiation, if required */
@@ -210,6 +262,132 @@ setup_iov_max(void)
 #endif
 }
 
+/* An event of the negotiation, recorded when DGSH_TRACE_DIR is set */
+struct trace_event {
+	const char *name;	/* Event name, e.g. read */
+	long long start;	/* Start time (us) */
+	long long duration;	/* Duration (us) */
+	int node;		/* Node index; -1 if not known */
+	int size;		/* Bytes transferred, nodes solved or
+				 * file descriptors passed
+				 */
+	const char *state;	/* Protocol state of the message block */
+};
+
+static struct trace_event *trace_events;
+static int n_trace_events;
+static int trace_enabled = -1;		/* -1 if not yet determined */
+static int io_bytes;			/* Bytes transferred by the current
+					 * message block read or write.
+					 */
+
+/* Return true if negotiation events are to be traced. */
+static bool
+trace_on(void)
+{
+	if (trace_enabled == -1)
+		trace_enabled = (getenv("DGSH_TRACE_DIR") != NULL);
+	return trace_enabled;
+}
+
+/*
+ * Return the current time in microseconds.
+ * The monotonic clock is common to all processes of a host,
+ * so the events of a graph's processes can be placed on one timeline.
+ */
+long long
+trace_now(void)
+{
+	struct timespec t;
+
+	if (!trace_on())
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/*
+ * Record an event that started at the specified time and ends now.
+ * Concentrators, which are not graph nodes, are recorded with node -1.
+ */
+void
+trace_event(const char *name, long long start, int size, const char *state)
+{
+	struct trace_event *e;
+
+	if (!trace_on())
+		return;
+	e = realloc(trace_events, sizeof(*e) * (n_trace_events + 1));
+	if (e == NULL)
+		return;
+	trace_events = e;
+	e = &trace_events[n_trace_events++];
+	e->name = name;
+	e->start = start;
+	e->duration = trace_now() - start;
+	e->node = self_node.pid ? self_node.index : -1;
+	e->size = size;
+	e->state = state;
+}
+
+/* Output to f the string s as a JSON string, without its quotes */
+static void
+fput_json_string(const char *s, FILE *f)
+{
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s >= ' ')
+			fputc(*s, f);
+}
+
+/*
+ * Write the recorded events in the Chrome trace event format
+ * to a file named after our pid in the DGSH_TRACE_DIR directory.
+ * The files of a graph's processes can be combined with
+ * dgsh-merge-trace(1).
+ */
+void
+trace_write(const char *tool_name)
+{
+	char *dir = getenv("DGSH_TRACE_DIR");
+	char path[PATH_MAX];
+	FILE *f;
+	int pid = (int)getpid();
+	int i;
+
+	if (!trace_on() || dir == NULL)
+		return;
+	snprintf(path, sizeof(path), "%s/dgsh-%d.json", dir, pid);
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("%s", path);
+		goto exit;
+	}
+	fprintf(f, "[\n{\"name\": \"process_name\", \"ph\": \"M\", "
+			"\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"",
+			pid, pid);
+	fput_json_string(tool_name, f);
+	fprintf(f, "\"}}");
+	for (i = 0; i < n_trace_events; i++) {
+		struct trace_event *e = &trace_events[i];
+
+		fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"dgsh\", "
+				"\"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, "
+				"\"pid\": %d, \"tid\": %d, "
+				"\"args\": {\"node\": %d, \"size\": %d, "
+				"\"state\": \"%s\"}}",
+				e->name, e->start, e->duration, pid, pid,
+				e->node, e->size, e->state);
+	}
+	fprintf(f, "\n]\n");
+	if (fclose(f) != 0)
+		warn("%s", path);
+exit:
+	free(trace_events);
+	trace_events = NULL;
+	n_trace_events = 0;
+}
+
 /**
  * Remove path to command to save space in the graph plot
  * Find first space if any and take the name up to there
@@ -362,52 +540,241 @@ output_graph(char *filename)
 	return OP_SUCCESS;
 }
 
-/**
- * Allocate node indexes to store a node's (at node_index)
- * node outgoing or incoming connections (nc_edges).
+/*
+ * Set depth[i] to the longest distance, in edges, of the solution's node i
+ * from a node without inputs, and height[i] to its longest distance from
+ * a node without outputs.
+ * Only edges carrying channels are followed.
+ * Return the number of nodes on the graph's longest (critical) path,
+ * or -1 if the graph has a cycle.
+ */
+STATIC int
+solution_depths(int *depth, int *height)
+{
+	int n_nodes = chosen_mb->n_nodes;
+	struct dgsh_node_connections *graph_solution =
+					chosen_mb->graph_solution;
+	int *order, *n_inputs;
+	int i, j, n_ordered = 0, length = 0;
+
+	order = (int *)malloc(sizeof(int) * n_nodes);
+	n_inputs = (int *)calloc(n_nodes, sizeof(int));
+	if (order == NULL || n_inputs == NULL) {
+		free(order);
+		free(n_inputs);
+		return -1;
+	}
+	for (i = 0; i < n_nodes; i++) {
+		depth[i] = height[i] = 0;
+		for (j = 0; j < graph_solution[i].n_edges_outgoing; j++)
+			if (graph_solution[i].edges_outgoing[j].instances)
+				n_inputs[graph_solution[i].edges_outgoing[j].to]++;
+	}
+
+	/* Visit the nodes in topological order, starting from the sources */
+	for (i = 0; i < n_nodes; i++)
+		if (n_inputs[i] == 0)
+			order[n_ordered++] = i;
+	for (i = 0; i < n_ordered; i++) {
+		struct dgsh_node_connections *c = &graph_solution[order[i]];
+
+		for (j = 0; j < c->n_edges_outgoing; j++) {
+			int to = c->edges_outgoing[j].to;
+
+			if (c->edges_outgoing[j].instances == 0)
+				continue;
+			depth[to] = MAX(depth[to], depth[order[i]] + 1);
+			if (--n_inputs[to] == 0)
+				order[n_ordered++] = to;
+		}
+	}
+
+	/* ... and back from the sinks */
+	for (i = n_ordered - 1; i >= 0; i--) {
+		struct dgsh_node_connections *c = &graph_solution[order[i]];
+
+		for (j = 0; j < c->n_edges_outgoing; j++)
+			if (c->edges_outgoing[j].instances)
+				height[order[i]] = MAX(height[order[i]],
+					height[c->edges_outgoing[j].to] + 1);
+		length = MAX(length, depth[order[i]] + height[order[i]] + 1);
+	}
+
+	free(order);
+	free(n_inputs);
+	return n_ordered == n_nodes ? length : -1;
+}
+
+/* Return the number of channels of the specified edges */
+static int
+channels(struct dgsh_edge *edges, int n_edges)
+{
+	int i, n = 0;
+
+	for (i = 0; i < n_edges; i++)
+		n += edges[i].instances;
+	return n;
+}
+
+/*
+ * Write to the specified file a description of the solution in JSON,
+ * for debugging: each node's channels and position on the graph's paths,
+ * the critical path, the edges, and the concentrators in use.
  */
 STATIC enum op_result
-alloc_node_connections(struct dgsh_edge **nc_edges, int nc_n_edges, int type,
-								int node_index)
+output_plan(const char *filename)
 {
-	if (!nc_edges) {
-		DPRINTF(4, "ERROR: Double pointer to node connection edges is NULL.\n");
+	int n_nodes = chosen_mb->n_nodes;
+	struct dgsh_node_connections *graph_solution =
+					chosen_mb->graph_solution;
+	int *depth, *height;
+	int i, j, length;
+	bool first;
+	FILE *f;
+
+	depth = (int *)malloc(sizeof(int) * n_nodes);
+	height = (int *)malloc(sizeof(int) * n_nodes);
+	if (depth == NULL || height == NULL) {
+		free(depth);
+		free(height);
 		return OP_ERROR;
 	}
-	if (node_index < 0) {
-		DPRINTF(4, "ERROR: Index of node whose connections will be allocated is negative number.\n");
+	length = solution_depths(depth, height);
+	if ((f = fopen(filename, "w")) == NULL) {
+		warn("%s", filename);
+		free(depth);
+		free(height);
 		return OP_ERROR;
 	}
-	if (type > 1 || type < 0) {
-		DPRINTF(4, "ERROR: Type of edge is neither incoming (1) nor outgoing(0).\ntyep is: %d.\n", type);
+
+	DPRINTF(4, "Output plan in file %s for %d nodes", filename, n_nodes);
+	fprintf(f, "{\n\"nodes\": [");
+	for (i = 0; i < n_nodes; i++) {
+		struct dgsh_node *node = &chosen_mb->node_array[i];
+		struct dgsh_node_connections *c = &graph_solution[i];
+
+		fprintf(f, "%s\n  {\"index\": %d, \"name\": \"",
+				i ? "," : "", node->index);
+		fput_json_string(node->name, f);
+		fprintf(f, "\", \"pid\": %d, \"position\": %d, "
+				"\"fan_in\": %d, \"fan_out\": %d, "
+				"\"depth\": %d, \"height\": %d, "
+				"\"critical\": %s}",
+				node->pid, node->position,
+				channels(c->edges_incoming, c->n_edges_incoming),
+				channels(c->edges_outgoing, c->n_edges_outgoing),
+				length < 0 ? -1 : depth[i],
+				length < 0 ? -1 : height[i],
+				length > 0 && depth[i] + height[i] + 1 == length ?
+					"true" : "false");
+	}
+	fprintf(f, "\n],\n\"edges\": [");
+	first = true;
+	for (i = 0; i < n_nodes; i++)
+		for (j = 0; j < graph_solution[i].n_edges_outgoing; j++) {
+			struct dgsh_edge *e =
+				&graph_solution[i].edges_outgoing[j];
+
+			if (e->instances == 0)
+				continue;
+			fprintf(f, "%s\n  {\"from\": %d, \"to\": %d, "
+					"\"channels\": %d}",
+					first ? "" : ",", e->from, e->to,
+					e->instances);
+			first = false;
+		}
+	fprintf(f, "\n],\n\"concentrators\": [");
+	for (i = 0; i < chosen_mb->n_concs; i++) {
+		struct dgsh_conc *c = &chosen_mb->conc_array[i];
+
+		fprintf(f, "%s\n  {\"pid\": %d, \"position\": %d, "
+				"\"type\": \"%s\", \"endpoint_pid\": %d, "
+				"\"processes\": %d, \"channels\": %d}",
+				i ? "," : "", c->pid, c->position,
+				c->multiple_inputs ? "gather" : "scatter",
+				c->endpoint_pid, c->n_proc_pids,
+				c->multiple_inputs ? c->input_fds :
+					c->output_fds);
+	}
+	fprintf(f, "\n],\n\"critical_path_length\": %d\n}\n", length);
+
+	free(depth);
+	free(height);
+	if (fclose(f) != 0) {
+		warn("%s", filename);
 		return OP_ERROR;
 	}
+	return OP_SUCCESS;
+}
 
-	*nc_edges = (struct dgsh_edge *)malloc(sizeof(struct dgsh_edge) *
-								nc_n_edges);
-	if (!*nc_edges) {
-		DPRINTF(4, "ERROR: Memory allocation for node's index %d %s connections \
-failed.\n", node_index, (type) ? "incoming" : "outgoing");
+/**
+ * Allocate the edges of mb's solution as a single block, in the layout
+ * of a compressed sparse row matrix: the incoming edges of all nodes
+ * in node order, followed by their outgoing edges.
+ * The edge counts of the solution's node connections act as the row
+ * offsets; point each node's connections to its slice of the block.
+ */
+STATIC enum op_result
+alloc_solution_edges(struct dgsh_negotiation *mb)
+{
+	struct dgsh_node_connections *graph_solution = mb->graph_solution;
+	struct dgsh_edge *edges_incoming, *edges_outgoing;
+	int i, n_in = 0, n_out = 0;
 
+	for (i = 0; i < mb->n_nodes; i++) {
+		struct dgsh_node_connections *nc = &graph_solution[i];
+
+		nc->edges_incoming = nc->edges_outgoing = NULL;
+		if (nc->n_edges_incoming < 0 || nc->n_edges_outgoing < 0) {
+			DPRINTF(4, "ERROR: Node %d has a negative number of edges.", i);
+			return OP_ERROR;
+		}
+		n_in += nc->n_edges_incoming;
+		n_out += nc->n_edges_outgoing;
+	}
+
+	mb->solution_edges = NULL;
+	mb->n_solution_edges = n_in + n_out;
+	if (mb->n_solution_edges == 0)
+		return OP_SUCCESS;
+	mb->solution_edges = (struct dgsh_edge *)malloc(
+			sizeof(struct dgsh_edge) * mb->n_solution_edges);
+	if (mb->solution_edges == NULL) {
+		DPRINTF(4, "ERROR: Memory allocation for %d solution edges failed.",
+				mb->n_solution_edges);
+		mb->n_solution_edges = 0;
 		return OP_ERROR;
 	}
+
+	edges_incoming = mb->solution_edges;
+	edges_outgoing = mb->solution_edges + n_in;
+	for (i = 0; i < mb->n_nodes; i++) {
+		struct dgsh_node_connections *nc = &graph_solution[i];
+
+		if (nc->n_edges_incoming > 0)
+			nc->edges_incoming = edges_incoming;
+		if (nc->n_edges_outgoing > 0)
+			nc->edges_outgoing = edges_outgoing;
+		edges_incoming += nc->n_edges_incoming;
+		edges_outgoing += nc->n_edges_outgoing;
+	}
 	return OP_SUCCESS;
 }
 
 /**
  * Copy the array of pointers to edges that go to or leave from a node
- * (i.e. its incoming or outgoing connections) to a self-contained compact
- * array of edges for easy transmission and receipt in one piece.
+ * (i.e. its incoming or outgoing connections) to the node's compact
+ * slice of the solution's edge block, for easy transmission and
+ * receipt in one piece.
  */
 STATIC enum op_result
-make_compact_edge_array(struct dgsh_edge **nc_edges, int nc_n_edges,
+make_compact_edge_array(struct dgsh_edge *nc_edges, int nc_n_edges,
 			struct dgsh_edge **p_edges)
 {
 	int i;
-	int array_size = sizeof(struct dgsh_edge) * nc_n_edges;
 
 	if (nc_n_edges <= 0) {
-		DPRINTF(4, "ERROR: Size identifier to be used in malloc() is non-positive number: %d.\n", nc_n_edges);
+		DPRINTF(4, "ERROR: Number of edges to copy is non-positive number: %d.\n", nc_n_edges);
 		return OP_ERROR;
 	}
 	if (nc_edges == NULL) {
@@ -419,13 +786,6 @@ make_compact_edge_array(struct dgsh_edge **nc_edges, int nc_n_edges,
 		return OP_ERROR;
 	}
 
-	*nc_edges = (struct dgsh_edge *)malloc(array_size);
-	if (!(*nc_edges)) {
-		DPRINTF(4, "ERROR: Memory allocation of size %d for edge array failed.\n",
-								array_size);
-		return OP_ERROR;
-	}
-
 	/**
 	 * Copy the edges of interest to the node-specific edge array
 	 * that contains its connections.
@@ -439,7 +799,7 @@ make_compact_edge_array(struct dgsh_edge **nc_edges, int nc_n_edges,
 		 * Dereference to reach the array base, make i hops of size
 		 * sizeof(struct dgsh_edge), and point to that memory block.
 		 */
-		memcpy(&(*nc_edges)[i], p_edges[i], sizeof(struct dgsh_edge));
+		memcpy(&nc_edges[i], p_edges[i], sizeof(struct dgsh_edge));
 		DPRINTF(4, "%s():Copied edge %d -> %d (%d) at index %d.",
 				__func__, p_edges[i]->from, p_edges[i]->to,
 				p_edges[i]->instances, i);
@@ -599,12 +959,18 @@ free_graph_solution(int node_index)
 	struct dgsh_node_connections *graph_solution =
 					chosen_mb->graph_solution;
 	assert(node_index < chosen_mb->n_nodes);
-	for (i = 0; i <= node_index; i++) {
-		if (graph_solution[i].n_edges_incoming > 0)
-			free(graph_solution[i].edges_incoming);
-		if (graph_solution[i].n_edges_outgoing > 0)
-			free(graph_solution[i].edges_outgoing);
-	}
+	if (chosen_mb->solution_edges != NULL) {
+		/* A prepared solution; its edges are in one block */
+		free(chosen_mb->solution_edges);
+		chosen_mb->solution_edges = NULL;
+		chosen_mb->n_solution_edges = 0;
+	} else
+		for (i = 0; i <= node_index; i++) {
+			if (graph_solution[i].n_edges_incoming > 0)
+				free(graph_solution[i].edges_incoming);
+			if (graph_solution[i].n_edges_outgoing > 0)
+				free(graph_solution[i].edges_outgoing);
+		}
 	free(graph_solution);
 	chosen_mb->graph_solution = NULL;
 	DPRINTF(4, "%s: freed %d nodes.", __func__, chosen_mb->n_nodes);
@@ -863,104 +1229,129 @@ find_conc(struct dgsh_negotiation *mb, pid_t pid)
 	return NULL;
 }
 
+/* Progress in calculating a conc's fds; see resolve_conc_fds() */
+enum conc_fds_state {
+	CF_PENDING,	/* Not yet examined */
+	CF_ACTIVE,	/* Its chained concs are being calculated */
+	CF_DONE		/* Calculated */
+};
+
 /**
- * Calculate fds for concs at the multi-pipe
- * endpoint.
+ * Calculate the fds of the conc at index i of the chosen message
+ * block's conc array at the multi-pipe endpoint.
+ * Concs chained to it as processes of its multi-pipe, as happens
+ * with nested scatter and gather blocks, are calculated first,
+ * so that each conc is examined once, whatever its order in the array.
+ * Return OP_ERROR if a conc is chained to itself.
  */
 static enum op_result
-calculate_conc_fds(void)
+resolve_conc_fds(int i, enum conc_fds_state *state)
 {
-	int i, calculated = 0, retries = 0;
-	int n_concs = chosen_mb->n_concs;
+	struct dgsh_conc *c = &chosen_mb->conc_array[i];
+	int j, fds;
+	int endpoint_fds, multi_pipe_fds = 0;
 
-	DPRINTF(4, "%s for %d n_concs", __func__, n_concs);
-	if (n_concs == 0)
+	if (state[i] == CF_DONE)
 		return OP_SUCCESS;
+	if (state[i] == CF_ACTIVE) {
+		DPRINTF(4, "%s(): conc pid %d at index %d is chained to itself",
+				__func__, c->pid, i);
+		return OP_ERROR;
+	}
+	DPRINTF(4, "%s() for conc %d at index %d with %d n_proc_pids",
+			__func__, c->pid, i, c->n_proc_pids);
 
-repeat:
-	for (i = 0; i < n_concs; i++) {
-		struct dgsh_conc *c = &chosen_mb->conc_array[i];
-		DPRINTF(4, "%s() for conc %d at index %d with %d n_proc_pids",
-				__func__, c->pid, i, c->n_proc_pids);
+	if (c->input_fds >= 0 && c->output_fds >= 0) {
+		state[i] = CF_DONE;
+		return OP_SUCCESS;
+	}
+	state[i] = CF_ACTIVE;
 
-		if (c->input_fds >= 0 && c->output_fds >= 0)
-			continue;
+	/*
+	 * Keep the conc's fds unset until they are known, so that
+	 * the concs chained to it can't use partial sums.
+	 */
+	if (c->multiple_inputs)
+		endpoint_fds = get_expected_fds_n(chosen_mb, c->endpoint_pid);
+	else
+		endpoint_fds = get_provided_fds_n(chosen_mb, c->endpoint_pid);
+
+	DPRINTF(4, "%s(): conc pid %d at index %d: %d %s fds for endpoint pid %d recovered",
+			__func__, c->pid, i, endpoint_fds,
+			c->multiple_inputs ? "outgoing" : "incoming",
+			c->endpoint_pid);
 
-		c->input_fds = 0;
-		c->output_fds = 0;
+	for (j = 0; j < c->n_proc_pids; j++) {
+		struct dgsh_conc *pc = find_conc(chosen_mb, c->proc_pids[j]);
+
+		if (pc != NULL && resolve_conc_fds(pc - chosen_mb->conc_array,
+					state) == OP_ERROR)
+			return OP_ERROR;
 
 		if (c->multiple_inputs)
-			c->output_fds = get_expected_fds_n(chosen_mb,
-					c->endpoint_pid);
+			fds = get_provided_fds_n(chosen_mb, c->proc_pids[j]);
 		else
-			c->input_fds = get_provided_fds_n(chosen_mb,
-					c->endpoint_pid);
-
-		DPRINTF(4, "%s(): conc pid %d at index %d: %d %s fds for endpoint pid %d recovered",
-				__func__, c->pid, i,
-				c->multiple_inputs ? c->output_fds : c->input_fds,
-				c->multiple_inputs ? "outgoing" : "incoming",
-				c->endpoint_pid);
-
-		int j, fds;
-		for (j = 0; j < c->n_proc_pids; j++) {
-			if (c->multiple_inputs)
-				fds = get_provided_fds_n(chosen_mb,
-						c->proc_pids[j]);
-			else
-				fds = get_expected_fds_n(chosen_mb,
-						c->proc_pids[j]);
-
-			if (find_conc(chosen_mb, c->proc_pids[j]) && fds == -1) {
-				c->input_fds = c->output_fds = -1;
-				DPRINTF(4, "%s(): conc pid %d at index %d: fds for conc with pid %d not yet available",
-					__func__, c->pid, i, c->proc_pids[j]);
-				break;
-			} else
-				if (c->multiple_inputs)
-					c->input_fds += fds;
-				else
-					c->output_fds += fds;
-			DPRINTF(4, "%s(): conc pid %d at index %d: %d %s fds for pid %d recovered",
-				__func__, c->pid, i, fds,
-				c->multiple_inputs ? "incoming" : "outgoing",
-				c->proc_pids[j]);
-		}
-		// Use what we know for the multi-pipe end to compute the endpoint
-		if (c->multiple_inputs && c->input_fds >= 0 && c->output_fds == -1)
-			c->output_fds = c->input_fds;
-		else if (!c->multiple_inputs && c->output_fds >= 0
-				&& c->input_fds == -1)
-			c->input_fds = c->output_fds;
-
-		if (c->input_fds >= 0 && c->output_fds >= 0) {
-			assert(c->input_fds == c->output_fds);
-			calculated++;
-		}
-		DPRINTF(4, "%s(): Conc pid %d at index %d has %d %s fds and %d %s fds",
-				__func__, c->pid, i,
-				c->multiple_inputs ? c->input_fds : c->output_fds,
-				c->multiple_inputs ? "incoming" : "outgoing",
-				c->multiple_inputs ? c->output_fds : c->input_fds,
-				c->multiple_inputs ? "outgoing" : "incoming");
-		DPRINTF(4, "%s(): Calculated fds for %d concs so far", __func__,
-				calculated);
-
+			fds = get_expected_fds_n(chosen_mb, c->proc_pids[j]);
+		multi_pipe_fds += fds;
+		DPRINTF(4, "%s(): conc pid %d at index %d: %d %s fds for pid %d recovered",
+			__func__, c->pid, i, fds,
+			c->multiple_inputs ? "incoming" : "outgoing",
+			c->proc_pids[j]);
 	}
-	if (calculated != n_concs && retries < n_concs) {
-		retries++;
-		goto repeat;
+	// Use what we know for the multi-pipe end to compute the endpoint
+	if (multi_pipe_fds >= 0 && endpoint_fds == -1)
+		endpoint_fds = multi_pipe_fds;
+
+	DPRINTF(4, "%s(): Conc pid %d at index %d has %d %s fds and %d %s fds",
+			__func__, c->pid, i,
+			multi_pipe_fds,
+			c->multiple_inputs ? "incoming" : "outgoing",
+			endpoint_fds,
+			c->multiple_inputs ? "outgoing" : "incoming");
+	if (multi_pipe_fds < 0 || endpoint_fds < 0)
+		return OP_ERROR;
+	assert(multi_pipe_fds == endpoint_fds);
+	if (c->multiple_inputs) {
+		c->input_fds = multi_pipe_fds;
+		c->output_fds = endpoint_fds;
+	} else {
+		c->input_fds = endpoint_fds;
+		c->output_fds = multi_pipe_fds;
 	}
+	state[i] = CF_DONE;
+	return OP_SUCCESS;
+}
 
-	if (retries == n_concs)
-		return OP_ERROR;
+/**
+ * Calculate fds for concs at the multi-pipe
+ * endpoint.
+ */
+static enum op_result
+calculate_conc_fds(void)
+{
+	int i;
+	int n_concs = chosen_mb->n_concs;
+	enum conc_fds_state *state;
+	enum op_result result = OP_SUCCESS;
 
-	return OP_SUCCESS;
+	DPRINTF(4, "%s for %d n_concs", __func__, n_concs);
+	if (n_concs == 0)
+		return OP_SUCCESS;
+
+	state = (enum conc_fds_state *)calloc(n_concs, sizeof(*state));
+	if (state == NULL)
+		return OP_ERROR;
+	for (i = 0; i < n_concs && result == OP_SUCCESS; i++)
+		result = resolve_conc_fds(i, state);
+	free(state);
+	return result;
 }
 
 /**
  * For each node substitute pointers to edges with proper edge structures
  * (copies) to facilitate transmission and receipt in one piece.
+ * The copies of all nodes are stored in a single block;
+ * see alloc_solution_edges().
  */
 static enum op_result
 prepare_solution(void)
@@ -969,19 +1360,30 @@ prepare_solution(void)
 	int n_nodes = chosen_mb->n_nodes;
 	struct dgsh_node_connections *graph_solution =
 					chosen_mb->graph_solution;
+	struct dgsh_edge ***edge_pointers;
 	enum op_result exit_state = OP_SUCCESS;
 
+	/* Detach the pointers to edges before pointing to the block */
+	edge_pointers = (struct dgsh_edge ***)malloc(
+			sizeof(struct dgsh_edge **) * 2 * n_nodes);
+	if (edge_pointers == NULL) {
+		DPRINTF(4, "ERROR: Memory allocation of edge pointers failed.");
+		return OP_ERROR;
+	}
+	for (i = 0; i < n_nodes; i++) {
+		/* Hack: struct dgsh_edge* -> struct dgsh_edge** */
+		edge_pointers[2 * i] =
+			(struct dgsh_edge **)graph_solution[i].edges_incoming;
+		edge_pointers[2 * i + 1] =
+			(struct dgsh_edge **)graph_solution[i].edges_outgoing;
+	}
+
+	if (alloc_solution_edges(chosen_mb) == OP_ERROR)
+		exit_state = OP_ERROR;
+
 	for (i = 0; i < n_nodes; i++) {
 		struct dgsh_node_connections *current_connections =
 							&graph_solution[i];
-		/* Hack: struct dgsh_edge* -> struct dgsh_edge** */
-		struct dgsh_edge **edges_incoming =
-		       (struct dgsh_edge **)current_connections->edges_incoming;
-		current_connections->edges_incoming = NULL;
-		/* Hack: struct dgsh_edge* -> struct dgsh_edge** */
-		struct dgsh_edge **edges_outgoing =
-		       (struct dgsh_edge **)current_connections->edges_outgoing;
-		current_connections->edges_outgoing = NULL;
         	int *n_edges_incoming = &current_connections->n_edges_incoming;
         	int *n_edges_outgoing = &current_connections->n_edges_outgoing;
 		DPRINTF(3, "%s(): Node %s, pid: %d, connections in: %d, connections out: %d.",
@@ -992,22 +1394,23 @@ prepare_solution(void)
 		if (*n_edges_incoming > 0) {
 			if (exit_state == OP_SUCCESS)
 				if (make_compact_edge_array(
-					&current_connections->edges_incoming,
-			       		*n_edges_incoming, edges_incoming)
+					current_connections->edges_incoming,
+			       		*n_edges_incoming, edge_pointers[2 * i])
 								== OP_ERROR)
 					exit_state = OP_ERROR;
-			free(edges_incoming);
+			free(edge_pointers[2 * i]);
 		}
 		if (*n_edges_outgoing > 0) {
 			if (exit_state == OP_SUCCESS)
 				if (make_compact_edge_array(
-					&current_connections->edges_outgoing,
-					*n_edges_outgoing, edges_outgoing)
+					current_connections->edges_outgoing,
+					*n_edges_outgoing, edge_pointers[2 * i + 1])
 								== OP_ERROR)
 					exit_state = OP_ERROR;
-			free(edges_outgoing);
+			free(edge_pointers[2 * i + 1]);
 		}
 	}
+	free(edge_pointers);
 	return exit_state;
 }
 
@@ -1172,6 +1575,9 @@ node_match_constraints(void)
 		DPRINTF(4, "ERROR: Failed to allocate memory of size %d for dgsh negotiation graph solution structure.\n", graph_solution_size);
 		return OP_ERROR;
 	}
+	/* Edges are pointed to until prepare_solution() copies them */
+	chosen_mb->solution_edges = NULL;
+	chosen_mb->n_solution_edges = 0;
 
 	/* Check constraints for each node on the dgsh graph. */
 	for (i = 0; i < n_nodes; i++) {
@@ -1213,6 +1619,370 @@ node_match_constraints(void)
 	return exit_state;
 }
 
+/**
+ * Construct in sig (of length len) a canonical signature of the
+ * graph's I/O constraint problem: the nodes' names and channel
+ * constraints, and the edge list.
+ * The caller is responsible for freeing sig.
+ */
+STATIC enum op_result
+graph_signature(char **sig, size_t *len)
+{
+	int i;
+	FILE *f = open_memstream(sig, len);
+
+	if (f == NULL)
+		return OP_ERROR;
+	fprintf(f, "dgsh solution %d %d %d %d\n", DGSH_CACHE_VERSION,
+			chosen_mb->version, chosen_mb->n_nodes,
+			chosen_mb->n_edges);
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		struct dgsh_node *node = &chosen_mb->node_array[i];
+		fprintf(f, "n %d %d %d %d %d %.*s\n", node->index,
+				node->requires_channels,
+				node->provides_channels,
+				node->dgsh_in, node->dgsh_out,
+				(int)sizeof(node->name), node->name);
+	}
+	for (i = 0; i < chosen_mb->n_edges; i++)
+		fprintf(f, "e %d %d\n", chosen_mb->edge_array[i].from,
+				chosen_mb->edge_array[i].to);
+	if (fclose(f) != 0) {
+		free(*sig);
+		return OP_ERROR;
+	}
+	return OP_SUCCESS;
+}
+
+/**
+ * Set in path the name of the file caching the solution for the
+ * graph with signature sig.
+ * Return false if the cache is not enabled or its directory cannot
+ * be created.
+ * The cache is enabled by setting DGSH_CACHE.  If its value is an
+ * absolute path, it names the cache directory; otherwise
+ * $XDG_CACHE_HOME/dgsh or $HOME/.cache/dgsh is used.
+ */
+STATIC bool
+cache_path(const char *sig, size_t len, char *path, size_t path_size)
+{
+	char *dir = getenv("DGSH_CACHE");
+	char *base;
+	char dirbuf[PATH_MAX];
+	unsigned long long hash = 14695981039346656037ULL;	/* FNV-1a */
+	size_t i;
+
+	if (dir == NULL || *dir == '\0')
+		return false;
+	if (*dir != '/') {
+		if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base)
+			snprintf(dirbuf, sizeof(dirbuf), "%s", base);
+		else if ((base = getenv("HOME")) != NULL && *base) {
+			snprintf(dirbuf, sizeof(dirbuf), "%s/.cache", base);
+			(void)mkdir(dirbuf, 0700);
+		} else
+			return false;
+		strncat(dirbuf, "/dgsh", sizeof(dirbuf) - strlen(dirbuf) - 1);
+		dir = dirbuf;
+	}
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		DPRINTF(1, "%s(): cannot create cache directory %s: %s",
+				__func__, dir, strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)sig[i];
+		hash *= 1099511628211ULL;
+	}
+	snprintf(path, path_size, "%s/%016llx", dir, hash);
+	return true;
+}
+
+/**
+ * Read from f the graph solution of mb, as written by fwrite_solution(),
+ * into newly allocated memory.
+ */
+STATIC enum op_result
+fread_solution(FILE *f, struct dgsh_negotiation *mb)
+{
+	int i;
+	int n_nodes = mb->n_nodes;
+	struct dgsh_node_connections *graph_solution;
+
+	mb->solution_edges = NULL;
+	mb->n_solution_edges = 0;
+	graph_solution = malloc(sizeof(struct dgsh_node_connections) * n_nodes);
+	if (graph_solution == NULL)
+		return OP_ERROR;
+	if (fread(graph_solution, sizeof(struct dgsh_node_connections),
+				n_nodes, f) != (size_t)n_nodes)
+		goto error;
+	for (i = 0; i < n_nodes; i++)
+		if (graph_solution[i].node_index != i)
+			goto error;
+
+	mb->graph_solution = graph_solution;
+	if (alloc_solution_edges(mb) == OP_ERROR ||
+			fread(mb->solution_edges, sizeof(struct dgsh_edge),
+				mb->n_solution_edges, f) !=
+			(size_t)mb->n_solution_edges)
+		goto error;
+	return OP_SUCCESS;
+
+error:
+	free(mb->solution_edges);
+	mb->solution_edges = NULL;
+	mb->n_solution_edges = 0;
+	free(graph_solution);
+	mb->graph_solution = NULL;
+	return OP_ERROR;
+}
+
+/**
+ * Write to f the message block's graph solution: the node connections
+ * followed by the block of their edges.
+ */
+STATIC void
+fwrite_solution(FILE *f)
+{
+	fwrite(chosen_mb->graph_solution, sizeof(struct dgsh_node_connections),
+			chosen_mb->n_nodes, f);
+	fwrite(chosen_mb->solution_edges, sizeof(struct dgsh_edge),
+			chosen_mb->n_solution_edges, f);
+}
+
+/**
+ * Try to load from the cache the solution of the graph with signature sig.
+ * On success the loaded solution is set as the message block's
+ * graph solution.
+ */
+STATIC enum op_result
+cache_load_solution(const char *sig, size_t len)
+{
+	char path[PATH_MAX];
+	char *cached_sig = NULL;
+	size_t cached_len;
+	FILE *f;
+
+	if (!cache_path(sig, len, path, sizeof(path)))
+		return OP_ERROR;
+	if ((f = fopen(path, "r")) == NULL)
+		return OP_ERROR;
+
+	/* Guard against hash collisions */
+	if (fread(&cached_len, sizeof(cached_len), 1, f) != 1 ||
+			cached_len != len ||
+			(cached_sig = malloc(len)) == NULL ||
+			fread(cached_sig, 1, len, f) != len ||
+			memcmp(cached_sig, sig, len) != 0 ||
+			fread_solution(f, chosen_mb) != OP_SUCCESS) {
+		DPRINTF(2, "%s(): ignoring invalid cache entry %s",
+				__func__, path);
+		free(cached_sig);
+		fclose(f);
+		return OP_ERROR;
+	}
+	fclose(f);
+	free(cached_sig);
+	DPRINTF(2, "%s(): loaded solution from %s", __func__, path);
+	return OP_SUCCESS;
+}
+
+/**
+ * Store in the cache the message block's graph solution for the graph
+ * with signature sig.
+ * The entry is written to a temporary file and renamed into place,
+ * so that concurrently running graphs never see a partial entry.
+ */
+STATIC enum op_result
+cache_store_solution(const char *sig, size_t len)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 20];
+	bool failed;
+	FILE *f;
+
+	if (!cache_path(sig, len, path, sizeof(path)))
+		return OP_ERROR;
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+	if ((f = fopen(tmp_path, "w")) == NULL)
+		return OP_ERROR;
+
+	fwrite(&len, sizeof(len), 1, f);
+	fwrite(sig, 1, len, f);
+	fwrite_solution(f);
+	failed = ferror(f);
+	if (fclose(f) != 0)
+		failed = true;
+	if (failed || rename(tmp_path, path) == -1) {
+		DPRINTF(1, "%s(): cannot write cache entry %s", __func__, path);
+		unlink(tmp_path);
+		return OP_ERROR;
+	}
+	DPRINTF(2, "%s(): stored solution in %s", __func__, path);
+	return OP_SUCCESS;
+}
+
+/* Return the process's position in the graph, as set by the shell, or -1 */
+int
+graph_position(void)
+{
+	char *position = getenv("DGSH_POSITION");
+
+	return position == NULL ? -1 : atoi(position);
+}
+
+/**
+ * Store the solved graph in the file at path, so that subsequent
+ * runs of the same graph can set up their connections without
+ * negotiating (see graph_file_negotiate()).
+ * This is only possible if the shell has identified the graph's shape
+ * and set the position of all the graph's tools and concentrators.
+ */
+STATIC enum op_result
+graph_file_store(const char *path)
+{
+	char tmp_path[PATH_MAX + 20];
+	char *id = getenv("DGSH_GRAPH_ID");
+	int i;
+	bool failed;
+	FILE *f;
+
+	if (id == NULL || strchr(id, '\n') != NULL)
+		return OP_ERROR;
+	for (i = 0; i < chosen_mb->n_nodes; i++)
+		if (chosen_mb->node_array[i].position < 0)
+			return OP_ERROR;
+	for (i = 0; i < chosen_mb->n_concs; i++)
+		if (chosen_mb->conc_array[i].position < 0)
+			return OP_ERROR;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+	if ((f = fopen(tmp_path, "w")) == NULL)
+		return OP_ERROR;
+	fprintf(f, "dgsh graph %d %d %d %d\n%s\n", DGSH_GRAPH_VERSION,
+			chosen_mb->version, chosen_mb->n_nodes,
+			chosen_mb->n_concs, id);
+	fwrite(chosen_mb->node_array, sizeof(struct dgsh_node),
+			chosen_mb->n_nodes, f);
+	fwrite_solution(f);
+	fwrite(chosen_mb->conc_array, sizeof(struct dgsh_conc),
+			chosen_mb->n_concs, f);
+	for (i = 0; i < chosen_mb->n_concs; i++)
+		fwrite(chosen_mb->conc_array[i].proc_pids, sizeof(int),
+				chosen_mb->conc_array[i].n_proc_pids, f);
+	failed = ferror(f);
+	if (fclose(f) != 0)
+		failed = true;
+	if (failed || rename(tmp_path, path) == -1) {
+		DPRINTF(1, "%s(): cannot write graph file %s", __func__, path);
+		unlink(tmp_path);
+		return OP_ERROR;
+	}
+	DPRINTF(2, "%s(): stored graph in %s", __func__, path);
+	return OP_SUCCESS;
+}
+
+/**
+ * Load into a newly allocated message block set in mb the solved
+ * graph stored in the file at path by graph_file_store(),
+ * provided that it was stored for the graph identified by id.
+ * The message block's pids are those of the run that stored the graph.
+ */
+enum op_result
+graph_file_load(const char *path, const char *id, struct dgsh_negotiation **mb)
+{
+	char header[100];
+	char stored_id[256];
+	int version, mb_version, n_nodes, n_concs;
+	int i;
+	struct dgsh_negotiation *m;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return OP_ERROR;
+	if (fgets(header, sizeof(header), f) == NULL ||
+			sscanf(header, "dgsh graph %d %d %d %d", &version,
+				&mb_version, &n_nodes, &n_concs) != 4 ||
+			version != DGSH_GRAPH_VERSION ||
+			n_nodes <= 0 || n_concs < 0 ||
+			/* Only use a graph stored for the same shape */
+			fgets(stored_id, sizeof(stored_id), f) == NULL ||
+			strlen(stored_id) != strlen(id) + 1 ||
+			strncmp(stored_id, id, strlen(id)) != 0 ||
+			stored_id[strlen(id)] != '\n' ||
+			(m = calloc(1, sizeof(*m))) == NULL) {
+		fclose(f);
+		return OP_ERROR;
+	}
+	m->version = mb_version;
+	m->n_nodes = n_nodes;
+	m->n_concs = n_concs;
+	m->state = PS_COMPLETE;
+	if ((m->node_array = malloc(sizeof(struct dgsh_node) * n_nodes))
+			== NULL ||
+			fread(m->node_array, sizeof(struct dgsh_node), n_nodes,
+				f) != (size_t)n_nodes ||
+			fread_solution(f, m) != OP_SUCCESS)
+		goto error;
+	if (n_concs > 0) {
+		if ((m->conc_array = calloc(n_concs, sizeof(struct dgsh_conc)))
+				== NULL ||
+				fread(m->conc_array, sizeof(struct dgsh_conc),
+					n_concs, f) != (size_t)n_concs)
+			goto error;
+		for (i = 0; i < n_concs; i++) {
+			struct dgsh_conc *c = &m->conc_array[i];
+
+			c->proc_pids = NULL;
+			if (c->n_proc_pids <= 0 || (c->proc_pids =
+					malloc(sizeof(int) * c->n_proc_pids))
+					== NULL ||
+					fread(c->proc_pids, sizeof(int),
+					c->n_proc_pids, f) !=
+					(size_t)c->n_proc_pids) {
+				/* Not yet read proc_pids are garbage */
+				m->n_concs = i + 1;
+				goto error;
+			}
+		}
+	}
+	fclose(f);
+	*mb = m;
+	DPRINTF(2, "%s(): loaded graph from %s", __func__, path);
+	return OP_SUCCESS;
+
+error:
+	DPRINTF(2, "%s(): ignoring invalid graph file %s", __func__, path);
+	fclose(f);
+	free(m->solution_edges);
+	free(m->graph_solution);
+	free(m->node_array);
+	if (m->conc_array) {
+		for (i = 0; i < m->n_concs; i++)
+			free(m->conc_array[i].proc_pids);
+		free(m->conc_array);
+	}
+	free(m);
+	return OP_ERROR;
+}
+
+/**
+ * Fail a process whose entry at the specified position of the graph
+ * file at path does not match it.
+ * The graph's other processes may already be using the stored graph,
+ * so the process cannot negotiate on its own.  Instead it removes the
+ * file, so that the graph's next run negotiates and stores it afresh.
+ */
+void
+graph_file_mismatch(const char *path, int position)
+{
+	warnx("%s: entry at position %d does not match the process; removed",
+			path, position);
+	unlink(path);
+	errno = EINVAL;
+}
 
 /**
  * This function implements the algorithm that tries to satisfy reported
@@ -1227,6 +1997,25 @@ solve_graph(void)
 	int index_argc = 0;
 	int *index_commands_notmatched;
 	int *side_commands_notmatched;
+	char *sig = NULL;
+	size_t sig_len = 0;
+	long long start = trace_now();
+
+	/* A graph we have seen before; reuse its solution. */
+	if (getenv("DGSH_CACHE") &&
+			graph_signature(&sig, &sig_len) == OP_SUCCESS) {
+		if (cache_load_solution(sig, sig_len) == OP_SUCCESS) {
+			cache_hits++;
+			DPRINTF(1, "%s(): solution cache hit (hits: %d, misses: %d)",
+					__func__, cache_hits, cache_misses);
+			free(sig);
+			sig = NULL;
+			goto solved;
+		}
+		cache_misses++;
+		DPRINTF(1, "%s(): solution cache miss (hits: %d, misses: %d)",
+				__func__, cache_hits, cache_misses);
+	}
 
 	/**
 	 * The initial layout of the solution plays an important
@@ -1243,8 +2032,11 @@ solve_graph(void)
 	 * Try to match each node's I/O resources with constraints
 	 * expressed by incoming and outgoing edges.
 	 */
-	if ((exit_state = node_match_constraints()) == OP_ERROR)
+	if ((exit_state = node_match_constraints()) == OP_ERROR) {
+		free(sig);
+		trace_event("solve", start, chosen_mb->n_nodes, "ERROR");
 		return exit_state;
+	}
 
 	/* Optimise solution using flexible constraints */
 	exit_state = OP_RETRY;
@@ -1279,13 +2071,25 @@ solve_graph(void)
 	if ((exit_state = prepare_solution()) == OP_ERROR)
 		goto exit;
 
+	if (sig)
+		cache_store_solution(sig, sig_len);
+
+solved:
 	if ((exit_state = calculate_conc_fds()) == OP_ERROR)
 		goto exit;
 
+	/* Allow the next run of this graph to skip the negotiation */
+	if ((filename = getenv("DGSH_GRAPH")))
+		graph_file_store(filename);
+
 	if ((filename = getenv("DGSH_DOT_DRAW")))
 		if ((exit_state = output_graph(filename)) == OP_ERROR)
 			goto exit;
 
+	if ((filename = getenv("DGSH_PLAN")))
+		if ((exit_state = output_plan(filename)) == OP_ERROR)
+			goto exit;
+
 	if (getenv("DGSH_DRAW_EXIT")) {
 		DPRINTF(1, "Document the solution and exit\n");
 		exit_state = OP_DRAW_EXIT;
@@ -1294,8 +2098,11 @@ solve_graph(void)
 	DPRINTF(4, "%s: exit_state: %d", __func__, exit_state);
 
 exit:
+	free(sig);
 	if (exit_state == OP_ERROR || exit_state == OP_DRAW_EXIT)
 		free_graph_solution(chosen_mb->n_nodes - 1);
+	trace_event("solve", start, chosen_mb->n_nodes,
+			state_name(chosen_mb->state));
 	return exit_state;
 } /* memory deallocation when in error state? */
 
@@ -1317,14 +2124,19 @@ establish_io_connections(int **input_fds, int *n_input_fds, int **output_fds,
 		 * take the place of stdin.
 		 */
 		int fd_to_dup = self_pipe_fds.input_fds[0];
-		if (close(STDIN_FILENO) == -1)
-			err(1, "Close stdin failed");
-		if ((self_pipe_fds.input_fds[0] = dup(fd_to_dup)) == -1)
-			err(1, "dup failed with errno %d", errno);
-		DPRINTF(4, "%s(): closed STDIN, dup %d returned %d",
-				__func__,fd_to_dup, self_pipe_fds.input_fds[0]);
+		/*
+		 * Replace stdin atomically: the program's other threads
+		 * may open files while an asynchronous negotiation runs.
+		 */
+		if ((self_pipe_fds.input_fds[0] = dup2(fd_to_dup, STDIN_FILENO)) == -1)
+			err(1, "dup2 failed with errno %d", errno);
+		DPRINTF(4, "%s(): dup2 %d to STDIN returned %d",
+				__func__, fd_to_dup, self_pipe_fds.input_fds[0]);
 		assert(self_pipe_fds.input_fds[0] == STDIN_FILENO);
-		close(fd_to_dup);
+		if (fd_to_dup != STDIN_FILENO) {
+			shm_channel_move(fd_to_dup, STDIN_FILENO);
+			close(fd_to_dup);
+		}
 
 		if (n_input_fds) {
 			*n_input_fds = self_pipe_fds.n_input_fds;
@@ -1345,14 +2157,19 @@ establish_io_connections(int **input_fds, int *n_input_fds, int **output_fds,
 		 * take the place of stdin.
 		 */
 		int fd_to_dup = self_pipe_fds.output_fds[0];
-		if (close(STDOUT_FILENO) == -1)
-			err(1, "Close stdout failed");
-		if ((self_pipe_fds.output_fds[0] = dup(fd_to_dup)) == -1)
-			err(1, "dup failed with errno %d", errno);
-		DPRINTF(4, "%s(): closed STDOUT, dup %d returned %d",
-				__func__,fd_to_dup,self_pipe_fds.output_fds[0]);
+		/*
+		 * Replace stdout atomically: the program's other threads
+		 * may open files while an asynchronous negotiation runs.
+		 */
+		if ((self_pipe_fds.output_fds[0] = dup2(fd_to_dup, STDOUT_FILENO)) == -1)
+			err(1, "dup2 failed with errno %d", errno);
+		DPRINTF(4, "%s(): dup2 %d to STDOUT returned %d",
+				__func__, fd_to_dup, self_pipe_fds.output_fds[0]);
 		assert(self_pipe_fds.output_fds[0] == STDOUT_FILENO);
-		close(fd_to_dup);
+		if (fd_to_dup != STDOUT_FILENO) {
+			shm_channel_move(fd_to_dup, STDOUT_FILENO);
+			close(fd_to_dup);
+		}
 
 		if (n_output_fds) {
 			*n_output_fds = self_pipe_fds.n_output_fds;
@@ -1374,6 +2191,86 @@ establish_io_connections(int **input_fds, int *n_input_fds, int **output_fds,
 	return re;
 }
 
+/*
+ * Return the pipe capacity requested through the channel hints h.
+ * An explicit buffer size takes precedence; otherwise small expected
+ * volumes get a minimal pipe and large ones a large pipe, unless
+ * the channel is latency sensitive.
+ */
+STATIC int
+hinted_pipe_size(const struct dgsh_channel_hints *h)
+{
+	if (h == NULL)
+		return 0;
+	if (h->buffer_size > 0)
+		return h->buffer_size;
+	if (h->expected_bytes > 0 && h->expected_bytes <= DGSH_SMALL_VOLUME)
+		return DGSH_SMALL_PIPE_SIZE;
+	if (h->latency_sensitive)
+		return 0;
+	if (h->expected_bytes >= DGSH_LARGE_VOLUME)
+		return DGSH_LARGE_PIPE_SIZE;
+	return 0;
+}
+
+/*
+ * Return the largest pipe capacity the system allows,
+ * as set in /proc/sys/fs/pipe-max-size.
+ */
+STATIC int
+pipe_max_size(void)
+{
+	static int max_size = 0;
+
+	if (max_size == 0) {
+		FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+
+		if (f == NULL || fscanf(f, "%d", &max_size) != 1 ||
+				max_size <= 0)
+			max_size = DGSH_LARGE_PIPE_SIZE;
+		if (f)
+			fclose(f);
+	}
+	return max_size;
+}
+
+/*
+ * Return the capacity up to which the pipes of a tool with n_outputs
+ * outputs can be enlarged.
+ * The outputs share the largest capacity the system allows, so that
+ * a wide fan-out does not exhaust the user's pipe memory (on Linux
+ * /proc/sys/fs/pipe-user-pages-soft), after which the kernel gives
+ * all of the user's new pipes a single page.
+ * No pipe is limited below the default capacity.
+ */
+STATIC int
+output_pipe_size_limit(int n_outputs)
+{
+	return MAX(pipe_max_size() / n_outputs, DGSH_DEFAULT_PIPE_SIZE);
+}
+
+/*
+ * Set the capacity of the pipe fd to size bytes, within the limit
+ * set in /proc/sys/fs/pipe-max-size.
+ * Failure is not an error: the pipe retains its default capacity.
+ */
+STATIC void
+set_pipe_size(int fd, int size)
+{
+#ifdef F_SETPIPE_SZ
+	if (size <= 0)
+		return;
+	if (size > pipe_max_size())
+		size = pipe_max_size();
+	if (fcntl(fd, F_SETPIPE_SZ, size) == -1)
+		DPRINTF(2, "%s(): unable to set capacity of pipe %d to %d: %s",
+				__func__, fd, size, strerror(errno));
+	else
+		DPRINTF(4, "%s(): set capacity of pipe %d to %d",
+				__func__, fd, size);
+#endif
+}
+
 /* Transmit file descriptors that will pipe this
  * tool's output to another tool.
  */
@@ -1393,49 +2290,88 @@ write_output_fds(int output_socket, int *output_fds, int flags)
 	assert(this_nc->node_index == self_node.index);
 	int i;
 	int total_edge_instances = 0;
-	enum op_result re = OP_SUCCESS;
+	int n_read_sides = 0;
+	int *read_sides;
+	int size_limit;
+
+	/**
+	 * Due to channel constraint flexibility,
+	 * each edge can have more than one instances.
+	 */
+	for (i = 0; i < this_nc->n_edges_outgoing; i++)
+		total_edge_instances += this_nc->edges_outgoing[i].instances;
+	if (total_edge_instances == 0)
+		return OP_SUCCESS;
+	size_limit = output_pipe_size_limit(total_edge_instances);
+
+	read_sides = (int *)malloc(sizeof(int) *
+			MIN(total_edge_instances, DGSH_MAX_MSG_FDS));
+	if (read_sides == NULL) {
+		DPRINTF(4, "%s(): ERROR. Aborting.", __func__);
+		free_graph_solution(chosen_mb->n_nodes - 1);
+		free(self_pipe_fds.output_fds);
+		return OP_ERROR;
+	}
 
 	/**
 	 * Create a pipe for each instance of each outgoing edge connection.
-	 * Inject the pipe read side in the cont.
-	 * Send each pipe fd as a message to a socket descriptor,
-	 * that is write_fd, that has been
+	 * Send the pipe read sides in batches of control messages
+	 * to a socket descriptor, that is output_socket, that has been
 	 * set up by the shell to support the dgsh negotiation phase.
+	 * After each batch close the read sides to let the recipient
+	 * process handle them; this bounds the descriptors we hold
+	 * to our outputs plus one batch.
 	 */
+	total_edge_instances = 0;
 	for (i = 0; i < this_nc->n_edges_outgoing; i++) {
-		int k;
-		/**
-		 * Due to channel constraint flexibility,
-		 * each edge can have more than one instances.
+		struct dgsh_edge *e = &this_nc->edges_outgoing[i];
+		/* Honor the larger of the two ends' capacity preferences */
+		int pipe_size = MAX(
+			chosen_mb->node_array[e->from].output_pipe_size,
+			chosen_mb->node_array[e->to].input_pipe_size);
+
+		/*
+		 * Connect tools that both support it through shared memory,
+		 * unless the edge carries little data; a minimal pipe
+		 * then costs less than mapping a ring.
 		 */
-		for (k = 0; k < this_nc->edges_outgoing[i].instances; k++) {
-			int fd[2];
-			/* Create pipe, inject the read side to the msg control
-			 * data and close the read side to let the recipient
-			 * process handle it.
-			 */
-			if (pipe(fd) == -1) {
-				perror("pipe open failed");
-				dgsh_exit(-1, flags);
-			}
-			DPRINTF(4, "%s(): created pipe pair %d - %d. Transmitting fd %d through sendmsg().", __func__, fd[0], fd[1], fd[0]);
+		bool use_shm = chosen_mb->node_array[e->from].shm_channels &&
+			chosen_mb->node_array[e->to].shm_channels &&
+			(pipe_size == 0 || pipe_size > DGSH_SMALL_PIPE_SIZE);
+		int k;
 
-			write_fd(output_socket, fd[0]);
-			close(fd[0]);
+		for (k = 0; k < e->instances; k++) {
+			int fd[2];
 
-			output_fds[total_edge_instances] = fd[1];
-			total_edge_instances++;
+			if (use_shm && (fd[1] = shm_channel_create(pipe_size,
+							&fd[0])) != -1) {
+				DPRINTF(4, "%s(): created channel %d - %d.",
+						__func__, fd[0], fd[1]);
+			} else {
+				if (pipe(fd) == -1) {
+					perror("pipe open failed");
+					dgsh_exit(-1, flags);
+				}
+				DPRINTF(4, "%s(): created pipe pair %d - %d.",
+						__func__, fd[0], fd[1]);
+				set_pipe_size(fd[1], MIN(pipe_size, size_limit));
+			}
+			read_sides[n_read_sides++] = fd[0];
+			output_fds[total_edge_instances++] = fd[1];
+			if (n_read_sides == DGSH_MAX_MSG_FDS) {
+				write_fds(output_socket, read_sides,
+						n_read_sides);
+				while (n_read_sides > 0)
+					close(read_sides[--n_read_sides]);
+			}
 		}
-		/* XXX */
-		if (re == OP_ERROR)
-			break;
 	}
-	if (re == OP_ERROR) {
-		DPRINTF(4, "%s(): ERROR. Aborting.", __func__);
-		free_graph_solution(chosen_mb->n_nodes - 1);
-		free(self_pipe_fds.output_fds);
-	}
-	return re;
+
+	write_fds(output_socket, read_sides, n_read_sides);
+	while (n_read_sides > 0)
+		close(read_sides[--n_read_sides]);
+	free(read_sides);
+	return OP_SUCCESS;
 }
 
 static int
@@ -1531,6 +2467,8 @@ do_write (int write_fd, void *datastruct, int datastruct_size, int struct_type)
 	} else
 		wsize = write_piece(write_fd, datastruct, datastruct_size);
 
+	if (wsize != -1)
+		io_bytes += datastruct_size;
 	return wsize;
 }
 
@@ -1566,14 +2504,18 @@ write_concs(int write_fd)
 	return OP_SUCCESS;
 }
 
-/* Transmit dgsh negotiation graph solution to the next tool on the graph. */
+/**
+ * Transmit dgsh negotiation graph solution to the next tool on the graph.
+ * The node connections are followed by the block holding their edges.
+ */
 static enum op_result
 write_graph_solution(int write_fd)
 {
-	int i;
 	int n_nodes = chosen_mb->n_nodes;
 	int graph_solution_size = sizeof(struct dgsh_node_connections) *
 								n_nodes;
+	int edges_size = sizeof(struct dgsh_edge) *
+						chosen_mb->n_solution_edges;
 	struct dgsh_node_connections *graph_solution =
 					chosen_mb->graph_solution;
 	int wsize = -1;
@@ -1586,33 +2528,16 @@ write_graph_solution(int write_fd)
 	}
 	DPRINTF(4, "%s(): Wrote graph solution of size %d bytes ", __func__, wsize);
 
-	/* We haven't invalidated pointers to arrays of node indices. */
-
-	for (i = 0; i < n_nodes; i++) {
-		struct dgsh_node_connections *nc = &graph_solution[i];
-		int in_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_incoming;
-		int out_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_outgoing;
-		if (nc->n_edges_incoming) {
-			/* Transmit a node's incoming connections. */
-			wsize = do_write(write_fd, nc->edges_incoming,
-							in_edges_size, 2);
-			if (wsize == -1) {
-				DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-				return OP_ERROR;
-			}
-			DPRINTF(4, "%s(): Wrote node's %d %d incoming edges of size %d bytes ", __func__, nc->node_index, nc->n_edges_incoming, wsize);
-		}
-
-		if (nc->n_edges_outgoing) {
-			/* Transmit a node's outgoing connections. */
-			wsize = do_write(write_fd, nc->edges_outgoing,
-							out_edges_size, 2);
-			if (wsize == -1) {
-				DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-				return OP_ERROR;
-			}
-			DPRINTF(4, "%s(): Wrote node's %d %d outgoing edges of size %d bytes ", __func__, nc->node_index, nc->n_edges_outgoing, wsize);
+	/* Transmit the incoming and outgoing connections of all nodes. */
+	if (edges_size > 0) {
+		wsize = do_write(write_fd, chosen_mb->solution_edges,
+							edges_size, 2);
+		if (wsize == -1) {
+			DPRINTF(4, "ERROR: write failed: errno: %d", errno);
+			return OP_ERROR;
 		}
+		DPRINTF(4, "%s(): Wrote %d solution edges of size %d bytes ",
+				__func__, chosen_mb->n_solution_edges, wsize);
 	}
 	return OP_SUCCESS;
 }
@@ -1648,9 +2573,11 @@ write_message_block(int write_fd)
 	int nodes_size = chosen_mb->n_nodes * sizeof(struct dgsh_node);
 	int edges_size = chosen_mb->n_edges * sizeof(struct dgsh_edge);
 	struct dgsh_node *p_nodes = chosen_mb->node_array;
+	long long start = trace_now();
 
 	DPRINTF(3, "%s(): %s (%d)", __func__, programname, self_node.index);
 
+	io_bytes = 0;
 	if (chosen_mb->state == PS_ERROR && errno == 0)
 		errno = EPROTO;
 
@@ -1705,6 +2632,7 @@ write_message_block(int write_fd)
 	}
 
 	DPRINTF(4, "%s(): Shipped message block or solution to next node in graph from file descriptor: %d.\n", __func__, write_fd);
+	trace_event("write", start, io_bytes, state_name(chosen_mb->state));
 	return OP_SUCCESS;
 }
 
@@ -2078,6 +3006,8 @@ alloc_copy_mb(struct dgsh_negotiation **mb, char *buf, int bytes_read,
 	(*mb)->node_array = NULL;
 	(*mb)->edge_array = NULL;
 	(*mb)->graph_solution = NULL;
+	(*mb)->solution_edges = NULL;
+	(*mb)->n_solution_edges = 0;
 	return OP_SUCCESS;
 }
 
@@ -2160,6 +3090,7 @@ read_chunk(int read_fd, char *buf, int buf_size, int *bytes_read,
 	} else  /* Read succeeded. */
 		DPRINTF(4, "Read succeeded: %d bytes read from %d.\n",
 		*bytes_read, read_fd);
+	io_bytes += *bytes_read;
 	return OP_SUCCESS;
 }
 
@@ -2280,31 +3211,119 @@ get_provided_fds_n(struct dgsh_negotiation *mb, pid_t pid)
 }
 
 /*
- * Write the file descriptor fd_to_write to
+ * Write the n_fds file descriptors in fds_to_write to
  * the socket file descriptor output_socket.
+ * The descriptors are batched into as few control messages as the
+ * kernel allows.
  */
 void
-write_fd(int output_socket, int fd_to_write)
+write_fds(int output_socket, int *fds_to_write, int n_fds)
 {
 	struct msghdr    msg;
 	struct cmsghdr  *cmsg;
-	unsigned char    buf[CMSG_SPACE(sizeof(int))];
+	union {
+		struct cmsghdr h;
+		unsigned char buf[CMSG_SPACE(sizeof(int) * DGSH_MAX_MSG_FDS)];
+	} control;
 	struct iovec io = { .iov_base = " ", .iov_len = 1 };
+	int n;
+	int total = n_fds;
+	long long start = trace_now();
+
+	for (; n_fds > 0; n_fds -= n, fds_to_write += n) {
+		n = n_fds > DGSH_MAX_MSG_FDS ? DGSH_MAX_MSG_FDS : n_fds;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &io;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), fds_to_write, sizeof(int) * n);
+
+		if (sendmsg(output_socket, &msg, 0) == -1)
+			err(1, "sendmsg on fd %d", output_socket);
+		DPRINTF(4, "%s(): sent %d fds on fd %d", __func__, n,
+				output_socket);
+	}
+	if (total > 0)
+		trace_event("send fds", start, total,
+				chosen_mb ? state_name(chosen_mb->state) : "");
+}
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = &io;
-	msg.msg_iovlen = 1;
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
+/*
+ * Write the file descriptor fd_to_write to
+ * the socket file descriptor output_socket.
+ */
+void
+write_fd(int output_socket, int fd_to_write)
+{
+	write_fds(output_socket, &fd_to_write, 1);
+}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	*(int *)CMSG_DATA(cmsg) = fd_to_write;
+/*
+ * Read n_fds file descriptors from socket input_socket into fds.
+ * The descriptors may arrive batched in one or more control messages.
+ */
+void
+read_fds(int input_socket, int *fds, int n_fds)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr h;
+		unsigned char buf[CMSG_SPACE(sizeof(int) * DGSH_MAX_MSG_FDS)];
+	} control;
+	char m_buffer[1];
+	struct iovec io = { .iov_base = m_buffer, .iov_len = sizeof(m_buffer) };
+	int n_read = 0;
+	long long start = trace_now();
+
+	while (n_read < n_fds) {
+		int n_msg = 0;
 
-	if (sendmsg(output_socket, &msg, 0) == -1)
-		err(1, "sendmsg on fd %d", output_socket);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		msg.msg_iov = &io;
+		msg.msg_iovlen = 1;
+
+		if (recvmsg(input_socket, &msg, 0) == -1) {
+			if (errno == EAGAIN) {
+				sleep(1);
+				continue;
+			}
+			err(1, "recvmsg on fd %d", input_socket);
+		}
+		if ((msg.msg_flags & MSG_TRUNC) || (msg.msg_flags & MSG_CTRUNC))
+			errx(1, "control message truncated on fd %d", input_socket);
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			n_msg = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (n_read + n_msg > n_fds)
+				errx(1, "received %d file descriptors, expected %d, on fd %d",
+						n_read + n_msg, n_fds,
+						input_socket);
+			memcpy(fds + n_read, CMSG_DATA(cmsg),
+					sizeof(int) * n_msg);
+			n_read += n_msg;
+		}
+		if (n_msg == 0)
+			errx(1, "unable to read file descriptor from fd %d",
+					input_socket);
+		DPRINTF(4, "%s(): received %d fds on fd %d", __func__, n_msg,
+				input_socket);
+	}
+	if (n_fds > 0)
+		trace_event("receive fds", start, n_fds,
+				chosen_mb ? state_name(chosen_mb->state) : "");
 }
 
 /*
@@ -2312,37 +3331,195 @@ write_fd(int output_socket, int fd_to_write)
  */
 int
 read_fd(int input_socket)
+{
+	int fd;
+
+	read_fds(input_socket, &fd, 1);
+	return fd;
+}
+
+/*
+ * Set in addr the address of the control socket at path.
+ * Return false if the path does not fit.
+ */
+static bool
+control_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/*
+ * Create at path a control socket through which a running program
+ * can be attached channels after the negotiation, and return its
+ * non-blocking file descriptor, or -1 on error.
+ * The descriptor becomes readable when a request to attach channels
+ * arrives; see dgsh_control_accept().
+ */
+int
+dgsh_control_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!control_address(path, &addr))
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(fd, 5) == -1 ||
+			fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		close(fd);
+		return -1;
+	}
+	DPRINTF(2, "%s(): listening on %s", __func__, path);
+	return fd;
+}
+
+/*
+ * Accept a connection arriving on control_fd, through which another
+ * process requests to attach channels.
+ * Return the connection's non-blocking descriptor, which becomes
+ * readable when the request arrives (see dgsh_control_receive()),
+ * or -1 if no connection could be accepted.
+ */
+int
+dgsh_control_accept(int control_fd)
+{
+	int sock;
+
+	if ((sock = accept(control_fd, NULL, NULL)) == -1)
+		return -1;
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Receive the request to attach channels arriving on the connection
+ * sock obtained through dgsh_control_accept(), and close the connection.
+ * Return the number of channels attached and set fds to point to an
+ * allocated sequence of their descriptors.
+ * Return -1 with errno set to EAGAIN, keeping the connection open,
+ * if the request has not yet arrived.
+ * Return -1 with errno set to EBADMSG if no valid request could be read;
+ * a misbehaving client cannot affect the running program.
+ */
+int
+dgsh_control_receive(int sock, int **fds)
 {
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
-	unsigned char buf[CMSG_SPACE(sizeof(int))];
-	char m_buffer[2];
-	struct iovec io = { .iov_base = m_buffer, .iov_len = sizeof(m_buffer) };
+	union {
+		struct cmsghdr h;
+		unsigned char buf[CMSG_SPACE(sizeof(int) * DGSH_MAX_MSG_FDS)];
+	} control;
+	int n_fds = 0, n_received = 0;
+	struct iovec io = { .iov_base = &n_fds, .iov_len = sizeof(n_fds) };
+	ssize_t n;
 
 	memset(&msg, 0, sizeof(msg));
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
 	msg.msg_iov = &io;
 	msg.msg_iovlen = 1;
-
-again:
-	if (recvmsg(input_socket, &msg, 0) == -1) {
-		if (errno == EAGAIN) {
-			sleep(1);
-			goto again;
-		}
-		err(1, "recvmsg on fd %d", input_socket);
+	n = recvmsg(sock, &msg, 0);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		errno = EAGAIN;
+		return -1;
 	}
-	if ((msg.msg_flags & MSG_TRUNC) || (msg.msg_flags & MSG_CTRUNC))
-		errx(1, "control message truncated on fd %d", input_socket);
+	close(sock);
+	if (n == -1)
+		return -1;
+
+	*fds = NULL;
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
 	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if (cmsg->cmsg_len == CMSG_LEN(sizeof(int)) &&
-		    cmsg->cmsg_level == SOL_SOCKET &&
-		    cmsg->cmsg_type == SCM_RIGHTS)
-			return *(int *)CMSG_DATA(cmsg);
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n_received > 0 &&
+				(*fds = malloc(sizeof(int) * n_received)) != NULL)
+			memcpy(*fds, CMSG_DATA(cmsg), sizeof(int) * n_received);
+		break;
+	}
+	if (n != sizeof(n_fds) || n_fds != n_received || *fds == NULL ||
+			(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		DPRINTF(1, "%s(): ignoring invalid request to attach %d channels",
+				__func__, n_fds);
+		if (*fds != NULL) {
+			int i;
+
+			for (i = 0; i < n_received; i++)
+				close((*fds)[i]);
+			free(*fds);
+			*fds = NULL;
+		}
+		errno = EBADMSG;
+		return -1;
 	}
-	errx(1, "unable to read file descriptor from fd %d", input_socket);
+	DPRINTF(2, "%s(): attached %d channels", __func__, n_fds);
+	return n_fds;
+}
+
+/*
+ * Attach the n_fds channels whose descriptors are in fds
+ * to the running program listening on the control socket at path.
+ * Return 0 on success, -1 on error.
+ */
+int
+dgsh_control_attach(const char *path, int n_fds, int *fds)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr h;
+		unsigned char buf[CMSG_SPACE(sizeof(int) * DGSH_MAX_MSG_FDS)];
+	} control;
+	struct iovec io = { .iov_base = &n_fds, .iov_len = sizeof(n_fds) };
+	int sock;
+
+	if (n_fds <= 0 || n_fds > DGSH_MAX_MSG_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!control_address(path, &addr))
+		return -1;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &io;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+
+	if (sendmsg(sock, &msg, 0) != sizeof(n_fds)) {
+		close(sock);
+		return -1;
+	}
+	close(sock);
+	return 0;
 }
 
 /* Read file descriptors piping input from another tool in the dgsh graph. */
@@ -2360,32 +3537,24 @@ read_input_fds(int input_socket, int *input_fds)
 	assert(this_nc->node_index == self_node.index);
 	int i;
 	int total_edge_instances = 0;
-	enum op_result re = OP_SUCCESS;
 
 	DPRINTF(4, "%s(): %d incoming edges to inspect of node %d.", __func__,
 			this_nc->n_edges_incoming, self_node.index);
-	for (i = 0; i < this_nc->n_edges_incoming; i++) {
-		int k;
-		/**
-		 * Due to channel constraint flexibility,
-		 * each edge can have more than one instances.
-		 */
-		for (k = 0; k < this_nc->edges_incoming[i].instances; k++) {
-			input_fds[total_edge_instances] = read_fd(input_socket);
-			DPRINTF(4, "%s: Node %d received file descriptor %d.",
-					__func__, this_nc->node_index,
-					input_fds[total_edge_instances]);
-			total_edge_instances++;
-		}
-		/* XXX */
-		if (re == OP_ERROR)
-			break;
-	}
-	if (re == OP_ERROR) {
-		free_graph_solution(chosen_mb->n_nodes - 1);
-		free(input_fds);
+	/**
+	 * Due to channel constraint flexibility,
+	 * each edge can have more than one instances.
+	 */
+	for (i = 0; i < this_nc->n_edges_incoming; i++)
+		total_edge_instances += this_nc->edges_incoming[i].instances;
+
+	read_fds(input_socket, input_fds, total_edge_instances);
+	for (i = 0; i < total_edge_instances; i++) {
+		DPRINTF(4, "%s: Node %d received file descriptor %d.",
+				__func__, this_nc->node_index, input_fds[i]);
+		if (self_node.shm_channels)
+			shm_channel_attach(input_fds[i]);
 	}
-	return re;
+	return OP_SUCCESS;
 }
 
 static enum op_result
@@ -2426,11 +3595,11 @@ read_concs(int read_fd, struct dgsh_negotiation *fresh_mb)
 static enum op_result
 read_graph_solution(int read_fd, struct dgsh_negotiation *fresh_mb)
 {
-	int i;
 	int bytes_read = 0;
 	int n_nodes = fresh_mb->n_nodes;
 	size_t buf_size = sizeof(struct dgsh_node_connections) * n_nodes;
 	char *buf = (char *)malloc(buf_size);
+	int edges_size;
 	enum op_result error_code = OP_SUCCESS;
 
 	/* Read node connection structures of the solution. */
@@ -2442,49 +3611,22 @@ read_graph_solution(int read_fd, struct dgsh_negotiation *fresh_mb)
 		return error_code;
 	free(buf);
 
-	struct dgsh_node_connections *graph_solution =
-					fresh_mb->graph_solution;
-	for (i = 0; i < n_nodes; i++) {
-		struct dgsh_node_connections *nc = &graph_solution[i];
-		DPRINTF(4, "Node %d with %d incoming edges at %lx and %d outgoing edges at %lx.", nc->node_index, nc->n_edges_incoming, (long)nc->edges_incoming, nc->n_edges_outgoing, (long)nc->edges_outgoing);
-		int in_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_incoming;
-		int out_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_outgoing;
-
-		/* Read a node's incoming connections. */
-		if (nc->n_edges_incoming > 0) {
-			buf = (char *)malloc(in_edges_size);
-			if ((error_code = read_chunk(read_fd, buf, in_edges_size,
-				&bytes_read, 2)) != OP_SUCCESS)
-				return error_code;
-			if (in_edges_size != bytes_read) {
-				DPRINTF(4, "%s(): ERROR: Expected %d bytes, got %d.", __func__,
-						in_edges_size, bytes_read);
-				return OP_ERROR;
-			}
-			if (alloc_node_connections(&nc->edges_incoming,
-				nc->n_edges_incoming, 0, i) == OP_ERROR)
-				return OP_ERROR;
-			memcpy(nc->edges_incoming, buf, in_edges_size);
-			free(buf);
-		}
+	/* Point the nodes' connections into the block of their edges. */
+	if (alloc_solution_edges(fresh_mb) == OP_ERROR)
+		return OP_ERROR;
+	edges_size = sizeof(struct dgsh_edge) * fresh_mb->n_solution_edges;
+	DPRINTF(4, "%s(): Reading %d solution edges.", __func__,
+			fresh_mb->n_solution_edges);
+	if (edges_size == 0)
+		return OP_SUCCESS;
 
-		/* Read a node's outgoing connections. */
-		if (nc->n_edges_outgoing) {
-			buf = (char *)malloc(out_edges_size);
-			if ((error_code = read_chunk(read_fd, buf, out_edges_size,
-				&bytes_read, 2)) != OP_SUCCESS)
-				return error_code;
-			if (out_edges_size != bytes_read) {
-				DPRINTF(4, "%s(): ERROR: Expected %d bytes, got %d.", __func__,
-						out_edges_size, bytes_read);
-				return OP_ERROR;
-			}
-			if (alloc_node_connections(&nc->edges_outgoing,
-				nc->n_edges_outgoing, 1, i) == OP_ERROR)
-				return OP_ERROR;
-			memcpy(nc->edges_outgoing, buf, out_edges_size);
-			free(buf);
-		}
+	if ((error_code = read_chunk(read_fd, (char *)fresh_mb->solution_edges,
+			edges_size, &bytes_read, 2)) != OP_SUCCESS)
+		return error_code;
+	if (edges_size != bytes_read) {
+		DPRINTF(4, "%s(): ERROR: Expected %d bytes, got %d.", __func__,
+				edges_size, bytes_read);
+		return OP_ERROR;
 	}
 	return OP_SUCCESS;
 }
@@ -2507,9 +3649,11 @@ read_message_block(int read_fd, struct dgsh_negotiation **fresh_mb)
 	char *buf = (char *)malloc(buf_size);
 	int bytes_read = 0;
 	enum op_result error_code = 0;
+	long long start = trace_now();
 
 	DPRINTF(3, "%s(): %s (%d)", __func__, programname, self_node.index);
 
+	io_bytes = 0;
 	memset(buf, 0, buf_size);
 
 	/* Try read core message block: struct negotiation state fields. */
@@ -2560,6 +3704,7 @@ read_message_block(int read_fd, struct dgsh_negotiation **fresh_mb)
 			return OP_ERROR;
 	}
 	DPRINTF(4, "%s(): Read message block or solution from node %d sent from file descriptor: %s.\n", __func__, (*fresh_mb)->origin_index, ((*fresh_mb)->origin_fd_direction) ? "stdout" : "stdin");
+	trace_event("read", start, io_bytes, state_name((*fresh_mb)->state));
 	return OP_SUCCESS;
 }
 
@@ -2587,6 +3732,8 @@ construct_message_block(const char *tool_name, pid_t self_pid)
 	chosen_mb->is_origin_conc = false;
 	chosen_mb->conc_pid = -1;
 	chosen_mb->graph_solution = NULL;
+	chosen_mb->solution_edges = NULL;
+	chosen_mb->n_solution_edges = 0;
 	chosen_mb->conc_array = NULL;
 	chosen_mb->n_concs = 0;
 	DPRINTF(3, "Message block created by process %s with pid %d.\n",
@@ -2624,6 +3771,52 @@ get_environment_vars()
 	get_env_var("DGSH_OUT", &self_node.dgsh_out);
 }
 
+/**
+ * Set up the message block and this tool's node from the graph stored
+ * at an earlier run in the file named by DGSH_GRAPH for the graph
+ * identified by DGSH_GRAPH_ID.
+ * Return OP_SUCCESS if the tool can then exchange its file descriptors
+ * without negotiating, OP_NOOP if there is no such graph, so that all
+ * of the graph's processes negotiate, and OP_ERROR if the tool's entry
+ * at its position does not match its name and I/O requirements.
+ */
+static enum op_result
+graph_file_negotiate(const char *tool_name, pid_t self_pid, int *n_input_fds,
+		int *n_output_fds)
+{
+	char *path = getenv("DGSH_GRAPH");
+	char *id = getenv("DGSH_GRAPH_ID");
+	struct dgsh_negotiation *mb;
+	struct dgsh_node *n = NULL;
+	int i;
+
+	if (path == NULL || id == NULL || self_node.position < 0 ||
+			graph_file_load(path, id, &mb) == OP_ERROR)
+		return OP_NOOP;
+
+	fill_node(tool_name, self_pid, n_input_fds, n_output_fds);
+	for (i = 0; i < mb->n_nodes; i++)
+		if (mb->node_array[i].position == self_node.position) {
+			n = &mb->node_array[i];
+			break;
+		}
+	chosen_mb = mb;
+	if (n == NULL || strcmp(n->name, self_node.name) != 0 ||
+			n->requires_channels != self_node.requires_channels ||
+			n->provides_channels != self_node.provides_channels ||
+			n->dgsh_in != self_node.dgsh_in ||
+			n->dgsh_out != self_node.dgsh_out ||
+			n->shm_channels != self_node.shm_channels) {
+		free_mb(mb);
+		chosen_mb = NULL;
+		graph_file_mismatch(path, self_node.position);
+		return OP_ERROR;
+	}
+	self_node.index = n->index;
+	DPRINTF(1, "%s(): using the graph stored in %s", __func__, path);
+	return OP_SUCCESS;
+}
+
 /**
  * Verify tool's I/O channel requirements are sane.
  * We might need some upper barrier for requirements too,
@@ -2647,48 +3840,46 @@ validate_input(int *channels_required, int *channels_provided, const char *tool_
 	return OP_SUCCESS;
 }
 
+/*
+ * Set in fds the poll(2) entries for the next read or write
+ * operation and return their number.
+ */
 static int
-set_fds(fd_set *read_fds, fd_set *write_fds, bool isread)
+set_fds(struct pollfd *fds, bool isread)
 {
-	fd_set *fds;
-	FD_ZERO(read_fds);
-	FD_ZERO(write_fds);
+	short events = isread ? POLLIN : POLLOUT;
+	int nfds = 0;
 
 	DPRINTF(4, "Next operation is a %s", isread ? "read" : "write");
-	/* The next operation is a read or a write */
-	if (isread)
-		fds = read_fds;
-	else
-		fds = write_fds;
 
 	if (self_node.dgsh_out && !self_node.dgsh_in) {
 		self_node_io_side.fd_direction = STDOUT_FILENO;
-		FD_SET(STDOUT_FILENO, fds);
+		fds[nfds++].fd = STDOUT_FILENO;
 	} else if (!self_node.dgsh_out && self_node.dgsh_in) {
 		self_node_io_side.fd_direction = STDIN_FILENO;
-		FD_SET(STDIN_FILENO, fds);
+		fds[nfds++].fd = STDIN_FILENO;
 	} else {
 		/* We should have all ears open for a read */
 		if (isread) {
-			FD_SET(STDIN_FILENO, fds);
-			FD_SET(STDOUT_FILENO, fds);
+			fds[nfds++].fd = STDIN_FILENO;
+			fds[nfds++].fd = STDOUT_FILENO;
 		} else {
 			/* But for writing we should pass the message across.
 			 * If mb came from stdout channel, we got it from stdin.
 			 * So we should send it from stdout */
 			if (chosen_mb->origin_fd_direction == STDOUT_FILENO) {
-				FD_SET(STDOUT_FILENO, fds);
+				fds[nfds++].fd = STDOUT_FILENO;
 				self_node_io_side.fd_direction = STDOUT_FILENO;
 				DPRINTF(4, "STDOUT set for write");
 			} else {
-				FD_SET(STDIN_FILENO, fds);
+				fds[nfds++].fd = STDIN_FILENO;
 				self_node_io_side.fd_direction = STDIN_FILENO;
 				DPRINTF(4, "STDIN set for write");
 			}
 		}
 	}
-	/* so that after select() we try both 0 and 1 to see if they are set */
-	return 2;
+	fds[0].events = fds[1].events = events;
+	return nfds;
 }
 
 void
@@ -2697,6 +3888,12 @@ set_negotiation_complete()
 	negotiation_completed = 1;
 }
 
+void
+set_negotiation_started()
+{
+	negotiation_started = 1;
+}
+
 static int
 setup_file_descriptors(int *n_input_fds, int *n_output_fds,
 		int **input_fds, int **output_fds)
@@ -2763,6 +3960,8 @@ state_name(enum prot_state s)
 		return "RUN";
 	case PS_ERROR:
 		return "ERROR";
+	case PS_DRAW_EXIT:
+		return "DRAW_EXIT";
 	default:
 		assert(0);
 	}
@@ -2790,16 +3989,18 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 	pid_t self_pid = getpid();    /* Get tool's pid */
 	struct dgsh_negotiation *fresh_mb = NULL; /* MB just read. */
 
-	int nfds = 0, n_io_sides;
+	int nfds = 0, nready, n_io_sides;
 	bool isread = false;
-	fd_set read_fds, write_fds;
+	struct pollfd fds[2];
 	char *timeout;
 	char *debug_level;
+	long long start = trace_now();
 
 	if (negotiation_completed) {
 		errno = EALREADY;
 		return dgsh_exit(-1, flags);
 	}
+	negotiation_started = 1;
 
 	/* Get and set user-provided debug level.
 	 * dgsh_debug_level is defined in debug.h.
@@ -2826,6 +4027,9 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 
 	self_node.dgsh_in = 0;
 	self_node.dgsh_out = 0;
+	self_node.shm_channels = (flags & DGSH_SHM_CHANNELS) &&
+		shm_channels_supported();
+	self_node.position = graph_position();
 	get_environment_vars();
 	n_io_sides = self_node.dgsh_in + self_node.dgsh_out;
 
@@ -2844,6 +4048,19 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 					n_output_fds, input_fds, output_fds), flags);
 	}
 
+	/* A graph solved at an earlier run; no need to negotiate */
+	switch (graph_file_negotiate(tool_name, self_pid, n_input_fds,
+				n_output_fds)) {
+	case OP_SUCCESS:
+		isread = false;
+		goto exit;
+	case OP_ERROR:
+		negotiation_completed = 1;
+		return dgsh_exit(-1, flags);
+	default:
+		break;
+	}
+
 	signal(SIGALRM, dgsh_alarm_handler);
 	if ((timeout = getenv("DGSH_TIMEOUT")) != NULL)
 		alarm(atoi(timeout));
@@ -2870,20 +4087,33 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 	while (1) {
 again:
 		DPRINTF(4, "%s(): perform round", __func__);
-		nfds = set_fds(&read_fds, &write_fds, isread);
-		if (select(nfds, &read_fds, &write_fds, NULL, NULL) < 0) {
+		nfds = set_fds(fds, isread);
+		if ((nready = poll(fds, nfds, -1)) < 0) {
 			if (errno == EINTR)
 				goto again;
-			perror("select");
+			perror("poll");
 			chosen_mb->state = PS_ERROR;
+			/* Proceed with the operation to communicate the error */
+			for (i = 0; i < nfds; i++)
+				fds[i].revents = fds[i].events;
+			nready = nfds;
 		}
 
-		for (i = 0; i < nfds; i++) {
-			if (FD_ISSET(i, &write_fds)) {
-				DPRINTF(4, "write on fd %d is active.", i);
+		for (i = 0; nready > 0 && i < nfds; i++) {
+			int fd = fds[i].fd;
+			short ready = fds[i].revents;
+
+			if (ready == 0)
+				continue;
+			nready--;
+			/* Like select(2), let the failing operation report */
+			if (ready & (POLLERR | POLLHUP | POLLNVAL))
+				ready |= fds[i].events;
+			if (ready & POLLOUT) {
+				DPRINTF(4, "write on fd %d is active.", fd);
 				/* Write message block et al. */
 				set_dispatcher();
-				if (write_message_block(i) == OP_ERROR)
+				if (write_message_block(fd) == OP_ERROR)
 					chosen_mb->state = PS_ERROR;
 				if (n_io_sides == ntimes_seen_run ||
 				    n_io_sides == ntimes_seen_error ||
@@ -2894,10 +4124,10 @@ again:
 				}
 				isread = true;
 			}
-			if (FD_ISSET(i, &read_fds)) {
-				DPRINTF(4, "read on fd %d is active.", i);
+			if (ready & POLLIN) {
+				DPRINTF(4, "read on fd %d is active.", fd);
 				/* Read message block et al. */
-				if (read_message_block(i, &fresh_mb)
+				if (read_message_block(fd, &fresh_mb)
 						== OP_ERROR &&
 						fresh_mb != NULL)
 					fresh_mb->state = PS_ERROR;
@@ -2979,6 +4209,8 @@ exit:
 			*n_output_fds = 0;
 	}
 	int state = chosen_mb->state;
+	trace_event("negotiate", start, 0, state_name(state));
+	trace_write(tool_name);
 #ifdef TIME
 	if (self_node.pid == chosen_mb->initiator_pid) {
 		clock_gettime(CLOCK_MONOTONIC, &tend);
@@ -2994,3 +4226,21 @@ exit:
 	signal(SIGALRM, SIG_IGN);	// Do not handle the signal
 	return dgsh_exit(state, flags);
 }
+
+/**
+ * Negotiate like dgsh_negotiate(), additionally passing hints regarding
+ * the data carried by the tool's input and output channels.
+ * The hints are used to size the pipes connecting the tool.
+ * Either hint pointer can be NULL.
+ */
+int
+dgsh_negotiate_hints(int flags, const char *tool_name, int *n_input_fds,
+		int *n_output_fds, int **input_fds, int **output_fds,
+		const struct dgsh_channel_hints *input_hints,
+		const struct dgsh_channel_hints *output_hints)
+{
+	self_node.input_pipe_size = hinted_pipe_size(input_hints);
+	self_node.output_pipe_size = hinted_pipe_size(output_hints);
+	return dgsh_negotiate(flags, tool_name, n_input_fds, n_output_fds,
+			input_fds, output_fds);
+}
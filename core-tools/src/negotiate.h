@@ -42,6 +42,12 @@ union fdmsg {
 	char buf[CMSG_SPACE(sizeof(int))];
 };
 
+/*
+ * Maximum number of file descriptors passed in a single control message.
+ * This is Linux's SCM_MAX_FD, which is not exported to user space.
+ */
+#define DGSH_MAX_MSG_FDS 253
+
 /*
  * Results of operations
  * Also negative values signify a failed operation's errno value
@@ -88,6 +94,8 @@ extern int nfd;
 extern int next_fd(int fd, bool *ro);
 extern int read_fd(int input_socket);
 extern void write_fd(int output_socket, int fd_to_write);
+extern void read_fds(int input_socket, int *fds, int n_fds);
+extern void write_fds(int output_socket, int *fds_to_write, int n_fds);
 #else
 
 #define STATIC static
@@ -114,6 +122,7 @@ struct dgsh_conc {
 	int *proc_pids;		/* pids at the multipipe end */
 	int endpoint_pid;	/* pid at the other end */
 	bool multiple_inputs;	/* true for input conc */
+	int position;		/* Position in the shell's graph */
 };
 
 /* The message block structure that provides the vehicle for negotiation. */
@@ -150,6 +159,13 @@ struct dgsh_negotiation {
 						       * I/O constraint problem
 						       * at hand.
 						       */
+	struct dgsh_edge *solution_edges; /* The edges of the solution's
+					   * node connections, in one block:
+					   * the incoming edges of all nodes
+					   * in node order, followed by their
+					   * outgoing edges. NULL while solving.
+					   */
+	int n_solution_edges;		/* Number of solution edges */
 	struct dgsh_conc *conc_array;	/* Array of concentrators facilitating
 					 * the negotiation. The need for this
 					 * array emerged in cases where a conc
@@ -175,8 +191,27 @@ enum op_result write_message_block(int write_fd);
 void free_mb(struct dgsh_negotiation *mb);
 int read_fd(int input_socket);
 void write_fd(int output_socket, int fd_to_write);
+void read_fds(int input_socket, int *fds, int n_fds);
+void write_fds(int output_socket, int *fds_to_write, int n_fds);
+const char *state_name(enum prot_state s);
+/* Negotiation tracing */
+long long trace_now(void);
+void trace_event(const char *name, long long start, int size,
+		const char *state);
+void trace_write(const char *tool_name);
+/* Graphs solved at an earlier run */
+int graph_position(void);
+enum op_result graph_file_load(const char *path, const char *id,
+		struct dgsh_negotiation **mb);
+void graph_file_mismatch(const char *path, int position);
+/* Shared-memory channels */
+bool shm_channels_supported(void);
+int shm_channel_create(int size, int *reader_fd);
+bool shm_channel_attach(int fd);
+void shm_channel_move(int old_fd, int new_fd);
 /* Alarm mechanism and on_exit handling */
 void set_negotiation_complete();
+void set_negotiation_started();
 void dgsh_alarm_handler(int);
 
 #endif /* NEGOTIATE_H */
@@ -0,0 +1,419 @@
+/*
+ * Copyright 2026 Diomidis Spinellis
+ *
+ * Shared-memory channels between dgsh-aware tools.
+ * A channel is a single-producer single-consumer ring buffer stored
+ * in a memfd that both ends map.  The ends also share a Unix-domain
+ * socket pair, which carries the memfd at setup time and then serves
+ * as a doorbell: a byte is sent only when the peer has declared
+ * that it is waiting for data or for space.  This keeps the channel
+ * ends pollable with select(2) and lets each end detect the other's
+ * exit, as with a pipe.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* memfd_create() */
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>		/* mmap(), memfd_create() */
+#include <sys/socket.h>		/* socketpair(), send(), recv() */
+#include <sys/stat.h>		/* fstat() */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>		/* fcntl(), O_NONBLOCK */
+#include <poll.h>		/* poll() */
+#include <signal.h>		/* raise(), SIGPIPE */
+#include <stdbool.h>
+#include <stdint.h>		/* uint32_t, uint64_t */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dgsh.h"
+#include "negotiate.h"		/* read_fd(), write_fd() */
+#include "dgsh-debug.h"		/* DPRINTF() */
+
+/* Identifies a mapped channel */
+#define SHM_CHANNEL_MAGIC 0x64677368
+
+/* Data capacity of channels whose ends expressed no preference */
+#define SHM_CHANNEL_SIZE (1024 * 1024)
+
+/* The channel's memory layout */
+struct shm_ring {
+	uint32_t magic;
+	uint32_t size;			/* Data capacity; a power of two */
+	uint64_t head;			/* Bytes written; set by the producer */
+	uint64_t tail;			/* Bytes read; set by the consumer */
+	uint32_t reader_waiting;	/* Consumer waits for data */
+	uint32_t writer_waiting;	/* Producer waits for space */
+	uint32_t reader_closed;		/* Consumer has gone away */
+	char data[];
+};
+
+/* A channel end in this process */
+struct shm_channel {
+	struct shm_ring *ring;
+	size_t map_size;
+	bool is_writer;
+	bool peer_gone;			/* Peer's socket end is closed */
+};
+
+/* Channel ends indexed by their (socket) file descriptor */
+static struct shm_channel **channels;
+static int n_channels;
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Return true if shared-memory channels can be used */
+bool
+shm_channels_supported(void)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	char *env = getenv("DGSH_SHM");
+
+	return env == NULL || strcmp(env, "0") != 0;
+#else
+	return false;
+#endif
+}
+
+/* Return the channel end associated with fd, or NULL */
+static struct shm_channel *
+lookup(int fd)
+{
+	if (fd < 0 || fd >= n_channels)
+		return NULL;
+	return channels[fd];
+}
+
+/* Associate the channel end c with fd */
+static void
+enter(int fd, struct shm_channel *c)
+{
+	if (fd >= n_channels) {
+		int n = fd + 16;
+		struct shm_channel **p = realloc(channels, n * sizeof(*p));
+
+		if (p == NULL)
+			err(1, "Unable to allocate channel table");
+		memset(p + n_channels, 0, (n - n_channels) * sizeof(*p));
+		channels = p;
+		n_channels = n;
+	}
+	channels[fd] = c;
+}
+
+/* Map the ring stored in memfd; return NULL on failure */
+static struct shm_channel *
+map_ring(int memfd, bool is_writer)
+{
+	struct stat sb;
+	struct shm_channel *c;
+	void *p;
+
+	if (fstat(memfd, &sb) == -1 ||
+			(size_t)sb.st_size < sizeof(struct shm_ring))
+		return NULL;
+	p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			memfd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		munmap(p, sb.st_size);
+		return NULL;
+	}
+	c->ring = p;
+	c->map_size = sb.st_size;
+	c->is_writer = is_writer;
+	return c;
+}
+
+/*
+ * Create a channel with a data capacity of at least size bytes
+ * (0 for the default).
+ * Return the producer's file descriptor and set in reader_fd the
+ * descriptor to pass to the consumer, or return -1 on failure.
+ */
+int
+shm_channel_create(int size, int *reader_fd)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	int sv[2];
+	int memfd;
+	uint32_t capacity = 4096;
+	struct shm_channel *c;
+
+	if (size <= 0)
+		size = SHM_CHANNEL_SIZE;
+	while (capacity < (uint32_t)size)
+		capacity <<= 1;
+
+	if ((memfd = memfd_create("dgsh-channel", MFD_CLOEXEC)) == -1)
+		return -1;
+	if (ftruncate(memfd, sizeof(struct shm_ring) + capacity) == -1 ||
+			(c = map_ring(memfd, true)) == NULL) {
+		close(memfd);
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		munmap(c->ring, c->map_size);
+		free(c);
+		close(memfd);
+		return -1;
+	}
+	c->ring->size = capacity;
+	STORE(&c->ring->magic, SHM_CHANNEL_MAGIC);
+
+	/* Queue the memory for the consumer to pick up on attach */
+	write_fd(sv[0], memfd);
+	close(memfd);
+
+	enter(sv[0], c);
+	*reader_fd = sv[1];
+	DPRINTF(4, "%s(): channel %d -> %d of %u bytes", __func__,
+			sv[0], sv[1], capacity);
+	return sv[0];
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * If fd, received through the negotiation, is the consumer end of
+ * a channel, map the channel's memory and associate it with fd.
+ * Return true if fd is a channel.
+ */
+bool
+shm_channel_attach(int fd)
+{
+	struct stat sb;
+	struct shm_channel *c;
+	int memfd;
+
+	if (fstat(fd, &sb) == -1 || !S_ISSOCK(sb.st_mode))
+		return false;
+	memfd = read_fd(fd);
+	c = map_ring(memfd, false);
+	close(memfd);
+	if (c == NULL || LOAD(&c->ring->magic) != SHM_CHANNEL_MAGIC)
+		errx(1, "Invalid shared-memory channel on fd %d", fd);
+	enter(fd, c);
+	DPRINTF(4, "%s(): attached channel on fd %d", __func__, fd);
+	return true;
+}
+
+/* Reassociate the channel on old_fd, which was duplicated, with new_fd */
+void
+shm_channel_move(int old_fd, int new_fd)
+{
+	struct shm_channel *c = lookup(old_fd);
+
+	if (c == NULL)
+		return;
+	channels[old_fd] = NULL;
+	enter(new_fd, c);
+}
+
+/* Notify the peer on the other end of fd */
+static void
+ring_doorbell(int fd)
+{
+	/* A full socket buffer already holds wakeups */
+	(void)send(fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* Consume pending notifications; note if the peer has gone away */
+static void
+drain_doorbell(int fd, struct shm_channel *c)
+{
+	char buf[64];
+	ssize_t n;
+
+	/* A short read means that no more notifications are pending */
+	while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) ==
+			(ssize_t)sizeof(buf))
+		;
+	if (n == 0)
+		c->peer_gone = true;
+}
+
+/* Return the number of bytes that can be read or written without waiting */
+static size_t
+available(struct shm_channel *c)
+{
+	struct shm_ring *r = c->ring;
+
+	if (c->is_writer)
+		return r->size - (r->head - LOAD(&r->tail));
+	else
+		return LOAD(&r->head) - r->tail;
+}
+
+/*
+ * Return true if an operation on the channel end c can proceed
+ * without waiting, be it for transferring data or for reporting
+ * an end of file or a closed reader.
+ * Otherwise declare that the end waits, so that the peer will
+ * make fd readable when it changes the ring's state.
+ */
+static bool
+ready(int fd, struct shm_channel *c)
+{
+	uint32_t *waiting = c->is_writer ? &c->ring->writer_waiting :
+		&c->ring->reader_waiting;
+
+	if (available(c) > 0 || c->peer_gone)
+		return true;
+	drain_doorbell(fd, c);
+	STORE(waiting, 1);
+	FENCE();
+	return available(c) > 0 || c->peer_gone ||
+		(c->is_writer && LOAD(&c->ring->reader_closed));
+}
+
+/* Wait until the ring's state changes, or return EAGAIN if fd doesn't block */
+static int
+wait_peer(int fd, struct shm_channel *c)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	struct pollfd pfd;
+
+	if (flags != -1 && (flags & O_NONBLOCK)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return -1;
+	drain_doorbell(fd, c);
+	return 0;
+}
+
+ssize_t
+dgsh_read(int fd, void *buf, size_t nbyte)
+{
+	struct shm_channel *c = lookup(fd);
+	struct shm_ring *r;
+	size_t n, offset, first;
+
+	if (c == NULL)
+		return read(fd, buf, nbyte);
+	r = c->ring;
+	if (nbyte == 0)
+		return 0;
+	while (!ready(fd, c))
+		if (wait_peer(fd, c) == -1)
+			return -1;
+	if ((n = available(c)) == 0)
+		return 0;	/* Producer has gone away */
+	if (n > nbyte)
+		n = nbyte;
+	offset = r->tail & (r->size - 1);
+	first = r->size - offset;
+	if (first >= n)
+		memcpy(buf, r->data + offset, n);
+	else {
+		memcpy(buf, r->data + offset, first);
+		memcpy((char *)buf + first, r->data, n - first);
+	}
+	STORE(&r->tail, r->tail + n);
+	FENCE();
+	if (EXCHANGE(&r->writer_waiting, 0))
+		ring_doorbell(fd);
+	return n;
+}
+
+ssize_t
+dgsh_write(int fd, const void *buf, size_t nbyte)
+{
+	struct shm_channel *c = lookup(fd);
+	struct shm_ring *r;
+	size_t written = 0;
+
+	if (c == NULL)
+		return write(fd, buf, nbyte);
+	r = c->ring;
+	while (written < nbyte) {
+		size_t n, offset, first;
+
+		if (!ready(fd, c)) {
+			if (wait_peer(fd, c) == -1)
+				return written > 0 ? (ssize_t)written : -1;
+			continue;
+		}
+		if (c->peer_gone || LOAD(&r->reader_closed)) {
+			if (written > 0)
+				break;
+			raise(SIGPIPE);
+			errno = EPIPE;
+			return -1;
+		}
+		if ((n = available(c)) == 0)
+			continue;
+		if (n > nbyte - written)
+			n = nbyte - written;
+		offset = r->head & (r->size - 1);
+		first = r->size - offset;
+		if (first >= n)
+			memcpy(r->data + offset, (const char *)buf + written, n);
+		else {
+			memcpy(r->data + offset, (const char *)buf + written,
+					first);
+			memcpy(r->data, (const char *)buf + written + first,
+					n - first);
+		}
+		STORE(&r->head, r->head + n);
+		FENCE();
+		if (EXCHANGE(&r->reader_waiting, 0))
+			ring_doorbell(fd);
+		written += n;
+	}
+	return written;
+}
+
+int
+dgsh_ready(int fd)
+{
+	struct shm_channel *c = lookup(fd);
+
+	if (c == NULL)
+		return -1;
+	return ready(fd, c);
+}
+
+int
+dgsh_close(int fd)
+{
+	struct shm_channel *c = lookup(fd);
+
+	if (c != NULL) {
+		if (!c->is_writer)
+			STORE(&c->ring->reader_closed, 1);
+		munmap(c->ring, c->map_size);
+		free(c);
+		channels[fd] = NULL;
+	}
+	return close(fd);
+}
@@ -103,6 +103,34 @@ TRY="`$DGSH_READVAL -l -s testsocket 2>client.err `"
 EXPECT='record1:'
 check
 
+testcase "Store started after its reader" # {{{3
+START=$(perl -MTime::HiRes=time -e 'printf("%d\n", time * 1000)')
+{ sleep 0.2 ; echo late record | $DGSH_WRITEVAL -s testsocket 2>server.err ; } &
+TRY="`$DGSH_READVAL -l -s testsocket 2>client.err `"
+END=$(perl -MTime::HiRes=time -e 'printf("%d\n", time * 1000)')
+EXPECT='late record'
+# The reader should connect soon after the store starts listening
+if [ $((END - START)) -gt 700 ]
+then
+	fail "Reading took $((END - START))ms"
+fi
+check
+
+testcase "Named value" # {{{3
+echo named record | $DGSH_WRITEVAL -k name -s testsocket 2>server.err &
+sleep 1
+TRY="`$DGSH_READVAL -l -k name -s testsocket 2>client.err `"
+# Values the store lacks cannot be read
+if $DGSH_READVAL -l -k other -s testsocket 2>/dev/null
+then
+	fail "Read a missing value"
+fi
+TRY="$TRY `$DGSH_READVAL -l -s testsocket 2>client.err `"
+# Reading the last value is the default, however the options are given
+TRY="$TRY `$DGSH_READVAL -kname -s testsocket 2>client.err `"
+EXPECT='named record named record named record'
+check
+
 sleep 1
 testcase "HTTP interface - text data" # {{{3
 PORT=53843
@@ -147,6 +175,78 @@ EXPECT='second record'
 check
 stop_server
 
+testcase "HTTP interface - reused store connection" # {{{3
+PORT=53843
+( echo 'first record' ; sleep 2 ; echo 'second record' ) |
+$DGSH_WRITEVAL -s testsocket 2>server.err &
+start_server -n
+# -s40: silent, IPv4 HTTP 1.0
+sleep 1
+TRY="`curl -s40 http://localhost:$PORT/testsocket`"
+sleep 2
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+# The server must reconnect to a restarted store
+$DGSH_READVAL -q -s testsocket 2>client.err
+echo 'third record' | $DGSH_WRITEVAL -s testsocket 2>server.err &
+sleep 1
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+EXPECT='first record second record third record'
+check
+stop_server
+
+testcase "HTTP interface - shared memory record" # {{{3
+PORT=53843
+( echo 'first record' ; sleep 2 ; echo 'second record' ) |
+$DGSH_WRITEVAL -m 100 -s testsocket 2>server.err &
+start_server -n
+# -s40: silent, IPv4 HTTP 1.0
+sleep 1
+TRY="`curl -s40 http://localhost:$PORT/testsocket`"
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+sleep 2
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+# The server must notice that the store exited
+$DGSH_READVAL -q -s testsocket 2>client.err
+echo 'third record' | $DGSH_WRITEVAL -m 100 -s testsocket 2>server.err &
+sleep 1
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+EXPECT='first record first record second record third record third record'
+check
+stop_server
+
+testcase "HTTP interface - killed shared memory store" # {{{3
+PORT=53843
+( echo 'first record' ; sleep 5 ) |
+$DGSH_WRITEVAL -m 100 -s testsocket 2>server.err &
+STORE_PID=$!
+start_server -n
+# -s40: silent, IPv4 HTTP 1.0
+sleep 1
+TRY="`curl -s40 http://localhost:$PORT/testsocket`"
+TRY="$TRY `curl -s40 http://localhost:$PORT/testsocket`"
+# A store killed by a signal leaves its segment unmarked
+kill -9 $STORE_PID
+sleep 1
+if curl -s40 http://localhost:$PORT/testsocket 2>/dev/null | grep -q record
+then
+	fail "Served the record of a killed store"
+fi
+rm -f testsocket
+EXPECT='first record first record'
+check -n
+stop_server
+
+testcase "HTTP interface - named value" # {{{3
+PORT=53843
+echo named record | $DGSH_WRITEVAL -k name -s testsocket 2>server.err &
+start_server
+# -s40: silent, IPv4 HTTP 1.0
+TRY="`curl -s40 http://localhost:$PORT/testsocket/name`"
+EXPECT='named record'
+check
+stop_server
+
 testcase "HTTP interface - binary data" # {{{3
 PORT=53843
 perl -e 'BEGIN { binmode STDOUT; }
@@ -319,6 +419,14 @@ second record
 third record'
 check
 
+testcase "Wide window over many records" # {{{3
+sequence 100000 | $DGSH_WRITEVAL -b 5000 -e 4997 -s testsocket 2>server.err &
+TRY="`$DGSH_READVAL -l -s testsocket 2>client.err `"
+EXPECT='95001
+95002
+95003'
+check
+
 section 'Window from fixed record stream' # {{{2
 
 testcase "Middle record" # {{{3
@@ -464,6 +572,89 @@ TRY="`$DGSH_READVAL -c -s testsocket 2>client.err `"
 EXPECT='0000'
 check
 
+section 'Subscriptions' # {{{2
+
+testcase "Record stream" # {{{3
+(echo r1 ; sleep 1 ; echo r2 ; sleep 1 ; echo r3) | $DGSH_WRITEVAL -s testsocket 2>server.err &
+TRY="`$DGSH_READVAL -f -s testsocket 2>client.err `"
+EXPECT='r1
+r2
+r3'
+check
+
+testcase "Time window" # {{{3
+# r1 enters at 0, r2 at 1, r1 leaves at 1.5, and r2 at 2.5
+(echo r1 ; sleep 1 ; echo r2 ; sleep 3) | $DGSH_WRITEVAL -u s -b 1.5 -s testsocket 2>server.err &
+TRY="`$DGSH_READVAL -f -s testsocket 2>client.err `"
+EXPECT='r1
+r1
+r2
+r2'
+check
+
+testcase "Subscriber hang-up" # {{{3
+# The store outlives a subscriber that exits while a record is sent to it
+(perl -e 'print "x" x 3000000, "\n"' ; sleep 1 ; echo last) |
+$DGSH_WRITEVAL -s testsocket 2>server.err &
+$DGSH_READVAL -f -s testsocket 2>client.err | head -c 10 >/dev/null
+TRY="`$DGSH_READVAL -l -s testsocket 2>client.err `"
+EXPECT='last'
+check
+
+section 'Aggregates' # {{{2
+
+testcase "Record window" # {{{3
+# The non-numeric last record leaves the window 6 7 8 9 10 x
+(seq 1 10 ; echo x) | $DGSH_WRITEVAL -a 1 -b 6 -s testsocket 2>server.err &
+$DGSH_READVAL -l -s testsocket >/dev/null 2>client.err
+# Percentiles are approximate; check only the exact aggregates
+TRY="`$DGSH_READVAL -a -s testsocket 2>client.err | sed 5q`"
+EXPECT='count 5
+sum 40
+min 6
+max 10
+mean 8'
+check
+
+# Read the store's percentiles, outputting "ok" for those within 1%
+# of the exact p50, p90, and p99 values specified as arguments
+read_percentiles()
+{
+	$DGSH_READVAL -a -s testsocket 2>client.err |
+	awk -v p50=$1 -v p90=$2 -v p99=$3 '
+	BEGIN { exact["p50"] = p50; exact["p90"] = p90; exact["p99"] = p99 }
+	$1 in exact {
+		e = exact[$1]
+		error = $2 > e ? $2 - e : e - $2
+		print $1, error <= (e < 0 ? -e : e) / 100 ? "ok" : $2
+	}'
+}
+
+testcase "Percentiles" # {{{3
+seq 1 1000 | $DGSH_WRITEVAL -a 1 -b 1000 -s testsocket 2>server.err &
+$DGSH_READVAL -l -s testsocket >/dev/null 2>client.err
+TRY="`read_percentiles 500 900 990`"
+EXPECT='p50 ok
+p90 ok
+p99 ok'
+check
+
+testcase "Small window percentiles" # {{{3
+printf '%s\n' -5 3 1000 | $DGSH_WRITEVAL -a 1 -b 3 -s testsocket 2>server.err &
+$DGSH_READVAL -l -s testsocket >/dev/null 2>client.err
+TRY="`read_percentiles 3 1000 1000`"
+EXPECT='p50 ok
+p90 ok
+p99 ok'
+check
+
+testcase "No aggregates" # {{{3
+echo 42 | $DGSH_WRITEVAL -s testsocket 2>server.err &
+$DGSH_READVAL -l -s testsocket >/dev/null 2>client.err
+TRY="`$DGSH_READVAL -a -s testsocket 2>client.err`"
+EXPECT=''
+check
+
 section 'Multi-client stress test' # {{{1
 echo -n "	Running"
 
@@ -520,6 +711,50 @@ done
 rm -f read-words-*
 echo "OK"
 
+section 'Concurrent clients load test' # {{{1
+echo -n "	Running"
+
+# Number of clients waiting concurrently for the store's value
+NUMCLIENTS=10000
+
+rm -f clients-started concurrent-reads
+
+# Provide the value only after all clients have been started
+{
+	while ! [ -r clients-started ]
+	do
+		sleep 1
+	done
+	echo value
+} | $DGSH_WRITEVAL -s testsocket 2>server.err &
+
+(
+	for i in `sequence $NUMCLIENTS`
+	do
+		$DGSH_READVAL -c -s testsocket 2>>client.err >>concurrent-reads &
+	done
+	touch clients-started
+
+	wait
+
+	echo
+	echo "	All clients finished"
+	$DGSH_READVAL -q -s testsocket 2>>client.err 1>/dev/null
+	echo "	Server finished"
+)
+
+echo -n "	Compare: "
+
+# Wait for the store to terminate
+wait
+
+if [ `grep -c '^value$' concurrent-reads` -ne $NUMCLIENTS ]
+then
+	fail "Concurrent clients are missing output"
+fi
+rm -f clients-started concurrent-reads
+echo "OK"
+
 section 'Time window stress test' # {{{1
 echo -n "	Running"
 
@@ -218,4 +218,46 @@ do
 	rm -f a b c d expect
 done
 
+# Test attaching an output to a running dgsh-tee through its control socket
+rm -f in ctl out out.attached
+mkfifo in
+$DGSH_TEE -c ctl <in >out &
+exec 3>in
+echo before >&3
+while ! [ -S ctl ]
+do
+	sleep 1
+done
+$DGSH_TEE -A ctl >out.attached
+echo after >&3
+exec 3>&-
+wait
+printf 'before\nafter\n' >expect
+ensure_same "Attached output (existing)" expect out
+echo after >expect
+ensure_same "Attached output (attached)" expect out.attached
+rm -f in ctl out out.attached expect
+
+# A client that connects to the control socket without sending a request
+# does not stall the existing outputs
+rm -f in ctl out out.early
+mkfifo in
+$DGSH_TEE -c ctl <in >out &
+exec 3>in
+while ! [ -S ctl ]
+do
+	sleep 1
+done
+perl -MIO::Socket::UNIX -e '$s = IO::Socket::UNIX->new(Peer => "ctl") or die;
+sleep 4' &
+sleep 1
+echo flowing >&3
+sleep 1
+cp out out.early
+exec 3>&-
+wait
+echo flowing >expect
+ensure_same "Stalled attach request" expect out.early
+rm -f in ctl out out.early expect
+
 exit 0
@@ -0,0 +1,184 @@
+#include <check.h>  /* Check unit test framework API. */
+#include <stdlib.h> /* EXIT_SUCCESS, EXIT_FAILURE */
+#include <unistd.h> /* pipe(), fork() */
+#include <err.h>    /* err() */
+#include <stdio.h>  /* snprintf */
+#include <string.h> /* memset() */
+#include <signal.h> /* signal() */
+#include <sys/types.h>
+#include <sys/wait.h> /* waitpid() */
+#include <sys/stat.h> /* fstat() */
+#include "../src/kvstore.h"
+
+/* The store server, run from the build directory */
+#define WRITEVAL "../src/dgsh-writeval"
+
+/* Length of the record the store holds, without its newline */
+#define RECORD_LENGTH 200000
+
+/* Number of commands sent before reading their responses */
+#define N_PIPELINED 120
+
+static char store_dir[] = "/tmp/dgsh-kvstore-XXXXXX";
+static char store_path[sizeof(store_dir) + 10];
+static pid_t store_pid;
+
+/*
+ * Start a store on store_path, holding a record of RECORD_LENGTH x
+ * characters, and having read all its input.
+ */
+void
+setup_store(void)
+{
+	int fds[2];
+	char *record;
+
+	if (mkdtemp(store_dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(store_path, sizeof(store_path), "%s/store", store_dir);
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	switch (store_pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(WRITEVAL, WRITEVAL, "-s", store_path, (char *)NULL);
+		err(1, "%s", WRITEVAL);
+	}
+	close(fds[0]);
+	if ((record = malloc(RECORD_LENGTH + 1)) == NULL)
+		err(1, "malloc");
+	memset(record, 'x', RECORD_LENGTH);
+	record[RECORD_LENGTH] = '\n';
+	signal(SIGPIPE, SIG_IGN);
+	if (write(fds[1], record, RECORD_LENGTH + 1) != RECORD_LENGTH + 1)
+		err(1, "write");
+	close(fds[1]);
+	free(record);
+}
+
+void
+retire_store(void)
+{
+	dgsh_send_command(store_path, NULL, 0, false, true, STDOUT_FILENO);
+	waitpid(store_pid, NULL, 0);
+	unlink(store_path);
+	rmdir(store_dir);
+}
+
+/* Return true if fd holds n copies of the store's record */
+static bool
+holds_records(int fd, int n)
+{
+	struct stat sb;
+	char buff[RECORD_LENGTH + 1];
+	int i, j;
+
+	if (fstat(fd, &sb) == -1 || sb.st_size != (off_t)n * sizeof(buff) ||
+	    lseek(fd, 0, SEEK_SET) == -1)
+		return false;
+	for (i = 0; i < n; i++) {
+		if (read(fd, buff, sizeof(buff)) != sizeof(buff) ||
+		    buff[RECORD_LENGTH] != '\n')
+			return false;
+		for (j = 0; j < RECORD_LENGTH; j++)
+			if (buff[j] != 'x')
+				return false;
+	}
+	return true;
+}
+
+START_TEST(test_pipelined_reads)
+{
+	struct kvstore_connection *kc;
+	FILE *out = tmpfile();
+	int i;
+
+	ck_assert_int_ne((long)out, 0);
+	kc = dgsh_kvstore_open(store_path, NULL, true);
+	ck_assert_int_ne((long)kc, 0);
+	/*
+	 * The responses exceed the socket buffers, so the store
+	 * writes their content lengths in parts.
+	 */
+	for (i = 0; i < N_PIPELINED; i++)
+		dgsh_kvstore_request(kc, 'L');
+	for (i = 0; i < N_PIPELINED; i++)
+		dgsh_kvstore_response(kc, fileno(out));
+	dgsh_kvstore_close(kc);
+	ck_assert(holds_records(fileno(out), N_PIPELINED));
+	fclose(out);
+}
+END_TEST
+
+START_TEST(test_connection_reuse)
+{
+	struct kvstore_connection *kc;
+	FILE *out = tmpfile();
+
+	ck_assert_int_ne((long)out, 0);
+	kc = dgsh_kvstore_open(store_path, NULL, true);
+	ck_assert_int_ne((long)kc, 0);
+	/* Different commands are answered in order */
+	dgsh_kvstore_request(kc, 'C');
+	dgsh_kvstore_request(kc, 'L');
+	dgsh_kvstore_request(kc, 'c');
+	dgsh_kvstore_response(kc, fileno(out));
+	dgsh_kvstore_response(kc, fileno(out));
+	dgsh_kvstore_response(kc, fileno(out));
+	/* The connection serves further commands after the responses */
+	dgsh_kvstore_request(kc, 'C');
+	dgsh_kvstore_response(kc, fileno(out));
+	dgsh_kvstore_close(kc);
+	ck_assert(holds_records(fileno(out), 4));
+	fclose(out);
+}
+END_TEST
+
+START_TEST(test_missing_value)
+{
+	ck_assert_int_eq((long)dgsh_kvstore_open(store_path, "nosuch", true),
+			0);
+	ck_assert_int_eq((long)dgsh_kvstore_open(store_path, "", true), 0);
+	ck_assert(!dgsh_kvstore_has_value(store_path, "nosuch", true));
+}
+END_TEST
+
+Suite *
+suite_kvstore(void)
+{
+	Suite *s = suite_create("Store connections");
+
+	TCase *tc_pr = tcase_create("pipelined reads");
+	tcase_add_checked_fixture(tc_pr, setup_store, retire_store);
+	tcase_add_test(tc_pr, test_pipelined_reads);
+	suite_add_tcase(s, tc_pr);
+
+	TCase *tc_cr = tcase_create("connection reuse");
+	tcase_add_checked_fixture(tc_cr, setup_store, retire_store);
+	tcase_add_test(tc_cr, test_connection_reuse);
+	suite_add_tcase(s, tc_cr);
+
+	TCase *tc_mv = tcase_create("missing value");
+	tcase_add_checked_fixture(tc_mv, setup_store, retire_store);
+	tcase_add_test(tc_mv, test_missing_value);
+	suite_add_tcase(s, tc_mv);
+
+	return s;
+}
+
+int
+main()
+{
+	int number_failed;
+	Suite *s = suite_kvstore();
+	SRunner *sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
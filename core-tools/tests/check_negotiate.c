@@ -7,6 +7,9 @@
 #include <stdio.h> /* snprintf */
 #include <unistd.h> /* pipe */
 #include <sys/types.h>
+#include <sys/wait.h> /* waitpid() */
+#include <sys/stat.h> /* fstat() */
+#include <pthread.h> /* pthread_create() */
 #include <sys/socket.h> /* socket */
 #include <sys/un.h> /* sockaddr_un */
 #include "../src/negotiate.h"
@@ -64,54 +67,41 @@ setup_graph_solution(void)
 		chosen_mb->graph_solution;
 	graph_solution[0].node_index = 0;
 	graph_solution[0].n_edges_incoming = 2;
-	graph_solution[0].edges_incoming = (struct dgsh_edge *)malloc(
-		sizeof(struct dgsh_edge) * graph_solution[0].n_edges_incoming);
+	graph_solution[0].n_edges_outgoing = 1;
+	graph_solution[1].node_index = 1;
+	graph_solution[1].n_edges_incoming = 1;
+	graph_solution[1].n_edges_outgoing = 2;
+	graph_solution[2].node_index = 2;
+	graph_solution[2].n_edges_incoming = 0;
+	graph_solution[2].n_edges_outgoing = 2;
+	graph_solution[3].node_index = 3;
+	graph_solution[3].n_edges_incoming = 2;
+	graph_solution[3].n_edges_outgoing = 0;
+	alloc_solution_edges(chosen_mb);
+
 	memcpy(&graph_solution[0].edges_incoming[0], &chosen_mb->edge_array[0],
 					sizeof(struct dgsh_edge));
 	memcpy(&graph_solution[0].edges_incoming[1], &chosen_mb->edge_array[2],
 					sizeof(struct dgsh_edge));
-	graph_solution[0].n_edges_outgoing = 1;
-	graph_solution[0].edges_outgoing = (struct dgsh_edge *)malloc(
-		sizeof(struct dgsh_edge) * graph_solution[0].n_edges_outgoing);
 	memcpy(&graph_solution[0].edges_outgoing[0], &chosen_mb->edge_array[4],
 					sizeof(struct dgsh_edge));
 
-	graph_solution[1].node_index = 1;
-	graph_solution[1].n_edges_incoming = 1;
-	graph_solution[1].edges_incoming = (struct dgsh_edge *)malloc(
-		sizeof(struct dgsh_edge) * graph_solution[1].n_edges_incoming);
 	memcpy(&graph_solution[1].edges_incoming[0], &chosen_mb->edge_array[1],
 					sizeof(struct dgsh_edge));
-	graph_solution[1].n_edges_outgoing = 2;
-	graph_solution[1].edges_outgoing = (struct dgsh_edge *)malloc(
-		sizeof(struct dgsh_edge) * graph_solution[1].n_edges_outgoing);
 	memcpy(&graph_solution[1].edges_outgoing[0], &chosen_mb->edge_array[2],
 					sizeof(struct dgsh_edge));
 	memcpy(&graph_solution[1].edges_outgoing[1], &chosen_mb->edge_array[3],
 					sizeof(struct dgsh_edge));
 
-	graph_solution[2].node_index = 2;
-	graph_solution[2].n_edges_incoming = 0;
-	graph_solution[2].edges_incoming = NULL;
-	graph_solution[2].n_edges_outgoing = 2;
-	graph_solution[2].edges_outgoing = (struct dgsh_edge *)malloc(
-		sizeof(struct dgsh_edge) * graph_solution[2].n_edges_outgoing);
 	memcpy(&graph_solution[2].edges_outgoing[0], &chosen_mb->edge_array[0],
 					sizeof(struct dgsh_edge));
 	memcpy(&graph_solution[2].edges_outgoing[1], &chosen_mb->edge_array[1],
 					sizeof(struct dgsh_edge));
 
-	graph_solution[3].node_index = 3;
-	graph_solution[3].n_edges_incoming = 2;
-	graph_solution[3].edges_incoming = (struct dgsh_edge *)malloc(
-		sizeof(struct dgsh_edge) * graph_solution[3].n_edges_incoming);
-	memcpy(&graph_solution[0].edges_incoming[0], &chosen_mb->edge_array[3],
+	memcpy(&graph_solution[3].edges_incoming[0], &chosen_mb->edge_array[3],
 					sizeof(struct dgsh_edge));
-	memcpy(&graph_solution[0].edges_incoming[1], &chosen_mb->edge_array[4],
+	memcpy(&graph_solution[3].edges_incoming[1], &chosen_mb->edge_array[4],
 					sizeof(struct dgsh_edge));
-	graph_solution[3].n_edges_outgoing = 0;
-	graph_solution[3].edges_outgoing = NULL;
-
 }
 
 void
@@ -203,6 +193,8 @@ setup_chosen_mb(void)
         chosen_mb->edge_array = edges;
         chosen_mb->n_edges = n_edges;
 	chosen_mb->graph_solution = NULL;
+	chosen_mb->solution_edges = NULL;
+	chosen_mb->n_solution_edges = 0;
 
 	/* check_negotiation_round() */
 	chosen_mb->state = PS_NEGOTIATION;
@@ -294,6 +286,8 @@ setup_mb(struct dgsh_negotiation **mb)
         temp_mb->edge_array = edges;
         temp_mb->n_edges = n_edges;
 	temp_mb->graph_solution = NULL;
+	temp_mb->solution_edges = NULL;
+	temp_mb->n_solution_edges = 0;
 
 	/* check_negotiation_round() */
 	temp_mb->state = PS_NEGOTIATION;
@@ -532,6 +526,13 @@ setup_test_read_concs(void)
 	setup_self_node_io_side();
 }
 
+void
+setup_test_alloc_solution_edges(void)
+{
+	setup_chosen_mb();
+	setup_graph_solution();
+}
+
 void
 setup_test_write_graph_solution(void)
 {
@@ -566,6 +567,8 @@ void
 setup_test_make_compact_edge_array(void)
 {
 	setup_pointers_to_edges();
+	compact_edges = (struct dgsh_edge *)malloc(sizeof(struct dgsh_edge) *
+								n_ptedges);
 }
 
 void
@@ -706,12 +709,17 @@ retire_graph_solution(struct dgsh_node_connections *graph_solution,
 								int node_index)
 {
 	int i;
-        for (i = 0; i <= node_index; i++) {
-		if (graph_solution[i].n_edges_incoming)
-                	free(graph_solution[i].edges_incoming);
-		if (graph_solution[i].n_edges_outgoing)
-                	free(graph_solution[i].edges_outgoing);
-        }
+	if (chosen_mb->solution_edges) {
+		free(chosen_mb->solution_edges);
+		chosen_mb->solution_edges = NULL;
+		chosen_mb->n_solution_edges = 0;
+	} else
+		for (i = 0; i <= node_index; i++) {
+			if (graph_solution[i].n_edges_incoming)
+				free(graph_solution[i].edges_incoming);
+			if (graph_solution[i].n_edges_outgoing)
+				free(graph_solution[i].edges_outgoing);
+		}
         free(graph_solution);
 }
 
@@ -918,6 +926,14 @@ retire_test_read_concs(void)
 	retire_mb(fresh_mb);
 }
 
+void
+retire_test_alloc_solution_edges(void)
+{
+	retire_graph_solution(chosen_mb->graph_solution,
+			chosen_mb->n_nodes - 1);
+	retire_chosen_mb();
+}
+
 void
 retire_test_write_graph_solution(void)
 {
@@ -1129,6 +1145,178 @@ START_TEST(test_solve_graph)
 }
 END_TEST
 
+START_TEST(test_solution_cache)
+{
+	char dir[] = "/tmp/dgsh-cache-XXXXXX";
+	char cmd[sizeof(dir) + 10];
+	struct dgsh_node_connections *graph_solution;
+
+	DPRINTF(4, "%s()", __func__);
+	ck_assert_int_eq(mkdtemp(dir) != NULL, 1);
+	setenv("DGSH_CACHE", dir, 1);
+
+	/* Cold cache: solve and store the solution. */
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(cache_hits, 0);
+	ck_assert_int_eq(cache_misses, 1);
+	retire_test_solve_graph();
+
+	/* Warm cache: the same graph reuses the stored solution. */
+	setup_test_solve_graph();
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(cache_hits, 1);
+	ck_assert_int_eq(cache_misses, 1);
+	graph_solution = chosen_mb->graph_solution;
+	ck_assert_int_eq(graph_solution[3].n_edges_incoming, 2);
+	ck_assert_int_eq(graph_solution[3].n_edges_outgoing, 0);
+	ck_assert_int_eq(graph_solution[3].edges_incoming[0].instances, 1);
+	ck_assert_int_eq(graph_solution[0].edges_outgoing[0].instances, 1);
+	ck_assert_int_eq(graph_solution[3].edges_incoming[1].instances, 1);
+	ck_assert_int_eq(graph_solution[1].edges_outgoing[1].instances, 1);
+	ck_assert_int_eq((long int)graph_solution[3].edges_outgoing, 0);
+	retire_test_solve_graph();
+
+	/* A changed constraint is a different graph. */
+	setup_test_solve_graph();
+	chosen_mb->node_array[3].requires_channels = -1;
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(cache_hits, 1);
+	ck_assert_int_eq(cache_misses, 2);
+
+	unsetenv("DGSH_CACHE");
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	ck_assert_int_eq(system(cmd), 0);
+}
+END_TEST
+
+START_TEST(test_graph_file)
+{
+	char path[] = "/tmp/dgsh-graph-XXXXXX";
+	struct dgsh_negotiation *mb, *solved_mb;
+	int i, fd, n_input_fds = 2;
+
+	DPRINTF(4, "%s()", __func__);
+	ck_assert_int_ne(fd = mkstemp(path), -1);
+	close(fd);
+	unlink(path);
+	setenv("DGSH_GRAPH", path, 1);
+
+	/* Without known positions the graph cannot be stored. */
+	setenv("DGSH_GRAPH_ID", "graph 1", 1);
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		chosen_mb->node_array[i].position = -1;
+		chosen_mb->node_array[i].shm_channels = 0;
+	}
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(access(path, F_OK), -1);
+	retire_test_solve_graph();
+
+	/* Nor can it without the graph's identifier. */
+	unsetenv("DGSH_GRAPH_ID");
+	setup_test_solve_graph();
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		chosen_mb->node_array[i].position = 10 + i;
+		chosen_mb->node_array[i].shm_channels = 0;
+	}
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(access(path, F_OK), -1);
+	retire_test_solve_graph();
+
+	setenv("DGSH_GRAPH_ID", "graph 1", 1);
+	setup_test_solve_graph();
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		chosen_mb->node_array[i].position = 10 + i;
+		chosen_mb->node_array[i].shm_channels = 0;
+	}
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(graph_file_load(path, "graph 2", &mb), OP_ERROR);
+	ck_assert_int_eq(graph_file_load(path, "graph", &mb), OP_ERROR);
+	ck_assert_int_eq(graph_file_load(path, "graph 1", &mb), OP_SUCCESS);
+	ck_assert_int_eq(mb->n_nodes, 4);
+	ck_assert_int_eq(mb->n_concs, 0);
+	ck_assert_int_eq(mb->node_array[2].position, 12);
+	ck_assert_int_eq(mb->graph_solution[3].n_edges_incoming, 2);
+	ck_assert_int_eq(mb->graph_solution[3].n_edges_outgoing, 0);
+	ck_assert_int_eq(mb->graph_solution[3].edges_incoming[1].instances,
+		chosen_mb->graph_solution[3].edges_incoming[1].instances);
+	solved_mb = chosen_mb;
+	chosen_mb = mb;
+	free_mb(mb);
+
+	/* The tool at position 13 is proc3, which takes two inputs. */
+	self_node.position = 13;
+	self_node.dgsh_in = 1;
+	self_node.dgsh_out = 0;
+	self_node.shm_channels = 0;
+	ck_assert_int_eq(graph_file_negotiate("proc3", 103, &n_input_fds,
+				NULL), OP_SUCCESS);
+	ck_assert_int_eq(self_node.index, 3);
+	free_mb(chosen_mb);
+	chosen_mb = NULL;
+
+	/* All processes of a graph with another shape negotiate. */
+	setenv("DGSH_GRAPH_ID", "graph 2", 1);
+	ck_assert_int_eq(graph_file_negotiate("proc2", 103, &n_input_fds,
+				NULL), OP_NOOP);
+	ck_assert_int_eq((long)chosen_mb, 0);
+
+	/* A process that does not match its entry fails and removes it. */
+	setenv("DGSH_GRAPH_ID", "graph 1", 1);
+	ck_assert_int_eq(graph_file_negotiate("proc2", 103, &n_input_fds,
+				NULL), OP_ERROR);
+	ck_assert_int_eq((long)chosen_mb, 0);
+	ck_assert_int_eq(access(path, F_OK), -1);
+	ck_assert_int_eq(graph_file_negotiate("proc3", 103, &n_input_fds,
+				NULL), OP_NOOP);
+	chosen_mb = solved_mb;
+
+	/* A corrupt file is ignored. */
+	ck_assert_int_eq(graph_file_store(path), OP_SUCCESS);
+	ck_assert_int_eq(truncate(path, 40), 0);
+	ck_assert_int_eq(graph_file_load(path, "graph 1", &mb), OP_ERROR);
+	unlink(path);
+	unsetenv("DGSH_GRAPH_ID");
+	unsetenv("DGSH_GRAPH");
+}
+END_TEST
+
+START_TEST(test_trace)
+{
+	char dir[] = "/tmp/dgsh-trace-XXXXXX";
+	char path[sizeof(dir) + 30], buf[2048];
+	FILE *f;
+	size_t n;
+
+	DPRINTF(4, "%s()", __func__);
+	ck_assert_int_eq(mkdtemp(dir) != NULL, 1);
+	setenv("DGSH_TRACE_DIR", dir, 1);
+	trace_enabled = -1;
+
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	ck_assert_int_eq(n_trace_events, 1);
+	ck_assert_int_eq(trace_events[0].size, 4);
+	ck_assert_int_ge(trace_events[0].duration, 0);
+	trace_write("proc \"0\"");
+	ck_assert_int_eq(n_trace_events, 0);
+
+	snprintf(path, sizeof(path), "%s/dgsh-%d.json", dir, (int)getpid());
+	ck_assert_int_eq((f = fopen(path, "r")) != NULL, 1);
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[n] = 0;
+	fclose(f);
+	ck_assert_int_eq(buf[0], '[');
+	ck_assert_int_eq(strstr(buf, "\"name\": \"proc \\\"0\\\"\"") != NULL, 1);
+	ck_assert_int_eq(strstr(buf, "\"name\": \"solve\"") != NULL, 1);
+	ck_assert_int_eq(strstr(buf, "\"size\": 4") != NULL, 1);
+	ck_assert_int_eq(strcmp(buf + n - 3, "\n]\n"), 0);
+
+	unlink(path);
+	rmdir(dir);
+	unsetenv("DGSH_TRACE_DIR");
+	trace_enabled = -1;
+}
+END_TEST
+
 START_TEST(test_calculate_conc_fds)
 {
 	DPRINTF(4, "%s()", __func__);
@@ -1150,6 +1338,70 @@ START_TEST(test_calculate_conc_fds)
 	graph_solution[2].edges_outgoing[1].instances = 1;
 
 	ck_assert_int_eq(calculate_conc_fds(), OP_SUCCESS);
+	ck_assert_int_eq(chosen_mb->conc_array[0].input_fds, 2);
+	ck_assert_int_eq(chosen_mb->conc_array[0].output_fds, 2);
+	ck_assert_int_eq(chosen_mb->conc_array[1].input_fds, 2);
+	ck_assert_int_eq(chosen_mb->conc_array[1].output_fds, 2);
+
+	/* Chained: the scatter conc feeds the gather conc that follows it */
+	chosen_mb->conc_array[0].input_fds = -1;
+	chosen_mb->conc_array[0].output_fds = -1;
+	chosen_mb->conc_array[0].proc_pids[1] = 2001;
+	chosen_mb->conc_array[0].endpoint_pid = 2002;	/* Not known */
+	chosen_mb->conc_array[1].input_fds = -1;
+	chosen_mb->conc_array[1].output_fds = -1;
+	ck_assert_int_eq(calculate_conc_fds(), OP_SUCCESS);
+	ck_assert_int_eq(chosen_mb->conc_array[1].input_fds, 2);
+	ck_assert_int_eq(chosen_mb->conc_array[0].output_fds, 1 + 2);
+	ck_assert_int_eq(chosen_mb->conc_array[0].input_fds, 1 + 2);
+
+	/* A conc chained to itself */
+	chosen_mb->conc_array[0].input_fds = -1;
+	chosen_mb->conc_array[0].output_fds = -1;
+	chosen_mb->conc_array[1].input_fds = -1;
+	chosen_mb->conc_array[1].output_fds = -1;
+	chosen_mb->conc_array[1].proc_pids[0] = 2000;
+	ck_assert_int_eq(calculate_conc_fds(), OP_ERROR);
+}
+END_TEST
+
+START_TEST(test_solution_depths)
+{
+	struct dgsh_node_connections *graph_solution =
+			chosen_mb->graph_solution;
+	int depth[4], height[4];
+
+	/* 2 -> 0, 2 -> 1, 1 -> 0, 1 -> 3, 0 -> 3 */
+	graph_solution[0].edges_outgoing[0].instances = 1;
+	graph_solution[1].edges_outgoing[0].instances = 1;
+	graph_solution[1].edges_outgoing[1].instances = 1;
+	graph_solution[2].edges_outgoing[0].instances = 1;
+	graph_solution[2].edges_outgoing[1].instances = 1;
+	ck_assert_int_eq(solution_depths(depth, height), 4);
+	ck_assert_int_eq(depth[2], 0);
+	ck_assert_int_eq(depth[1], 1);
+	ck_assert_int_eq(depth[0], 2);
+	ck_assert_int_eq(depth[3], 3);
+	ck_assert_int_eq(height[2], 3);
+	ck_assert_int_eq(height[1], 2);
+	ck_assert_int_eq(height[0], 1);
+	ck_assert_int_eq(height[3], 0);
+
+	/* Without channels 2 -> 1 and 1 -> 0 the path is shorter */
+	graph_solution[1].edges_outgoing[0].instances = 0;
+	graph_solution[2].edges_outgoing[1].instances = 0;
+	ck_assert_int_eq(solution_depths(depth, height), 3);
+	ck_assert_int_eq(depth[1], 0);
+	ck_assert_int_eq(depth[0], 1);
+	ck_assert_int_eq(height[1], 1);
+
+	/* A cycle: 3 -> 2 */
+	graph_solution[3].edges_outgoing = &graph_solution[0].edges_outgoing[0];
+	graph_solution[3].n_edges_outgoing = 1;
+	graph_solution[0].edges_outgoing[0].to = 2;
+	ck_assert_int_eq(solution_depths(depth, height), -1);
+	graph_solution[0].edges_outgoing[0].to = 3;
+	graph_solution[3].n_edges_outgoing = 0;
 }
 END_TEST
 
@@ -1206,6 +1458,76 @@ START_TEST(test_establish_io_connections)
 }
 END_TEST
 
+/* Number of I/O connections established by the following thread */
+#define ASYNC_CONNECTIONS 20000
+
+/*
+ * Repeatedly establish I/O connections, as an asynchronous negotiation
+ * does, counting those whose stdin or stdout is not the negotiated pipe
+ */
+static void *
+establish_io_connections_thread(void *mismatches)
+{
+	int in[2], out[2];
+	int i;
+	struct stat sb_pipe, sb_std;
+
+	for (i = 0; i < ASYNC_CONNECTIONS; i++) {
+		if (pipe(in) == -1 || pipe(out) == -1)
+			err(1, "pipe");
+		self_pipe_fds.n_input_fds = 1;
+		self_pipe_fds.input_fds = (int *)malloc(sizeof(int));
+		self_pipe_fds.input_fds[0] = in[0];
+		self_pipe_fds.n_output_fds = 1;
+		self_pipe_fds.output_fds = (int *)malloc(sizeof(int));
+		self_pipe_fds.output_fds[0] = out[1];
+		establish_io_connections(NULL, NULL, NULL, NULL);
+
+		/* Both ends of a pipe share its inode */
+		if (fstat(in[1], &sb_pipe) == -1 ||
+		    fstat(STDIN_FILENO, &sb_std) == -1 ||
+		    sb_std.st_ino != sb_pipe.st_ino)
+			(*(int *)mismatches)++;
+		if (fstat(out[0], &sb_pipe) == -1 ||
+		    fstat(STDOUT_FILENO, &sb_std) == -1 ||
+		    sb_std.st_ino != sb_pipe.st_ino)
+			(*(int *)mismatches)++;
+		close(in[1]);
+		close(out[0]);
+	}
+	__atomic_store_n((int *)mismatches + 1, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+START_TEST(test_establish_io_connections_async)
+{
+	/*
+	 * The main thread opens files, as a program doing its setup
+	 * after dgsh_negotiate_start() would, while another thread
+	 * moves negotiated fds to stdin and stdout.
+	 */
+	int saved_stdin = dup(STDIN_FILENO);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int result[2] = {0, 0};		/* Mismatches, done */
+	pthread_t thread;
+	int fd;
+
+	free(self_pipe_fds.input_fds);
+	ck_assert_int_eq(pthread_create(&thread, NULL,
+			establish_io_connections_thread, result), 0);
+	while (!__atomic_load_n(&result[1], __ATOMIC_ACQUIRE))
+		if ((fd = open("/dev/null", O_RDONLY)) != -1)
+			close(fd);
+	ck_assert_int_eq(pthread_join(thread, NULL), 0);
+	ck_assert_int_eq(result[0], 0);
+
+	dup2(saved_stdin, STDIN_FILENO);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdin);
+	close(saved_stdout);
+}
+END_TEST
+
 struct dgsh_edge **edges_in;
 int n_edges_in;
 struct dgsh_edge **edges_out;
@@ -1485,16 +1807,20 @@ END_TEST
 START_TEST(test_make_compact_edge_array)
 {
 	ck_assert_int_eq(make_compact_edge_array(NULL, 2, pointers_to_edges), OP_ERROR);
-	ck_assert_int_eq(make_compact_edge_array(&compact_edges, -2, pointers_to_edges), OP_ERROR);
-	ck_assert_int_eq(make_compact_edge_array(&compact_edges, 0, pointers_to_edges), OP_ERROR);
-	ck_assert_int_eq(make_compact_edge_array(&compact_edges, n_ptedges, NULL), OP_ERROR);
+	ck_assert_int_eq(make_compact_edge_array(compact_edges, -2, pointers_to_edges), OP_ERROR);
+	ck_assert_int_eq(make_compact_edge_array(compact_edges, 0, pointers_to_edges), OP_ERROR);
+	ck_assert_int_eq(make_compact_edge_array(compact_edges, n_ptedges, NULL), OP_ERROR);
 
 	struct dgsh_edge *p = pointers_to_edges[0];
 	pointers_to_edges[0] = NULL;
-	ck_assert_int_eq(make_compact_edge_array(&compact_edges, n_ptedges, pointers_to_edges), OP_ERROR);
+	ck_assert_int_eq(make_compact_edge_array(compact_edges, n_ptedges, pointers_to_edges), OP_ERROR);
 
 	pointers_to_edges[0] = p;
-	ck_assert_int_eq(make_compact_edge_array(&compact_edges, n_ptedges, pointers_to_edges), OP_SUCCESS);
+	ck_assert_int_eq(make_compact_edge_array(compact_edges, n_ptedges, pointers_to_edges), OP_SUCCESS);
+	ck_assert_int_eq(compact_edges[n_ptedges - 1].from,
+			pointers_to_edges[n_ptedges - 1]->from);
+	ck_assert_int_eq(compact_edges[n_ptedges - 1].to,
+			pointers_to_edges[n_ptedges - 1]->to);
 }
 END_TEST
 
@@ -1527,19 +1853,27 @@ START_TEST(test_set_dispatcher)
 }
 END_TEST
 
-START_TEST(test_alloc_node_connections)
+START_TEST(test_alloc_solution_edges)
 {
-	struct dgsh_edge *test;
-	/* It is assumed that negative number of edges have already
-         * been checked. See e.g. read_graph_solution().
-         */
-	ck_assert_int_eq(alloc_node_connections(NULL, 2, 1, 2), OP_ERROR);
-	ck_assert_int_eq(alloc_node_connections(&test, 1, 2, 2), OP_ERROR);
-	ck_assert_int_eq(alloc_node_connections(&test, 1, -1, 2), OP_ERROR);
-	ck_assert_int_eq(alloc_node_connections(&test, 1, 1, -2), OP_ERROR);
-
-	ck_assert_int_eq(alloc_node_connections(&test, 1, 1, 2), OP_SUCCESS);
-	free(test);
+	struct dgsh_node_connections *graph_solution =
+					chosen_mb->graph_solution;
+	struct dgsh_edge *edges = chosen_mb->solution_edges;
+
+	/* Incoming edges of all nodes precede the outgoing ones. */
+	ck_assert_int_eq(chosen_mb->n_solution_edges, 10);
+	ck_assert(graph_solution[0].edges_incoming == edges);
+	ck_assert(graph_solution[1].edges_incoming == edges + 2);
+	ck_assert(graph_solution[2].edges_incoming == NULL);
+	ck_assert(graph_solution[3].edges_incoming == edges + 3);
+	ck_assert(graph_solution[0].edges_outgoing == edges + 5);
+	ck_assert(graph_solution[1].edges_outgoing == edges + 6);
+	ck_assert(graph_solution[2].edges_outgoing == edges + 8);
+	ck_assert(graph_solution[3].edges_outgoing == NULL);
+
+	/* Negative number of edges. */
+	graph_solution[2].n_edges_incoming = -1;
+	ck_assert_int_eq(alloc_solution_edges(chosen_mb), OP_ERROR);
+	graph_solution[2].n_edges_incoming = 0;
 }
 END_TEST
 
@@ -1619,34 +1953,27 @@ START_TEST(test_write_graph_solution)
 			exit(1);
 		}
 
-		for (i = 0; i < chosen_mb->n_nodes; i++) {
-                	struct dgsh_node_connections *nc = &graph_solution[i];
-                	int in_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_incoming;
-                	int out_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_outgoing;
-                	if ((in_edges_size > buf_size) || 
-						(out_edges_size > buf_size)) {
-                        	DPRINTF(4, "Dgsh negotiation graph solution for node at index %d: incoming connections of size %d or outgoing connections of size %d do not fit to buffer of size %d.\n", nc->node_index, in_edges_size, out_edges_size, buf_size);
-                        	exit(1);
-                	}
-
-			DPRINTF(4, "Child reads incoming edges of node %d in fd %d. Total size: %d", i, fd[1], in_edges_size);
-                	/* Transmit a node's incoming connections. */
-                	rsize = read(fd[0], nc->edges_incoming, in_edges_size);
-			if (rsize == -1) {
-				DPRINTF(4, "Read edges incoming failed.");
-				exit(1);
-			}
-
-			DPRINTF(4, "Child reads outgoing edges of node %d in fd %d. Total size: %d", i, fd[1], out_edges_size);
-                	/* Transmit a node's outgoing connections. */
-                	rsize = read(fd[0], nc->edges_outgoing, out_edges_size);
-			if (rsize == -1) {
-				DPRINTF(4, "Read edges outgoing failed.");
-				exit(1);
-			}
-        	}
+		/* All nodes' connections follow in one block. */
+		int edges_size = 0;
+		for (i = 0; i < chosen_mb->n_nodes; i++)
+			edges_size += sizeof(struct dgsh_edge) *
+				(graph_solution[i].n_edges_incoming +
+				 graph_solution[i].n_edges_outgoing);
+		if (edges_size > buf_size) {
+			DPRINTF(4, "Dgsh negotiation graph solution edges of size %d do not fit to buffer of size %d.\n", edges_size, buf_size);
+			exit(1);
+		}
+		struct dgsh_edge *edges = (struct dgsh_edge *)malloc(edges_size);
+		DPRINTF(4, "Child reads edges in fd %d. Total size: %d",
+				fd[0], edges_size);
+		rsize = read(fd[0], edges, edges_size);
+		if (rsize != edges_size ||
+				memcmp(edges, chosen_mb->solution_edges,
+					edges_size) != 0) {
+			DPRINTF(4, "Read solution edges failed.");
+			exit(1);
+		}
+		free(edges);
 		DPRINTF(4, "Child: closes fd %d.", fd[0]);
 		close(fd[0]);
 		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
@@ -1807,7 +2134,6 @@ START_TEST(test_read_graph_solution)
 {
 	int fd[2];
 	int pid;
-	int i;
         int n_nodes = fresh_mb->n_nodes;
 	int buf_size = getpagesize();
         int graph_solution_size = sizeof(struct dgsh_node_connections) *
@@ -1842,39 +2168,20 @@ START_TEST(test_read_graph_solution)
 		/* Sleep for 1 millisecond before the next operation. */
 		nanosleep(&tm, NULL);
 
-		for (i = 0; i < chosen_mb->n_nodes; i++) {
-                	struct dgsh_node_connections *nc = &graph_solution[i];
-                	int in_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_incoming;
-                	int out_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_outgoing;
-			int wsize = -1;
-			if ((in_edges_size > buf_size) || 
-						(out_edges_size > buf_size)) {
-                        	DPRINTF(4, "Dgsh negotiation graph solution for node at index %d: incoming connections of size %d or outgoing connections of size %d do not fit to buffer of size %d.\n", nc->node_index, in_edges_size, out_edges_size, buf_size);
-                        	exit(1);
-                	}
-
-			DPRINTF(4, "Child writes incoming edges of node %d in fd %d. Total size: %d", i, fd[1], in_edges_size);
-                	/* Transmit a node's incoming connections. */
-                	wsize = write(fd[1], nc->edges_incoming, in_edges_size);
-			if (wsize == -1) {
-				DPRINTF(4, "Write edges incoming failed.");
-				exit(1);
-			}
-			/* Sleep for 1 millisecond before the next operation. */
-			nanosleep(&tm, NULL);
-
-			DPRINTF(4, "Child writes outgoing edges of node %d in fd %d. Total size: %d", i, fd[1], out_edges_size);
-                	/* Transmit a node's outgoing connections. */
-                	wsize = write(fd[1], nc->edges_outgoing, out_edges_size);
-			if (wsize == -1) {
-				DPRINTF(4, "Write edges outgoing failed.");
-				exit(1);
-			}
-			/* Sleep for 1 millisecond before the next operation. */
-			nanosleep(&tm, NULL);
-        	}
+		/* All nodes' connections follow in one block. */
+		int edges_size = sizeof(struct dgsh_edge) *
+					chosen_mb->n_solution_edges;
+		if (edges_size > buf_size) {
+			DPRINTF(4, "Dgsh negotiation graph solution edges of size %d do not fit to buffer of size %d.\n", edges_size, buf_size);
+			exit(1);
+		}
+		DPRINTF(4, "Child writes edges in fd %d. Total size: %d",
+				fd[1], edges_size);
+		wsize = write(fd[1], chosen_mb->solution_edges, edges_size);
+		if (wsize == -1) {
+			DPRINTF(4, "Write solution edges failed.");
+			exit(1);
+		}
 		DPRINTF(4, "Child: closes fd %d.", fd[1]);
 		close(fd[1]);
 		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
@@ -1883,6 +2190,22 @@ START_TEST(test_read_graph_solution)
 		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
 		ck_assert_int_eq(read_graph_solution(fd[0],
 					fresh_mb), OP_SUCCESS);
+		struct dgsh_node_connections *graph_solution =
+			fresh_mb->graph_solution;
+		ck_assert_int_eq(fresh_mb->n_solution_edges, 10);
+		ck_assert(graph_solution[0].edges_incoming ==
+				fresh_mb->solution_edges);
+		ck_assert(graph_solution[2].edges_incoming == NULL);
+		ck_assert(graph_solution[0].edges_outgoing ==
+				fresh_mb->solution_edges + 5);
+		ck_assert(graph_solution[1].edges_outgoing ==
+				fresh_mb->solution_edges + 6);
+		ck_assert_int_eq(graph_solution[3].edges_incoming[1].from,
+				chosen_mb->edge_array[4].from);
+		ck_assert_int_eq(graph_solution[3].edges_incoming[1].to,
+				chosen_mb->edge_array[4].to);
+		free(fresh_mb->solution_edges);
+		free(fresh_mb->graph_solution);
 	}
 }
 END_TEST
@@ -2051,6 +2374,201 @@ START_TEST (test_read_write_fd)
 }
 END_TEST
 
+START_TEST (test_hinted_pipe_size)
+{
+	struct dgsh_channel_hints h = {0, 0, 0};
+
+	ck_assert_int_eq(hinted_pipe_size(NULL), 0);
+	ck_assert_int_eq(hinted_pipe_size(&h), 0);
+	h.expected_bytes = DGSH_LARGE_VOLUME;
+	ck_assert_int_eq(hinted_pipe_size(&h), DGSH_LARGE_PIPE_SIZE);
+	h.latency_sensitive = 1;
+	ck_assert_int_eq(hinted_pipe_size(&h), 0);
+	/* Small volumes get a minimal pipe */
+	h.expected_bytes = 80;
+	ck_assert_int_eq(hinted_pipe_size(&h), DGSH_SMALL_PIPE_SIZE);
+	/* An explicit size takes precedence */
+	h.buffer_size = 4096;
+	ck_assert_int_eq(hinted_pipe_size(&h), 4096);
+#ifdef F_GETPIPE_SZ
+	int fd[2];
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	set_pipe_size(fd[1], 256 * 1024);
+	ck_assert_int_eq(fcntl(fd[1], F_GETPIPE_SZ), 256 * 1024);
+	close(fd[0]);
+	close(fd[1]);
+#endif
+	/* The outputs of a wide fan-out share the largest capacity */
+	ck_assert_int_eq(output_pipe_size_limit(1), pipe_max_size());
+	ck_assert_int_le(output_pipe_size_limit(4) * 4,
+			MAX(pipe_max_size(), 4 * DGSH_DEFAULT_PIPE_SIZE));
+	ck_assert_int_eq(output_pipe_size_limit(1000), DGSH_DEFAULT_PIPE_SIZE);
+}
+END_TEST
+
+START_TEST (test_control)
+{
+	char dir[] = "/tmp/dgsh-control-XXXXXX";
+	char path[sizeof(dir) + 10];
+	int control_fd, fd[2];
+	int *fds;
+	int conn;
+	char c;
+
+	ck_assert_int_eq(mkdtemp(dir) != NULL, 1);
+	snprintf(path, sizeof(path), "%s/ctl", dir);
+	ck_assert_int_ne((control_fd = dgsh_control_open(path)), -1);
+	/* No connection yet */
+	ck_assert_int_eq(dgsh_control_accept(control_fd), -1);
+
+	/* The attached descriptor refers to the same pipe */
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	ck_assert_int_eq(dgsh_control_attach(path, 1, &fd[1]), 0);
+	close(fd[1]);
+	ck_assert_int_ne((conn = dgsh_control_accept(control_fd)), -1);
+	ck_assert_int_eq(dgsh_control_receive(conn, &fds), 1);
+	ck_assert_int_eq(write(fds[0], "x", 1), 1);
+	close(fds[0]);
+	free(fds);
+	ck_assert_int_eq(read(fd[0], &c, 1), 1);
+	ck_assert_int_eq(c, 'x');
+	close(fd[0]);
+
+	/* Nothing to attach */
+	ck_assert_int_eq(dgsh_control_attach(path, 0, fd), -1);
+
+	/* A request that lacks the descriptors it announces is ignored */
+	struct sockaddr_un addr;
+	int sock, n = 1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	ck_assert_int_ne((sock = socket(AF_UNIX, SOCK_STREAM, 0)), -1);
+	ck_assert_int_eq(connect(sock, (struct sockaddr *)&addr,
+				sizeof(addr)), 0);
+	ck_assert_int_eq(write(sock, &n, sizeof(n)), sizeof(n));
+	close(sock);
+	ck_assert_int_ne((conn = dgsh_control_accept(control_fd)), -1);
+	ck_assert_int_eq(dgsh_control_receive(conn, &fds), -1);
+	ck_assert_int_ne(errno, EAGAIN);
+
+	/* A client that sends nothing does not block the receiver */
+	ck_assert_int_ne((sock = socket(AF_UNIX, SOCK_STREAM, 0)), -1);
+	ck_assert_int_eq(connect(sock, (struct sockaddr *)&addr,
+				sizeof(addr)), 0);
+	ck_assert_int_ne((conn = dgsh_control_accept(control_fd)), -1);
+	ck_assert_int_eq(dgsh_control_receive(conn, &fds), -1);
+	ck_assert_int_eq(errno, EAGAIN);
+	close(sock);
+	ck_assert_int_eq(dgsh_control_receive(conn, &fds), -1);
+	ck_assert_int_ne(errno, EAGAIN);
+
+	close(control_fd);
+	unlink(path);
+	rmdir(dir);
+}
+END_TEST
+
+START_TEST (test_shm_channel)
+{
+	/* Larger than the channel, to exercise wrap-around and waiting */
+	int size = 3 * 4096 + 100;
+	char *out = malloc(size), *in = malloc(size);
+	int wfd, rfd, got, n, status;
+	pid_t pid;
+
+	if (!shm_channels_supported())
+		return;
+	for (n = 0; n < size; n++)
+		out[n] = n % 251;
+
+	wfd = shm_channel_create(4096, &rfd);
+	ck_assert_int_ne(wfd, -1);
+	ck_assert(shm_channel_attach(rfd));
+	ck_assert_int_eq(dgsh_ready(rfd), 0);
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(rfd);
+		exit(dgsh_write(wfd, out, size) != size);
+	}
+	dgsh_close(wfd);
+	for (got = 0; (n = dgsh_read(rfd, in + got, size - got)) > 0; got += n)
+		;
+	ck_assert_int_eq(n, 0);
+	ck_assert_int_eq(got, size);
+	ck_assert(memcmp(in, out, size) == 0);
+	ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+	ck_assert_int_eq(WEXITSTATUS(status), 0);
+	dgsh_close(rfd);
+
+	/* Writing to a channel whose reader has gone fails as with a pipe */
+	signal(SIGPIPE, SIG_IGN);
+	wfd = shm_channel_create(0, &rfd);
+	ck_assert(shm_channel_attach(rfd));
+	dgsh_close(rfd);
+	ck_assert_int_eq(dgsh_write(wfd, out, 1), -1);
+	ck_assert_int_eq(errno, EPIPE);
+	dgsh_close(wfd);
+	signal(SIGPIPE, SIG_DFL);
+
+	/* Other descriptors are left alone */
+	int fd[2];
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	ck_assert(!shm_channel_attach(fd[0]));
+	ck_assert_int_eq(dgsh_ready(fd[0]), -1);
+	ck_assert_int_eq(dgsh_write(fd[1], "x", 1), 1);
+	ck_assert_int_eq(dgsh_read(fd[0], in, 1), 1);
+	dgsh_close(fd[0]);
+	dgsh_close(fd[1]);
+	free(in);
+	free(out);
+}
+END_TEST
+
+START_TEST (test_read_write_fds)
+{
+	/* More than fit in a single control message */
+	int n_fds = DGSH_MAX_MSG_FDS + 10;
+	int pipe_in[n_fds], pipe_out[n_fds], received[n_fds];
+	int sockets[2];
+	int i;
+	char buff[20];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+		err(1, "socketpair");
+	for (i = 0; i < n_fds; i++) {
+		int pipefd[2];
+		if (pipe(pipefd) == -1)
+			err(1, "pipe");
+		pipe_in[i] = pipefd[STDIN_FILENO];
+		pipe_out[i] = pipefd[STDOUT_FILENO];
+	}
+	write_fds(sockets[0], pipe_in, n_fds);
+	for (i = 0; i < n_fds; i++)
+		close(pipe_in[i]);
+	read_fds(sockets[1], received, n_fds);
+
+	/* Descriptors arrive in order */
+	for (i = 0; i < n_fds; i++) {
+		snprintf(buff, sizeof(buff), "%d", i);
+		if (write(pipe_out[i], buff, strlen(buff) + 1) == -1)
+			err(1, "write");
+		close(pipe_out[i]);
+		memset(buff, 0, sizeof(buff));
+		if (read(received[i], buff, sizeof(buff)) == -1)
+			err(1, "read");
+		close(received[i]);
+		ck_assert_int_eq(atoi(buff), i);
+	}
+	close(sockets[0]);
+	close(sockets[1]);
+}
+END_TEST
+
 		
 /* Incomplete? */
 START_TEST(test_read_input_fds)
@@ -2272,14 +2790,14 @@ END_TEST
 START_TEST(test_alloc_copy_nodes)
 {
 	const int size = sizeof(struct dgsh_node) * fresh_mb->n_nodes;
-	char buf[512];
-	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf, 86, 512), OP_ERROR);
+	char buf[1024];
+	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf, 86, 1024), OP_ERROR);
 
 	char buf2[32];
 	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf2, size, 32), OP_ERROR);
 
 	free(fresh_mb->node_array);  /* to avoid memory leak */
-	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf, size, 512), OP_SUCCESS);
+	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf, size, 1024), OP_SUCCESS);
 }
 END_TEST
 
@@ -2787,17 +3305,25 @@ END_TEST
 START_TEST(test_set_fds)
 {
 	/* For node 3 which is a terminal node */
-	fd_set read_fds, write_fds;
-	ck_assert_int_eq(set_fds(&read_fds, &write_fds, 0), 2);
+	struct pollfd fds[2];
+	ck_assert_int_eq(set_fds(fds, 0), 1);
 	ck_assert_int_eq(self_node_io_side.fd_direction, STDIN_FILENO);
-	ck_assert_int_eq(set_fds(&read_fds, &write_fds, 1), 2);
+	ck_assert_int_eq(fds[0].fd, STDIN_FILENO);
+	ck_assert_int_eq(fds[0].events, POLLOUT);
+	ck_assert_int_eq(set_fds(fds, 1), 1);
 	ck_assert_int_eq(self_node_io_side.fd_direction, STDIN_FILENO);
+	ck_assert_int_eq(fds[0].fd, STDIN_FILENO);
+	ck_assert_int_eq(fds[0].events, POLLIN);
 
 	/* Make node 1 self node, which is a non terminal node */
 	memcpy(&self_node, &chosen_mb->node_array[1], sizeof(struct dgsh_node));
-	ck_assert_int_eq(set_fds(&read_fds, &write_fds, 0), 2);
+	ck_assert_int_eq(set_fds(fds, 0), 1);
 	ck_assert_int_eq(self_node_io_side.fd_direction, STDOUT_FILENO);
-	ck_assert_int_eq(set_fds(&read_fds, &write_fds, 1), 2);
+	ck_assert_int_eq(fds[0].fd, STDOUT_FILENO);
+	ck_assert_int_eq(set_fds(fds, 1), 2);
+	ck_assert_int_eq(fds[0].fd, STDIN_FILENO);
+	ck_assert_int_eq(fds[1].fd, STDOUT_FILENO);
+	ck_assert_int_eq(fds[1].events, POLLIN);
 }
 END_TEST
 
@@ -2812,6 +3338,28 @@ START_TEST(test_dgsh_negotiate)
 }
 END_TEST
 
+START_TEST(test_dgsh_negotiate_start)
+{
+	int *input_fds;
+	int n_input_fds = 0;
+	int *output_fds;
+	int n_output_fds = 0;
+	struct pollfd pfd;
+
+	pfd.fd = dgsh_negotiate_start(0, "test", &n_input_fds, &n_output_fds,
+				&input_fds, &output_fds);
+	ck_assert_int_ge(pfd.fd, 0);
+	ck_assert_int_eq(dgsh_negotiate_start(0, "test", &n_input_fds,
+				&n_output_fds, &input_fds, &output_fds), -1);
+	ck_assert_int_eq(errno, EALREADY);
+	pfd.events = POLLIN;
+	ck_assert_int_eq(poll(&pfd, 1, 5000), 1);
+	ck_assert_int_eq(dgsh_negotiate_finish(), 0);
+	ck_assert_int_eq(dgsh_negotiate_finish(), -1);
+	ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
 /* Suite conc */
 START_TEST(test_is_ready)
 {
@@ -2827,6 +3375,33 @@ START_TEST(test_is_ready)
 }
 END_TEST
 
+START_TEST(test_fan_out)
+{
+	nfd = 5;
+	chosen_mb->state = PS_NEGOTIATION;
+	ck_assert_int_eq(is_final(chosen_mb), false);
+	chosen_mb->state = PS_ERROR;
+	ck_assert_int_eq(is_final(chosen_mb), false);
+	chosen_mb->is_error_confirmed = true;
+	ck_assert_int_eq(is_final(chosen_mb), true);
+	chosen_mb->state = PS_RUN;
+	ck_assert_int_eq(is_final(chosen_mb), true);
+
+	/* All output ports not written to get the block */
+	ck_assert_int_eq(is_pending(chosen_mb), false);
+	fan_out(chosen_mb);
+	ck_assert(pi[0].to_write == NULL);
+	ck_assert(pi[1].to_write == chosen_mb);
+	ck_assert(pi[2].to_write == NULL);
+	ck_assert(pi[3].to_write == NULL);
+	ck_assert(pi[4].to_write == chosen_mb);
+	ck_assert_int_eq(is_pending(chosen_mb), true);
+
+	pi[1].to_write = pi[4].to_write = NULL;
+	ck_assert_int_eq(is_pending(chosen_mb), false);
+}
+END_TEST
+
 START_TEST (test_next_fd)
 {
 	multiple_inputs = true;
@@ -2924,8 +3499,24 @@ suite_connect(void)
 	TCase *tc_trw = tcase_create("test read/write fd");
 	tcase_add_checked_fixture(tc_trw, NULL, NULL);
 	tcase_add_test(tc_trw, test_read_write_fd);
+	tcase_add_test(tc_trw, test_read_write_fds);
 	suite_add_tcase(s, tc_trw);
 
+	TCase *tc_hps = tcase_create("hinted pipe size");
+	tcase_add_checked_fixture(tc_hps, NULL, NULL);
+	tcase_add_test(tc_hps, test_hinted_pipe_size);
+	suite_add_tcase(s, tc_hps);
+
+	TCase *tc_shm = tcase_create("shared-memory channel");
+	tcase_add_checked_fixture(tc_shm, NULL, NULL);
+	tcase_add_test(tc_shm, test_shm_channel);
+	suite_add_tcase(s, tc_shm);
+
+	TCase *tc_ctl = tcase_create("control socket");
+	tcase_add_checked_fixture(tc_ctl, NULL, NULL);
+	tcase_add_test(tc_ctl, test_control);
+	suite_add_tcase(s, tc_ctl);
+
 	TCase *tc_rif = tcase_create("read input fds");
 	tcase_add_checked_fixture(tc_rif, setup_test_read_input_fds,
 					  retire_test_read_input_fds);
@@ -2954,11 +3545,13 @@ suite_connect(void)
 	tcase_add_checked_fixture(tc_eic, setup_test_establish_io_connections,
 					  retire_test_establish_io_connections);
 	tcase_add_test(tc_eic, test_establish_io_connections);
+	tcase_add_test(tc_eic, test_establish_io_connections_async);
 	suite_add_tcase(s, tc_eic);
 
-	TCase *tc_anc = tcase_create("alloc node connections");
-	tcase_add_checked_fixture(tc_anc, NULL, NULL);
-	tcase_add_test(tc_anc, test_alloc_node_connections);
+	TCase *tc_anc = tcase_create("alloc solution edges");
+	tcase_add_checked_fixture(tc_anc, setup_test_alloc_solution_edges,
+				  retire_test_alloc_solution_edges);
+	tcase_add_test(tc_anc, test_alloc_solution_edges);
 	suite_add_tcase(s, tc_anc);
 
 	TCase *tc_sd = tcase_create("set dispatcher");
@@ -3012,6 +3605,24 @@ suite_solve(void)
 	tcase_add_test(tc_ssg, test_solve_graph);
 	suite_add_tcase(s, tc_ssg);
 
+	TCase *tc_sc = tcase_create("solution cache");
+	tcase_add_checked_fixture(tc_sc, setup_test_solve_graph,
+					  retire_test_solve_graph);
+	tcase_add_test(tc_sc, test_solution_cache);
+	suite_add_tcase(s, tc_sc);
+
+	TCase *tc_gf = tcase_create("graph file");
+	tcase_add_checked_fixture(tc_gf, setup_test_solve_graph,
+					  retire_test_solve_graph);
+	tcase_add_test(tc_gf, test_graph_file);
+	suite_add_tcase(s, tc_gf);
+
+	TCase *tc_tr = tcase_create("trace");
+	tcase_add_checked_fixture(tc_tr, setup_test_solve_graph,
+					  retire_test_solve_graph);
+	tcase_add_test(tc_tr, test_trace);
+	suite_add_tcase(s, tc_tr);
+
 	TCase *tc_ccf = tcase_create("calculate conc fds");
 	tcase_add_checked_fixture(tc_ccf, setup_test_calculate_conc_fds,
 					  retire_test_calculate_conc_fds);
@@ -3024,6 +3635,12 @@ suite_solve(void)
 	tcase_add_test(tc_fgs, test_free_graph_solution);
 	suite_add_tcase(s, tc_fgs);
 
+	TCase *tc_sd = tcase_create("solution depths");
+	tcase_add_checked_fixture(tc_sd, setup_test_free_graph_solution,
+					  retire_test_free_graph_solution);
+	tcase_add_test(tc_sd, test_solution_depths);
+	suite_add_tcase(s, tc_sd);
+
 	TCase *tc_nmc = tcase_create("node match constraints");
 	tcase_add_checked_fixture(tc_nmc, setup_test_node_match_constraints,
 					  retire_test_node_match_constraints);
@@ -3237,6 +3854,7 @@ suite_broadcast(void)
 	TCase *tc_sn = tcase_create("dgsh negotiate");
 	tcase_add_checked_fixture(tc_sn, setup, retire);
 	tcase_add_test(tc_sn, test_dgsh_negotiate);
+	tcase_add_test(tc_sn, test_dgsh_negotiate_start);
 	suite_add_tcase(s, tc_sn);
 
 	return s;
@@ -3248,6 +3866,7 @@ suite_conc(void)
 	Suite *s = suite_create("Concentrator");
 	TCase *tc_tn = tcase_create("test next_fd");
 	TCase *tc_ir = tcase_create("test is_ready");
+	TCase *tc_fo = tcase_create("fan out");
 	TCase *tc_si = tcase_create("set io");
 	TCase *tc_sich = tcase_create("set io channels");
 
@@ -3258,6 +3877,10 @@ suite_conc(void)
 			retire_test_is_ready);
 	tcase_add_test(tc_ir, test_is_ready);
 	suite_add_tcase(s, tc_ir);
+	tcase_add_checked_fixture(tc_fo, setup_test_is_ready,
+			retire_test_is_ready);
+	tcase_add_test(tc_fo, test_fan_out);
+	suite_add_tcase(s, tc_fo);
 	tcase_add_checked_fixture(tc_sich, setup_test_set_io_channels,
 					  retire_test_set_io_channels);
 	tcase_add_test(tc_sich, test_set_io_channels);
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Measure the time from a script's start until the first byte of its
+# output appears, with a cold and with a warm negotiation solution cache
+# (DGSH_CACHE)
+#
+#  Copyright 2026 Diomidis Spinellis
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+
+TOP=$(cd .. ; pwd)
+DGSH="$TOP/build/bin/dgsh"
+PATH="$TOP/build/bin:$PATH"
+export DGSHPATH="$TOP/build/libexec/dgsh"
+EXAMPLE="$TOP/example"
+
+# Number of measurements per configuration
+RUNS=${RUNS:-20}
+
+# Input for the examples that read their standard input
+INPUT=${INPUT:-$TOP/README.md}
+
+CACHE=$(mktemp -d /tmp/dgsh-cache.XXXXXX)
+trap 'rm -rf $CACHE' 0
+
+mkdir -p time
+
+# Output the number of seconds between starting the specified command
+# and receiving the first byte of its output
+first_byte()
+{
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		open(my $in, "-|", @ARGV) || die;
+		read($in, $c, 1);
+		printf("%.6f\n", time - $start);
+		1 while (read($in, $c, 65536));
+		close($in);' "$@" <$INPUT
+}
+
+# Report the mean and minimum of the times read from the standard input
+summarize()
+{
+	awk '{ sum += $1; if (NR == 1 || $1 < min) min = $1 }
+	END { printf("mean %.6f min %.6f n %d\n", sum / NR, min, NR) }'
+}
+
+for script in compress-compare.sh word-properties.sh text-properties.sh
+do
+	# Cold: every run starts with an empty cache
+	i=0
+	while [ $i -lt $RUNS ]
+	do
+		rm -rf $CACHE/*
+		DGSH_CACHE=$CACHE first_byte $DGSH $EXAMPLE/$script
+		i=$((i + 1))
+	done | summarize >time/cache:$script:cold
+
+	# Warm: the first run populates the cache
+	DGSH_CACHE=$CACHE first_byte $DGSH $EXAMPLE/$script >/dev/null
+	i=0
+	while [ $i -lt $RUNS ]
+	do
+		DGSH_CACHE=$CACHE first_byte $DGSH $EXAMPLE/$script
+		i=$((i + 1))
+	done | summarize >time/cache:$script:warm
+
+	echo "$script cold: $(cat time/cache:$script:cold)"
+	echo "$script warm: $(cat time/cache:$script:warm)"
+done
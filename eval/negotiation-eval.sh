@@ -0,0 +1,166 @@
+#!/bin/sh
+#
+# Measure how the negotiation scales with the size of synthetic dgsh
+# graphs of various shapes, whose tools process no data:
+# chain: a pipeline of N tools
+# wide: N tools between a scatter and a gather block
+# nested: scatter/gather blocks nested N levels deep
+# flexible: as wide, with tools having a flexible number of channels
+#
+# One line of comma-separated values is appended to time/negotiation.csv
+# for each run, so that results of different versions can be compared.
+# System calls are counted when strace(1) is available.
+#
+#  Copyright 2026 Diomidis Spinellis
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+
+TOP=$(cd .. ; pwd)
+DGSH="$TOP/build/bin/dgsh"
+PATH="$TOP/build/bin:$PATH"
+export DGSHPATH="$TOP/build/libexec/dgsh"
+
+# Number of measurements per configuration
+RUNS=${RUNS:-10}
+
+# Graph shapes and sizes to measure
+SHAPES=${SHAPES:-chain wide nested flexible}
+SIZES=${SIZES:-2 8 32 128}
+
+# Identify the measured version in the results
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+WORK=$(mktemp -d /tmp/dgsh-negotiation.XXXXXX)
+trap 'rm -rf $WORK' 0
+
+mkdir -p time
+RESULTS=time/negotiation.csv
+if ! [ -s $RESULTS ]
+then
+	echo 'version,shape,size,run,wall_s,processes,negotiate_mean_us,negotiate_max_us,messages_per_process,bytes_per_process,syscalls_per_process' >$RESULTS
+fi
+
+# Output a tool that copies nothing from its input to its output
+noop()
+{
+	echo 'sed d'
+}
+
+# Output a graph of N tools of the specified shape
+graph()
+{
+	local shape=$1 n=$2 i
+
+	case $shape in
+	chain)
+		echo "$(noop) </dev/null |"
+		i=2
+		while [ $i -lt $n ]
+		do
+			echo "$(noop) |"
+			i=$((i + 1))
+		done
+		echo "$(noop) >/dev/null"
+		;;
+	wide|flexible)
+		echo 'tee </dev/null |'
+		echo '{{'
+		i=0
+		while [ $i -lt $n ]
+		do
+			if [ $shape = wide ]
+			then
+				noop
+			else
+				echo tee
+			fi
+			i=$((i + 1))
+		done
+		echo '}} |'
+		echo 'cat >/dev/null'
+		;;
+	nested)
+		echo 'tee </dev/null |'
+		i=1
+		while [ $i -lt $n ]
+		do
+			echo '{{'
+			noop
+			echo 'tee |'
+			i=$((i + 1))
+		done
+		echo '{{'
+		noop
+		noop
+		echo '}} |'
+		i=1
+		while [ $i -lt $n ]
+		do
+			echo 'cat'
+			echo '}} |'
+			i=$((i + 1))
+		done
+		echo 'cat >/dev/null'
+		;;
+	esac
+}
+
+# Output the number of seconds the specified command takes to complete
+elapsed()
+{
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		system(@ARGV) == 0 || die;
+		printf("%.6f\n", time - $start);' "$@"
+}
+
+if command -v strace >/dev/null 2>&1
+then
+	STRACE=strace
+fi
+
+for shape in $SHAPES
+do
+	for size in $SIZES
+	do
+		graph $shape $size >$WORK/graph.sh
+		i=0
+		while [ $i -lt $RUNS ]
+		do
+			rm -rf $WORK/trace $WORK/strace
+			mkdir $WORK/trace
+			wall=$(DGSH_TRACE_DIR=$WORK/trace elapsed $DGSH $WORK/graph.sh)
+
+			# Count system calls in a separate run, to keep
+			# the strace overhead out of the measured times
+			if [ -n "$STRACE" ]
+			then
+				mkdir $WORK/strace
+				$STRACE -ff -qq -o $WORK/strace/strace \
+					$DGSH $WORK/graph.sh
+				stats=$(perl negotiation-stats.pl $WORK/trace \
+					$WORK/strace)
+			else
+				stats=$(perl negotiation-stats.pl $WORK/trace)
+			fi
+
+			echo "$VERSION,$shape,$size,$i,$wall,$stats"
+			i=$((i + 1))
+		done >>$RESULTS
+		echo "$shape $size: $(grep "^$VERSION,$shape,$size," $RESULTS |
+			awk -F, '{ sum += $7; if (NR == 1 || $7 < min) min = $7 }
+			END { printf("negotiation mean %.0f min %.0f us n %d\n",
+				sum / NR, min, NR) }')"
+	done
+done
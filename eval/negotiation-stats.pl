@@ -0,0 +1,77 @@
+#!/usr/bin/perl
+#
+# Summarize the negotiation traces (DGSH_TRACE_DIR) of a dgsh graph's run
+# and optionally the per-process system call logs (strace -ff) of the
+# same run as a comma-separated list of the following fields:
+# processes, mean and maximum negotiation time (us),
+# messages, bytes, and system calls per process.
+# Unavailable values are output as NA.
+#
+#  Copyright 2026 Diomidis Spinellis
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+
+use strict;
+use warnings;
+use JSON::PP;
+
+if ($#ARGV < 0 || $#ARGV > 1) {
+	print STDERR "usage: $0 trace-directory [strace-directory]\n";
+	exit 1;
+}
+my ($trace_dir, $strace_dir) = @ARGV;
+
+my $json = JSON::PP->new;
+my ($processes, $negotiate_sum, $negotiate_max, $messages, $bytes) =
+	(0, 0, 0, 0, 0);
+for my $name (glob("$trace_dir/dgsh-*.json")) {
+	open(my $in, '<', $name) || die "Unable to open $name: $!\n";
+	local $/;
+	my $trace = $json->decode(<$in>);
+	close($in);
+	$processes++;
+	for my $e (@$trace) {
+		next unless ($e->{ph} eq 'X');
+		if ($e->{name} eq 'negotiate') {
+			$negotiate_sum += $e->{dur};
+			$negotiate_max = $e->{dur} if ($e->{dur} > $negotiate_max);
+		} elsif ($e->{name} eq 'read' || $e->{name} eq 'write') {
+			$messages++;
+			$bytes += $e->{args}->{size};
+		}
+	}
+}
+
+# Each strace -ff output file holds one line per system call
+my $syscalls = 'NA';
+if (defined($strace_dir)) {
+	my ($n, $calls) = (0, 0);
+	for my $name (glob("$strace_dir/strace.*")) {
+		open(my $in, '<', $name) || die "Unable to open $name: $!\n";
+		while (<$in>) {
+			$calls++ unless (/^(\+\+\+|---)/);
+		}
+		close($in);
+		$n++;
+	}
+	$syscalls = sprintf('%.1f', $calls / $n) if ($n);
+}
+
+if ($processes == 0) {
+	print "0,NA,NA,NA,NA,$syscalls\n";
+	exit 0;
+}
+printf("%d,%.0f,%d,%.1f,%.0f,%s\n", $processes, $negotiate_sum / $processes,
+	$negotiate_max, $messages / $processes, $bytes / $processes,
+	$syscalls);
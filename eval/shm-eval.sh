@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Compare the throughput of shared-memory channels between dgsh-tee
+# instances against that of pipes (DGSH_SHM=0), with 1 KB and 1 MB
+# transfers
+#
+#  Copyright 2026 Diomidis Spinellis
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+
+TOP=$(cd .. ; pwd)
+DGSH="$TOP/build/bin/dgsh"
+PATH="$TOP/build/bin:$PATH"
+export DGSHPATH="$TOP/build/libexec/dgsh"
+
+# Number of measurements per configuration
+RUNS=${RUNS:-10}
+
+# Data volume in MB passed through the channels
+VOLUME=${VOLUME:-1024}
+
+mkdir -p time
+
+# Output the number of seconds the specified command takes to complete
+elapsed()
+{
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		system(@ARGV) == 0 || die;
+		printf("%.6f\n", time - $start);' "$@"
+}
+
+# Report the mean and minimum of the times read from the standard input
+summarize()
+{
+	awk '{ sum += $1; if (NR == 1 || $1 < min) min = $1 }
+	END { printf("mean %.6f min %.6f n %d\n", sum / NR, min, NR) }'
+}
+
+for transfer in 1k 1M
+do
+	# The channel between the two dgsh-tee instances is the one measured
+	script="dd if=/dev/zero bs=1M count=$VOLUME 2>/dev/null |
+		dgsh-tee -b $transfer |
+		dgsh-tee -b $transfer |
+		cat >/dev/null"
+
+	for shm in 0 1
+	do
+		i=0
+		while [ $i -lt $RUNS ]
+		do
+			DGSH_SHM=$shm elapsed $DGSH -c "$script"
+			i=$((i + 1))
+		done | summarize >time/shm:$transfer:$shm
+	done
+
+	echo "$transfer pipe: $(cat time/shm:$transfer:0)"
+	echo "$transfer shared memory: $(cat time/shm:$transfer:1)"
+done
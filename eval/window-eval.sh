@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Measure how well dgsh-writeval keeps up with a high-rate stream
+# over which it maintains a time window.
+# The stream is fed at RATE MB/s for DURATION seconds into a store
+# keeping the last WINDOW seconds of the stream.
+# Note that the store keeps RATE * min(DURATION, WINDOW) MB in memory.
+#
+#  Copyright 2026 Diomidis Spinellis
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+
+TOP=$(cd .. ; pwd)
+PATH="$TOP/build/bin:$TOP/build/libexec/dgsh:$PATH"
+
+# Input rate in MB/s
+RATE=${RATE:-1024}
+
+# Input duration in seconds
+DURATION=${DURATION:-10}
+
+# Time window kept by the store in seconds
+WINDOW=${WINDOW:-60}
+
+# Number of measurements
+RUNS=${RUNS:-3}
+
+SOCKET=$(mktemp -u /tmp/dgsh-window.XXXXXX)
+
+mkdir -p time
+
+# Output 1 MB blocks of 64-byte lines at the specified rate and duration
+feed()
+{
+	perl -MTime::HiRes=time,sleep -e '
+		($rate, $duration) = @ARGV;
+		$block = ("x" x 63 . "\n") x 16384;
+		$start = time;
+		for ($i = 0; $i < $rate * $duration; $i++) {
+			syswrite(STDOUT, $block) == length($block) || die;
+			$ahead = $start + ($i + 1) / $rate - time;
+			sleep($ahead) if ($ahead > 0);
+		}' $RATE $DURATION
+}
+
+i=0
+while [ $i -lt $RUNS ]
+do
+	start=$(perl -MTime::HiRes=time -e 'printf("%.6f\n", time)')
+	feed | dgsh-writeval -u s -b $WINDOW -s $SOCKET &
+	pid=$!
+
+	# Wait for the store to read all its input
+	dgsh-readval -x -l -s $SOCKET >/dev/null
+	end=$(perl -MTime::HiRes=time -e 'printf("%.6f\n", time)')
+
+	# Obtain the store's user and system CPU time
+	if [ -r /proc/$pid/stat ]
+	then
+		cpu=$(awk -v tck=$(getconf CLK_TCK) \
+			'{ printf("%.2f\n", ($14 + $15) / tck) }' /proc/$pid/stat)
+	else
+		cpu=NA
+	fi
+	dgsh-readval -x -q -s $SOCKET
+	wait
+
+	echo "$start $end $cpu" |
+	awk -v volume=$((RATE * DURATION)) '{
+		elapsed = $2 - $1
+		printf("elapsed %.3f s rate %.0f MB/s cpu %s s\n",
+			elapsed, volume / elapsed, $3)
+	}'
+	i=$((i + 1))
+done | tee time/window:$RATE:$DURATION:$WINDOW
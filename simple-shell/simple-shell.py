@@ -4,6 +4,7 @@ from socket import socketpair, AF_UNIX, SOCK_DGRAM
 from os import pipe, fork, close, execlp, dup, dup2, \
         open as osopen, O_WRONLY, O_CREAT, environ
 from collections import OrderedDict
+from hashlib import md5
 import re
 
 prefix = '/usr/local/dgsh/bin'
@@ -112,6 +113,8 @@ except IndexError:
   exit(1)
 with open(dgshGraph, 'r') as f:
   lines = f.readlines()
+# Identifies the graph's shape to the processes (see DGSH_GRAPH)
+graphId = md5(prefix + '\n' + ''.join(lines)).hexdigest()
 
 toolDefsEnd = 0
 for index, line in enumerate(lines):
@@ -181,6 +184,8 @@ for index, process in Process.processes.iteritems():
   pid = fork()
   if pid:
     debug("%s: inputConnectors: %d\n" % (process.command, len(process.inputConnectors)))
+    environ["DGSH_GRAPH_ID"] = graphId
+    environ["DGSH_POSITION"] = str(index)
     if process.inputConnectors:
         environ["DGSH_IN"] = "1"
     else: